@@ -56,6 +56,18 @@ int wasmato_irq_create_ioapic(uint32_t irq);
 __attribute__((import_module("wasmato"), import_name("irq_unmask"))) 
 void wasmato_irq_unmask(int fd);
 
+__attribute__((import_module("wasmato"), import_name("event_create")))
+int wasmato_event_create(void);
+
+__attribute__((import_module("wasmato"), import_name("event_wait")))
+int wasmato_event_wait(int fd, int64_t timeout_ns);
+
+__attribute__((import_module("wasmato"), import_name("event_signal")))
+int wasmato_event_signal(int fd, uint32_t count);
+
+__attribute__((import_module("wasmato"), import_name("event_reset")))
+int wasmato_event_reset(int fd);
+
 uacpi_status uacpi_kernel_get_rsdp(uacpi_phys_addr* out_rsdp_address) {
     uint64_t rsdp = wasmato_acpi_get_rsdp();
     if (rsdp == -1) {
@@ -301,88 +313,34 @@ void uacpi_kernel_release_mutex(uacpi_handle handle) {
     mutex_unlock(handle);
 }
 
-typedef struct {
-    pthread_mutex_t mutex;
-    pthread_cond_t condvar;
-    size_t counter;
-} event_t;
+// events are kept by the runtime, the handle is the fd plus one
+// so a valid handle is never null
+#define EVENT_FD(handle) ((int)(uintptr_t)(handle) - 1)
 
 uacpi_handle uacpi_kernel_create_event(void) {
-    event_t* event = calloc(1, sizeof(*event));
-    if (event == nullptr) return nullptr;
-
-    mutex_init(&event->mutex);
-    condvar_init(&event->condvar);
-    return event;
+    int fd = wasmato_event_create();
+    if (fd < 0) return nullptr;
+    return (uacpi_handle)(uintptr_t)(fd + 1);
 }
 
 void uacpi_kernel_free_event(uacpi_handle handle) {
-    event_t* event = handle;
-    condvar_free(&event->condvar);
-    mutex_free(&event->mutex);
-    free(handle);
-}
-
-static bool event_pred(void *ptr) {
-    event_t* event = ptr;
-    return event->counter != 0;
+    close(EVENT_FD(handle));
 }
 
 uacpi_bool uacpi_kernel_wait_for_event(uacpi_handle handle, uacpi_u16 timeout) {
-    event_t* event = handle;
-
-    mutex_lock(&event->mutex);
-
-    if (event->counter > 0) {
-        event->counter -= 1;
-        mutex_unlock(&event->mutex);
-        return UACPI_TRUE;
-    }
-
-    if (timeout == 0) {
-        mutex_unlock(&event->mutex);
-        return UACPI_FALSE;
-    }
-
-    if (timeout == 0xFFFF) {
-        condvar_wait(&event->condvar, &event->mutex, event_pred, event);
-
-        event->counter -= 1;
-        mutex_unlock(&event->mutex);
-        return UACPI_TRUE;
-    }
-
-    bool ok = condvar_wait_timeout(
-        &event->condvar, &event->mutex, 
-        event_pred, event, 
-        timeout * 1000000ull
-    );
-    if (ok)
-        event->counter -= 1;
+    int64_t timeout_ns = -1;
+    if (timeout != 0xFFFF)
+        timeout_ns = timeout * 1000000ll;
 
-    mutex_unlock(&event->mutex);
-    return ok ? UACPI_TRUE : UACPI_FALSE;
+    return wasmato_event_wait(EVENT_FD(handle), timeout_ns) == 0 ? UACPI_TRUE : UACPI_FALSE;
 }
 
 void uacpi_kernel_signal_event(uacpi_handle handle) {
-    event_t* event = handle;
-
-    mutex_lock(&event->mutex);
-
-    event->counter += 1;
-    condvar_signal(&event->condvar);
-
-    mutex_unlock(&event->mutex);
+    wasmato_event_signal(EVENT_FD(handle), 1);
 }
 
 void uacpi_kernel_reset_event(uacpi_handle handle) {
-    event_t* event = handle;
-
-    mutex_lock(&event->mutex);
-
-    event->counter = 0;
-
-    mutex_unlock(&event->mutex);
+    wasmato_event_reset(EVENT_FD(handle));
 }
 
 uacpi_status uacpi_kernel_handle_firmware_request(uacpi_firmware_request *req) {
@@ -214,6 +214,8 @@ typedef union {
 
 #define MSR_IA32_TSC_DEADLINE 0x6E0
 
+#define MSR_IA32_XSS 0xDA0
+
 static inline INTRIN_ATTR void __wrmsr(uint32_t index, uint64_t value) {
     uint32_t low_data = value;
     uint32_t high_data = value >> 32;
@@ -119,3 +119,15 @@ typedef struct xsave_legacy_region {
     uint8_t _reserved11[96];
 } xsave_legacy_region_t;
 STATIC_ASSERT(sizeof(xsave_legacy_region_t) == 512);
+
+typedef struct xsave_header {
+    uint64_t xstate_bv;
+    uint64_t xcomp_bv;
+    uint64_t _reserved[6];
+} xsave_header_t;
+STATIC_ASSERT(sizeof(xsave_header_t) == 64);
+
+/**
+ * Set in xcomp_bv for an area in the compacted format
+ */
+#define XSAVE_XCOMP_BV_COMPACTED BIT63
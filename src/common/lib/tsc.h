@@ -28,6 +28,20 @@ static inline uint64_t ns_to_tsc(uint64_t ns) { return (ns * g_tsc_freq_hz) / NS
 static inline uint64_t us_to_tsc(uint64_t ns) { return (ns * g_tsc_freq_hz) / US_PER_S; }
 static inline uint64_t ms_to_tsc(uint64_t ns) { return (ns * g_tsc_freq_hz) / MS_PER_S; }
 
+//
+// NOTE: tsc values do get large, and we can't do a 128bit division
+//       in the kernel, so split it into whole seconds and the rest
+//
+
+static inline uint64_t tsc_to_unit(uint64_t tsc, uint64_t unit) {
+    uint64_t freq = g_tsc_freq_hz;
+    return (tsc / freq) * unit + ((tsc % freq) * unit) / freq;
+}
+
+static inline uint64_t tsc_to_ns(uint64_t tsc) { return tsc_to_unit(tsc, NS_PER_S); }
+static inline uint64_t tsc_to_us(uint64_t tsc) { return tsc_to_unit(tsc, US_PER_S); }
+static inline uint64_t tsc_to_ms(uint64_t tsc) { return tsc_to_unit(tsc, MS_PER_S); }
+
 #else
 
 static inline uint64_t ns_to_tsc(uint64_t ns) { return (ns * (unsigned __int128)g_tsc_freq_hz) / NS_PER_S; }
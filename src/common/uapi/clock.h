@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+/**
+ * The fraction bits of the tsc to nanoseconds multiplier
+ */
+#define CLOCK_MULT_SHIFT    32
+
+/**
+ * The parameters to turn a tsc value into time, the time at a tsc is
+ * base_ns + (((tsc - tsc_base) * mult) >> CLOCK_MULT_SHIFT)
+ */
+typedef struct clock_params {
+    /**
+     * The tsc at which the bases were taken
+     */
+    uint64_t tsc_base;
+
+    /**
+     * The monotonic time and the wall clock time,
+     * in nanoseconds, at the base tsc
+     */
+    uint64_t monotonic_base_ns;
+    uint64_t realtime_base_ns;
+
+    /**
+     * Nanoseconds per tsc tick, as a fixed point number
+     */
+    uint64_t mult;
+
+    /**
+     * The current estimation of the tsc frequency
+     */
+    uint64_t tsc_freq_hz;
+} clock_params_t;
+
+/**
+ * The timekeeping page, mapped read-only into the user and updated by
+ * the kernel as calibration is refined, the sequence is odd while the
+ * kernel is updating the parameters, so readers retry until they get
+ * the same even sequence before and after reading them
+ */
+typedef struct clock_page {
+    _Atomic(uint32_t) seq;
+    uint32_t reserved;
+    clock_params_t params;
+} clock_page_t;
+
+/**
+ * Take a consistent snapshot of the clock parameters
+ */
+static inline void clock_page_read(const clock_page_t* page, clock_params_t* params) {
+    uint32_t seq;
+    do {
+        seq = atomic_load_explicit(&page->seq, memory_order_acquire);
+        *params = page->params;
+        atomic_thread_fence(memory_order_acquire);
+    } while ((seq & 1) != 0 || seq != atomic_load_explicit(&page->seq, memory_order_relaxed));
+}
+
+/**
+ * Turn a tsc value into nanoseconds since the given base
+ */
+static inline uint64_t clock_params_tsc_to_ns(const clock_params_t* params, uint64_t base_ns, uint64_t tsc) {
+    if (tsc < params->tsc_base) {
+        return base_ns - (uint64_t)(((params->tsc_base - tsc) * (unsigned __int128)params->mult) >> CLOCK_MULT_SHIFT);
+    }
+    return base_ns + (uint64_t)(((tsc - params->tsc_base) * (unsigned __int128)params->mult) >> CLOCK_MULT_SHIFT);
+}
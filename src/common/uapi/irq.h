@@ -0,0 +1,100 @@
+#pragma once
+
+#include <stdint.h>
+
+/**
+ * Pass as the cpu of a new interrupt, or when changing its affinity, to let the
+ * kernel pick the least loaded cpu, such interrupts are also moved around by the
+ * kernel as the interrupt rates of the cpus change
+ */
+#define IRQ_CPU_ANY     UINT32_MAX
+
+/**
+ * How the kernel acknowledges an interrupt
+ */
+typedef enum irq_mode : uint32_t {
+    /**
+     * The line is masked when the interrupt fires and stays
+     * masked until the user unmasks it, the default
+     */
+    IRQ_MODE_MASK,
+
+    /**
+     * The line stays unmasked, interrupts that fire before the previous one
+     * was handled are only counted, for MSIs and edge triggered lines
+     */
+    IRQ_MODE_AUTO_ACK,
+} irq_mode_t;
+
+/**
+ * The result of changing the affinity of an interrupt
+ */
+typedef enum irq_affinity_status : uint32_t {
+    /**
+     * The interrupt was moved, an MSI still has to be
+     * reprogrammed with the new message
+     */
+    IRQ_AFFINITY_SUCCESS,
+
+    /**
+     * There was no free vector on the cpu, or no cpu to pick
+     * for IRQ_CPU_ANY, trying again later might work
+     */
+    IRQ_AFFINITY_NO_SPACE,
+
+    /**
+     * The interrupt can't be moved at all, an io-apic line in
+     * IRQ_MODE_AUTO_ACK is never masked so it can't be pointed
+     * at another cpu without losing an edge
+     */
+    IRQ_AFFINITY_NOT_SUPPORTED,
+} irq_affinity_status_t;
+
+/**
+ * The amount of buckets in the latency histogram of an interrupt, bucket 0
+ * counts wakeups under 1us, bucket i counts wakeups between 2^(i-1)us and
+ * 2^i us, and the last bucket counts everything above
+ */
+#define IRQ_LATENCY_BUCKETS     16
+
+/**
+ * The message a device writes to raise a message signaled interrupt, the
+ * driver programs it into the MSI capability or into an MSI-X table entry
+ */
+typedef struct msi_message {
+    uint64_t address;
+    uint32_t data;
+    uint32_t reserved;
+} msi_message_t;
+
+/**
+ * Statistics of a single interrupt object
+ */
+typedef struct irq_stats {
+    /**
+     * The amount of times the interrupt fired
+     */
+    uint64_t count;
+
+    /**
+     * The cpu and vector the interrupt is delivered to
+     */
+    uint32_t cpu;
+    uint8_t vector;
+
+    /**
+     * Whether the kernel picks the cpu of the interrupt
+     */
+    uint8_t balanced;
+
+    /**
+     * How the interrupt is acknowledged
+     */
+    uint8_t mode;
+
+    /**
+     * Histogram of the time from the interrupt coming in until
+     * the thread it woke with an irq wait ran
+     */
+    uint64_t latency[IRQ_LATENCY_BUCKETS];
+} irq_stats_t;
@@ -22,3 +22,32 @@ typedef enum mapping_protection : uint8_t {
     MAPPING_PROTECTION_RX,
 } mapping_protection_t;
 
+
+/**
+ * The granularity of the accessible size in the memory control
+ * word, matches the wasm page size
+ */
+#define MEM_CONTROL_UNIT    0x10000
+
+/**
+ * The control word of a memory region, updated atomically by the user, the
+ * kernel will lazily grow the bump of the region on access up to the
+ * accessible size, any access above it is a fault, the kernel gives each
+ * region its own page for the word when it is reserved, which starts out as
+ * zero, and frees it together with the region
+ */
+typedef union mem_control {
+    struct {
+        /**
+         * The accessible size, in MEM_CONTROL_UNIT units
+         */
+        uint32_t accessible;
+
+        /**
+         * The max accessible size, in MEM_CONTROL_UNIT units,
+         * only used by the user
+         */
+        uint32_t max;
+    };
+    uint64_t packed;
+} mem_control_t;
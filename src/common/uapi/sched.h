@@ -0,0 +1,314 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The scheduling class of a thread, a runnable thread of a higher
+ * class always runs before threads of a lower class
+ */
+typedef enum sched_class : uint8_t {
+    /**
+     * Normal threads, sharing the cpu round-robin
+     */
+    SCHED_CLASS_NORMAL,
+
+    /**
+     * Real-time threads, ordered by priority and preempting
+     * lower priority threads as soon as they wake up
+     */
+    SCHED_CLASS_REALTIME,
+
+    /**
+     * Only runs when there is nothing else to run
+     */
+    SCHED_CLASS_IDLE,
+} sched_class_t;
+
+/**
+ * The amount of real-time priorities, higher priorities run first
+ */
+#define SCHED_RT_PRIORITY_COUNT         32
+
+/**
+ * The amount of normal priorities, higher priorities get more of the cpu
+ */
+#define SCHED_NORMAL_PRIORITY_COUNT     40
+#define SCHED_NORMAL_PRIORITY_DEFAULT   20
+
+/**
+ * The weight of a normal priority thread and of a default scheduling group,
+ * normal threads share the cpu in proportion to their weight
+ */
+#define SCHED_WEIGHT_DEFAULT            1024
+#define SCHED_WEIGHT_MAX                (1024 * 1024)
+
+/**
+ * The range of the time slice of a class
+ */
+#define SCHED_SLICE_MIN_US              100
+#define SCHED_SLICE_MAX_US              1000000
+
+/**
+ * The scheduling parameters of a thread
+ */
+typedef struct sched_param {
+    sched_class_t sched_class;
+    uint8_t priority;
+} sched_param_t;
+
+/**
+ * The amount of buckets in the wakeup latency histogram, bucket 0 counts
+ * wakeups under 1us, bucket i counts wakeups between 2^(i-1)us and 2^i us,
+ * and the last bucket counts everything above
+ */
+#define SCHED_WAKEUP_LATENCY_BUCKETS    16
+
+/**
+ * Scheduler statistics of a single core
+ */
+typedef struct sched_stats {
+    /**
+     * The amount of threads waiting in the run queue
+     */
+    uint64_t nr_queued;
+
+    /**
+     * Threads that were pulled into this core from another core
+     */
+    uint64_t migrations;
+
+    /**
+     * Threads that were stolen by this core while it was idle,
+     * these are also counted as migrations
+     */
+    uint64_t steals;
+
+    /**
+     * The amount of times the periodic balancing found
+     * this core to be less loaded than another core
+     */
+    uint64_t imbalances;
+
+    /**
+     * Threads woken up by other cores into this core
+     */
+    uint64_t remote_wakeups;
+
+    /**
+     * Woken up threads that took over the cpu directly from
+     * their waker, without going through the run queue
+     */
+    uint64_t handoffs;
+
+    /**
+     * Histogram of the time from a notify until the woken
+     * thread first ran on this core
+     */
+    uint64_t wakeup_latency[SCHED_WAKEUP_LATENCY_BUCKETS];
+
+    /**
+     * The amount of timer interrupts taken by the core
+     */
+    uint64_t timer_interrupts;
+
+    /**
+     * The amount of times the timer hardware was programmed, and the
+     * amount of times it was skipped since the deadline did not change
+     */
+    uint64_t timer_writes;
+    uint64_t timer_skipped_writes;
+
+    /**
+     * The amount of timers that fired, timers sharing an interrupt
+     * make this larger than the amount of timer interrupts
+     */
+    uint64_t timer_expired;
+
+    /**
+     * The amount of times the core went idle, and
+     * the total time it spent idle
+     */
+    uint64_t idle_entries;
+    uint64_t idle_us;
+
+    /**
+     * Wakeups of the idle core that only needed a store to the
+     * word it waits on with mwait, instead of an ipi
+     */
+    uint64_t idle_store_wakeups;
+} sched_stats_t;
+
+/**
+ * The max amount of cpus an affinity mask can describe
+ */
+#define CPU_MASK_MAX_CPUS               256
+
+/**
+ * A set of cpus, bit n stands for cpu n
+ */
+typedef struct cpu_mask {
+    uint64_t bits[CPU_MASK_MAX_CPUS / 64];
+} cpu_mask_t;
+
+static inline void cpu_mask_set(cpu_mask_t* mask, size_t cpu) {
+    if (cpu < CPU_MASK_MAX_CPUS) {
+        mask->bits[cpu / 64] |= 1ull << (cpu % 64);
+    }
+}
+
+static inline bool cpu_mask_test(const cpu_mask_t* mask, size_t cpu) {
+    return cpu < CPU_MASK_MAX_CPUS && (mask->bits[cpu / 64] & (1ull << (cpu % 64))) != 0;
+}
+
+/**
+ * The amount of user threads that get a slot in the run page,
+ * threads created beyond that get no slot
+ */
+#define THREAD_RUN_SLOTS                1024
+#define THREAD_RUN_SLOT_NONE            UINT32_MAX
+
+/**
+ * Tells which user threads are on a cpu right now, mapped read-only into the
+ * user, the slot of a thread holds the cpu it runs on plus one while it is
+ * on a cpu and zero while it is not. The running thread finds its own slot
+ * with rdpid, the kernel loads the TSC_AUX with it whenever it switches in.
+ *
+ * This is only a hint for deciding whether to spin, a slot is given to another
+ * thread once its thread exits, so an owner read earlier may be stale.
+ */
+typedef struct thread_run_page {
+    _Atomic(uint32_t) on_cpu[THREAD_RUN_SLOTS];
+} thread_run_page_t;
+
+/**
+ * How the scheduler picks the core a thread with a home core wakes up on
+ */
+typedef enum sched_placement : uint8_t {
+    /**
+     * The home core is only where the thread starts, after that it wakes
+     * on its previous core if it is idle, otherwise on any idle core,
+     * otherwise next to the thread that woke it up
+     */
+    SCHED_PLACEMENT_DEFAULT,
+
+    /**
+     * Always wake on the home core, for threads that share a lot of
+     * data, idle cores can still steal the thread from it
+     */
+    SCHED_PLACEMENT_HOME,
+
+    /**
+     * Wake on the home core if it is idle, otherwise on any idle core,
+     * otherwise on the least loaded core, never next to the waker just
+     * because it woke the thread up
+     */
+    SCHED_PLACEMENT_SPREAD,
+} sched_placement_t;
+
+/**
+ * Which of the thread creation parameters are given, anything
+ * that is not given is inherited from the creating thread
+ */
+typedef enum thread_create_flags : uint32_t {
+    THREAD_CREATE_SCHED_PARAM   = 1 << 0,
+    THREAD_CREATE_GROUP         = 1 << 1,
+    THREAD_CREATE_AFFINITY      = 1 << 2,
+    THREAD_CREATE_CPU_HINT      = 1 << 3,
+} thread_create_flags_t;
+
+/**
+ * The parameters of a new thread
+ */
+typedef struct thread_create_params {
+    thread_create_flags_t flags;
+
+    /**
+     * The scheduling parameters
+     */
+    sched_param_t sched_param;
+
+    /**
+     * The home cpu of the thread, where it starts if the affinity allows
+     * it, and how the thread is placed relative to it when it wakes up,
+     * when not given the thread goes wherever the scheduler likes
+     */
+    uint32_t cpu_hint;
+    sched_placement_t placement;
+
+    /**
+     * The handle of the scheduling group
+     */
+    uint64_t group;
+
+    /**
+     * The cpus the thread is allowed to run on
+     */
+    cpu_mask_t affinity;
+} thread_create_params_t;
+
+/**
+ * Where the time of a thread went, or of all the threads of a group
+ */
+typedef struct cpu_time_stats {
+    /**
+     * Time running in usermode, and in the kernel on behalf of the thread
+     */
+    uint64_t user_ns;
+    uint64_t kernel_ns;
+
+    /**
+     * Time spent handling interrupts that came in while the thread
+     * was running, not counted in the user or kernel time
+     */
+    uint64_t irq_ns;
+
+    /**
+     * Time runnable but waiting for a cpu
+     */
+    uint64_t wait_ns;
+
+    /**
+     * Time parked until woken up
+     */
+    uint64_t blocked_ns;
+} cpu_time_stats_t;
+
+/**
+ * Statistics of a scheduling group, the cpu share of the group is
+ * its runtime divided by the time since it was created
+ */
+typedef struct sched_group_stats {
+    /**
+     * The cpu time used by all the threads of the group
+     */
+    uint64_t runtime_us;
+
+    /**
+     * The time since the group was created
+     */
+    uint64_t elapsed_us;
+
+    /**
+     * The weight of the group
+     */
+    uint32_t weight;
+
+    /**
+     * The amount of live threads in the group
+     */
+    uint32_t nr_threads;
+
+    /**
+     * The amount of threads in the group that are not blocked
+     */
+    uint32_t nr_runnable;
+
+    /**
+     * Where the time of the threads of the group went, threads add
+     * their time when they leave the cpu
+     */
+    cpu_time_stats_t cpu_time;
+} sched_group_stats_t;
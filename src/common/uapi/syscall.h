@@ -16,6 +16,7 @@ typedef enum syscall {
 	SYSCALL_MEM_MAP_PHYS,
 	SYSCALL_MEM_UNMAP_PHYS,
     SYSCALL_MEM_FREE,
+    SYSCALL_MEM_FREE_INITRD,
 
 	SYSCALL_JIT_ALLOC,
 	SYSCALL_JIT_LOCK_PROTECTION,
@@ -24,18 +25,41 @@ typedef enum syscall {
 	SYSCALL_THREAD_CREATE,
 	SYSCALL_THREAD_EXIT,
 	SYSCALL_THREAD_YIELD,
+	SYSCALL_THREAD_SET_SCHED,
+	SYSCALL_THREAD_SET_AFFINITY,
+	SYSCALL_THREAD_GET_AFFINITY,
+	SYSCALL_THREAD_GET_CPU_TIME,
+	SYSCALL_SCHED_GET_CPU_COUNT,
+	SYSCALL_SCHED_GET_STATS,
+	SYSCALL_SCHED_SET_SLICE,
+	SYSCALL_SCHED_GROUP_CREATE,
+	SYSCALL_SCHED_GROUP_SET_WEIGHT,
+	SYSCALL_SCHED_GROUP_GET_STATS,
+	SYSCALL_STACK_CACHE_SET_LIMIT,
 
 	SYSCALL_ATOMIC_WAIT,
 	SYSCALL_ATOMIC_NOTIFY,
+	SYSCALL_ATOMIC_NOTIFY_WAIT,
+	SYSCALL_ATOMIC_REQUEUE,
+	SYSCALL_WAIT_SET_CREATE,
+	SYSCALL_WAIT_SET_ADD,
+	SYSCALL_WAIT_SET_REMOVE,
+	SYSCALL_WAIT_SET_WAIT,
 
 	SYSCALL_HANDLE_CLOSE,
 
 	SYSCALL_IRQ_CREATE_IOAPIC,
+	SYSCALL_IRQ_CREATE_MSI,
 	SYSCALL_IRQ_UNMASK,
+	SYSCALL_IRQ_GET_STATS,
+	SYSCALL_IRQ_SET_AFFINITY,
+	SYSCALL_IRQ_SET_MODE,
+	SYSCALL_IRQ_WAIT,
 
 	SYSCALL_EARLY_GET_INITRD_SIZE,
-	SYSCALL_EARLY_GET_INITRD,
-	SYSCALL_EARLY_GET_TSC_FREQ,
+	SYSCALL_EARLY_MAP_INITRD,
+	SYSCALL_EARLY_MAP_CLOCK_PAGE,
+	SYSCALL_EARLY_MAP_THREAD_RUN_PAGE,
 	SYSCALL_EARLY_GET_RSDP,
 	SYSCALL_EARLY_DONE,
 } syscall_t;
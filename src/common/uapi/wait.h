@@ -11,18 +11,79 @@ typedef enum wait_status {
     WAIT_STATUS_SUCCESS,
     WAIT_STATUS_NOT_EQUAL,
     WAIT_STATUS_OUT_OF_MEMORY,
+    WAIT_STATUS_BUSY,
 } wait_status_t;
 
 typedef struct wait_entry {
     void* key;
     uint64_t old;
     uint64_t mask;
+
+    /**
+     * A bit the kernel keeps set in the key for as long as anyone waits
+     * with this entry, it is ignored when comparing against old, so the
+     * notifier can skip the syscall when it sees the bit clear, 0 for none
+     */
+    uint64_t waiters_bit;
+
     wait_key_size_t key_size;
     uint32_t user_data;
 } wait_entry_t;
 
+typedef struct notify_wait_params {
+    /**
+     * The key to notify with its mask, and the max amount of
+     * threads to wake, 0 for all
+     */
+    void* notify_key;
+    uint64_t notify_mask;
+    uint64_t notify_count;
+
+    /**
+     * The key to wait on after the notify
+     */
+    wait_entry_t wait;
+} notify_wait_params_t;
+
+typedef struct requeue_params {
+    /**
+     * The key to wake threads from, nothing happens unless
+     * it still holds the expected value
+     */
+    wait_entry_t compare;
+
+    /**
+     * The max amount of threads to wake
+     */
+    uint64_t wake_count;
+
+    /**
+     * The key to move the rest of the threads to, and
+     * the max amount of threads to move
+     */
+    void* requeue_key;
+    uint64_t requeue_count;
+
+    /**
+     * The waiters bit of the moved threads on the 32bit requeue key
+     */
+    uint64_t requeue_waiters_bit;
+} requeue_params_t;
+
+/**
+ * The max amount of ready keys a single wait on a wait set returns
+ */
+#define WAIT_SET_MAX_READY 32
+
 typedef struct wake_params {
     void* key;
     uint64_t mask;
+
+    /**
+     * The waiters bit the waiters on the key set, the kernel only notifies
+     * the key when it sees the bit set, 0 to always notify
+     */
+    uint64_t waiters_bit;
+
     wait_key_size_t key_size;
 } wake_params_t;
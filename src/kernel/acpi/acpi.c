@@ -9,14 +9,15 @@
 #include "mem/phys_map.h"
 
 /**
- * The frequency of the acpi timer
+ * The timer port, kept after init so the tsc
+ * calibration can be refined after boot
  */
-#define ACPI_TIMER_FREQUENCY  3579545
+LATE_RO static uint16_t m_acpi_timer_port;
 
 /**
- * The timer port
+ * The CMOS index of the RTC century register, zero if there is none
  */
-INIT_DATA static uint16_t m_acpi_timer_port;
+INIT_DATA static uint8_t m_acpi_century_register;
 
 INIT_CODE static err_t validate_acpi_table(acpi_description_header_t* header) {
     err_t err = NO_ERROR;
@@ -166,10 +167,16 @@ INIT_CODE err_t init_acpi_tables() {
     CHECK(facp->pm_tmr_len == 4);
     m_acpi_timer_port = facp->pm_tmr_blk;
 
+    m_acpi_century_register = facp->century;
+
 cleanup:
     return err;
 }
 
-INIT_CODE uint32_t acpi_get_timer_tick() {
+uint32_t acpi_get_timer_tick() {
     return __indword(m_acpi_timer_port);
 }
+
+INIT_CODE uint8_t acpi_get_century_register(void) {
+    return m_acpi_century_register;
+}
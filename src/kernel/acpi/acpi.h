@@ -4,6 +4,11 @@
 
 #include "lib/except.h"
 
+/**
+ * The frequency of the acpi timer
+ */
+#define ACPI_TIMER_FREQUENCY  3579545
+
 /**
  * Initialize the early acpi subsystem, should just be enough for
  * doing whatever we need to do
@@ -11,6 +16,12 @@
 err_t INIT_CODE init_acpi_tables(void);
 
 /**
- * Get the ACPI PM Timer tick value
+ * Get the ACPI PM Timer tick value, the timer may only be 24 bits wide
+ */
+uint32_t acpi_get_timer_tick(void);
+
+/**
+ * Get the CMOS index of the RTC century register from the FADT,
+ * zero if the platform does not have one
  */
-uint32_t INIT_CODE acpi_get_timer_tick(void);
+INIT_CODE uint8_t acpi_get_century_register(void);
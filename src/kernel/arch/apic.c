@@ -337,6 +337,16 @@ static void lapic_send_ipi(uint32_t icr_low, uint32_t apic_id) {
     }
 }
 
+void lapic_send_ipi_to(uint8_t vector, uint32_t apic_id) {
+    LOCAL_APIC_ICR_LOW icr_low = {
+        .delivery_mode = LOCAL_APIC_DELIVERY_MODE_FIXED,
+        .level = 1,
+        .destination_shorthand = LOCAL_APIC_DESTINATION_SHORTHAND_NO_SHORTHAND,
+        .vector = vector
+    };
+    lapic_send_ipi(icr_low.packed, apic_id);
+}
+
 void lapic_send_ipi_all_excluding_self(uint8_t vector) {
     LOCAL_APIC_ICR_LOW icr_low = {
         .delivery_mode = LOCAL_APIC_DELIVERY_MODE_FIXED,
@@ -35,6 +35,11 @@ void lapic_timer_set_deadline(uint64_t tsc_deadline);
  */
 void lapic_timer_clear(void);
 
+/**
+ * Send an IPI to the core with the given APIC id
+ */
+void lapic_send_ipi_to(uint8_t vector, uint32_t apic_id);
+
 /**
  * Send an IPI to all cores except the current one
  */
@@ -10,6 +10,7 @@
 #include "sync/spinlock.h"
 #include "lib/pcpu.h"
 #include "mem/stack.h"
+#include "thread/sched.h"
 #include "time/timer.h"
 
 
@@ -502,8 +503,16 @@ EXCEPTION_STUB(0x1F);
 
 __attribute__((interrupt))
 static void ipi_interrupt_handler(interrupt_frame_t* frame) {
+    cpu_time_kind_t prev_kind = sched_account_enter(CPU_TIME_IRQ);
     ipi_handle();
     lapic_eoi();
+    sched_account_enter(prev_kind);
+}
+
+__attribute__((interrupt))
+static void resched_interrupt_handler(interrupt_frame_t* frame) {
+    lapic_eoi();
+    scheduler_handle_resched_ipi();
 }
 
 __attribute__((interrupt))
@@ -578,6 +587,7 @@ INIT_CODE void init_idt(void) {
     intr_set_handler(INTR_VECTOR_TIMER, timer_interrupt_handler);
     intr_set_handler(INTR_VECTOR_IPI, ipi_interrupt_handler);
     intr_set_handler(INTR_VECTOR_PANIC, panic_handler);
+    intr_set_handler(INTR_VECTOR_RESCHED, resched_interrupt_handler);
     intr_set_handler(INTR_VECTOR_SPURIOUS, spurious_interrupt_handler);
 
     // allow from usermode
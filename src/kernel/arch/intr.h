@@ -45,6 +45,7 @@
 #define INTR_VECTOR_LAST        0xEF
 #define INTR_VECTOR_IPI         0xF0
 #define INTR_VECTOR_PANIC       0xF1
+#define INTR_VECTOR_RESCHED     0xF2
 #define INTR_VECTOR_SPURIOUS    0xFF
 
 typedef struct interrupt_frame {
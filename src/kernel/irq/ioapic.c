@@ -160,7 +160,7 @@ INIT_CODE err_t init_ioapic(void) {
         // convert to an ioapic entry
         phys_map_type_t type;
         RETHROW(phys_map_get_type(phys, PAGE_SIZE,  &type));
-        CHECK(type == PHYS_MAP_UNUSED);
+        CHECK(type == PHYS_MAP_FIRMWARE_RESERVED || type == PHYS_MAP_UNUSED, "%d", type);
         phys_map_convert(PHYS_MAP_MMIO_IOAPIC, phys, PAGE_SIZE);
         RETHROW(virt_map_direct(mapping, true));
 
@@ -240,6 +240,8 @@ void ioapic_register_isa(irq_t* handler, uint8_t isa) {
     handler->type = IRQ_TYPE_IOAPIC;
     handler->ioapic.slot = irq;
     handler->ioapic.index = ioapic_index;
+    handler->ioapic.retarget = false;
+    handler->ioapic.level = trigger_mode == IOAPIC_LEVEL_TRIGGERED;
 
     irq_spinlock_release(&ioapic->lock, irq_state);
 }
@@ -257,3 +259,27 @@ void ioapic_set_mask(irq_t* handler, bool masked) {
 
     irq_spinlock_release(&ioapic->lock, irq_state);
 }
+
+bool ioapic_set_destination(irq_t* handler) {
+    ioapic_t* ioapic = &m_ioapics[handler->ioapic.index];
+    bool irq_state = irq_spinlock_acquire(&ioapic->lock);
+
+    IO_APIC_REDIRECTION_TABLE_ENTRY entry = {};
+    uint32_t offset = IO_APIC_REDIRECTION_TABLE_ENTRY_INDEX + handler->ioapic.slot * 2;
+    entry.packed_low = ioapic_read(ioapic->mapping, offset);
+
+    // an unmasked line might be delivering with the old vector right now
+    bool updated = false;
+    if (entry.mask && !entry.remote_irr) {
+        entry.packed_high = ioapic_read(ioapic->mapping, offset + 1);
+        entry.vector = handler->vector;
+        entry.destination_id = get_apic_id_of(handler->cpu_id);
+        ioapic_write(ioapic->mapping, offset + 1, entry.packed_high);
+        ioapic_write(ioapic->mapping, offset, entry.packed_low);
+        updated = true;
+    }
+
+    irq_spinlock_release(&ioapic->lock, irq_state);
+
+    return updated;
+}
@@ -43,3 +43,11 @@ void ioapic_register_isa(irq_t* irq, uint8_t isa);
  * Change the mask mode of an interrupt
  */
 void ioapic_set_mask(irq_t* irq, bool masked);
+
+/**
+ * Point the redirection entry at the current cpu and vector of the interrupt,
+ * only done while the line is masked and has no interrupt in service, so the
+ * eoi of a level triggered interrupt always matches the vector it came with,
+ * returns false if the entry was left as is
+ */
+bool ioapic_set_destination(irq_t* irq);
@@ -1,29 +1,67 @@
 #include "irq.h"
 
 #include "ioapic.h"
+#include "msi.h"
 
 #include "arch/apic.h"
 #include "arch/intr.h"
+#include "arch/intrin.h"
+#include "arch/smp.h"
 #include "lib/assert.h"
 #include "lib/atomic.h"
 #include "lib/defs.h"
 #include "lib/except.h"
 #include "lib/log.h"
 #include "lib/pcpu.h"
+#include "lib/tsc.h"
 #include "mem/alloc.h"
 #include "mem/virt.h"
 #include "sync/spinlock.h"
 #include "thread/sched.h"
 #include "thread/wait.h"
+#include "time/timer.h"
 #include "uapi/wait.h"
 #include "user/object.h"
 #include <stdatomic.h>
 
+/**
+ * The amount of vectors every core has for interrupt objects
+ */
+#define IRQ_VECTOR_COUNT            (INTR_VECTOR_LAST - INTR_VECTOR_FIRST + 1)
+#define IRQ_VECTOR_WORDS            ((IRQ_VECTOR_COUNT + 63) / 64)
+
+/**
+ * How often the interrupt rates are measured and the interrupts
+ * balanced, and how late the balancing may run
+ */
+#define IRQ_BALANCE_INTERVAL_MS     1000
+#define IRQ_BALANCE_SLACK_MS        100
+
+/**
+ * The amount of interrupts in a period under which a core is never
+ * too busy, moving interrupts around would cost more than it gains
+ */
+#define IRQ_BALANCE_MIN_RATE        1000
+
 typedef struct irq_dispatcher {
     /**
      * The dispatch table
      */
-    irq_t* table[INTR_VECTOR_LAST - INTR_VECTOR_FIRST];
+    irq_t* table[IRQ_VECTOR_COUNT];
+
+    /**
+     * The vectors in use, and the ones among them that an interrupt
+     * was moved away from and are only kept for late arrivals
+     */
+    uint64_t used[IRQ_VECTOR_WORDS];
+    uint64_t retired[IRQ_VECTOR_WORDS];
+
+    /**
+     * The amount of vectors in use and the amount of interrupts taken in the
+     * last balance period, read without the lock when picking a core
+     */
+    _Atomic(uint32_t) allocated;
+    _Atomic(uint64_t) rate;
 
     /**
      * The interrupt table lock
@@ -38,6 +76,18 @@ static irq_dispatcher_t CPU_LOCAL m_irq_dispatcher;
 
 static mem_alloc_t m_irq_alloc;
 
+/**
+ * Taken by the balancer for its whole pass and by freeing an interrupt, so
+ * the interrupts the balancer finds in the tables stay alive while it works
+ */
+static irq_spinlock_t m_irq_balance_lock = IRQ_SPINLOCK_INIT;
+
+/**
+ * The periodic balancing, started with the first balanced interrupt
+ */
+static timer_t m_irq_balance_timer;
+static atomic_bool m_irq_balance_started = false;
+
 static irq_dispatcher_t* get_irq_dispatcher(void) {
     return pcpu_get_pointer(&m_irq_dispatcher);
 }
@@ -46,9 +96,264 @@ static irq_dispatcher_t* get_irq_dispatcher_of(int cpu_id) {
     return pcpu_get_pointer_of(&m_irq_dispatcher, cpu_id);
 }
 
+/**
+ * Allocate a vector for the interrupt on the given cpu, zero if they are all taken
+ */
+static uint8_t irq_vector_alloc(uint32_t cpu_id, irq_t* irq) {
+    irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(cpu_id);
+    bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
+
+    uint8_t vector = 0;
+    for (int i = 0; i < ARRAY_LENGTH(dispatcher->used); i++) {
+        uint64_t free = ~dispatcher->used[i];
+        if (free == 0) {
+            continue;
+        }
+
+        int idx = i * 64 + __builtin_ctzll(free);
+        if (idx >= IRQ_VECTOR_COUNT) {
+            break;
+        }
+
+        dispatcher->used[i] |= 1ull << (idx % 64);
+        dispatcher->table[idx] = irq;
+        atomic_store_relaxed(&dispatcher->allocated, atomic_load_relaxed(&dispatcher->allocated) + 1);
+        vector = INTR_VECTOR_FIRST + idx;
+        break;
+    }
+
+    irq_spinlock_release(&dispatcher->lock, irq_state);
+
+    return vector;
+}
+
+/**
+ * Mark the vector as one the interrupt was moved away from
+ */
+static void irq_vector_retire(uint32_t cpu_id, uint8_t vector) {
+    irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(cpu_id);
+    bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
+    int idx = vector - INTR_VECTOR_FIRST;
+    dispatcher->retired[idx / 64] |= 1ull << (idx % 64);
+    irq_spinlock_release(&dispatcher->lock, irq_state);
+}
+
+static void irq_vector_release(uint32_t cpu_id, uint8_t vector) {
+    irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(cpu_id);
+    bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
+    int idx = vector - INTR_VECTOR_FIRST;
+    dispatcher->table[idx] = nullptr;
+    dispatcher->used[idx / 64] &= ~(1ull << (idx % 64));
+    dispatcher->retired[idx / 64] &= ~(1ull << (idx % 64));
+    atomic_store_relaxed(&dispatcher->allocated, atomic_load_relaxed(&dispatcher->allocated) - 1);
+    irq_spinlock_release(&dispatcher->lock, irq_state);
+}
+
+/**
+ * Pick the core that took the least interrupts in the last balance period, with
+ * the amount of vectors in use breaking ties, -1 if no core has a free vector
+ */
+static int irq_pick_cpu(irq_type_t type) {
+    int best = -1;
+    uint64_t best_rate = 0;
+    uint32_t best_allocated = 0;
+
+    for (int cpu = 0; cpu < g_cpu_count; cpu++) {
+        irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(cpu);
+
+        uint32_t allocated = atomic_load_relaxed(&dispatcher->allocated);
+        if (allocated >= IRQ_VECTOR_COUNT) {
+            continue;
+        }
+
+        if (type == IRQ_TYPE_MSI && !msi_can_target(cpu)) {
+            continue;
+        }
+
+        uint64_t rate = atomic_load_relaxed(&dispatcher->rate);
+        if (best < 0 || rate < best_rate || (rate == best_rate && allocated < best_allocated)) {
+            best = cpu;
+            best_rate = rate;
+            best_allocated = allocated;
+        }
+    }
+
+    return best;
+}
+
+static void irq_balance(timer_t* timer);
+
+static void irq_balance_arm(void) {
+    timer_set_deadline_slack(
+        &m_irq_balance_timer,
+        tsc_ms_deadline(IRQ_BALANCE_INTERVAL_MS),
+        ms_to_tsc(IRQ_BALANCE_SLACK_MS)
+    );
+}
+
+static void irq_balance_start(void) {
+    if (!atomic_exchange_explicit(&m_irq_balance_started, true, memory_order_relaxed)) {
+        m_irq_balance_timer.callback = irq_balance;
+        irq_balance_arm();
+    }
+}
+
+/**
+ * Move the interrupt to the given cpu, the lock of the interrupt must be held
+ */
+static bool irq_move(irq_t* irq, uint32_t cpu_id, msi_message_t* message) {
+    if (cpu_id != irq->cpu_id) {
+        if (irq->type == IRQ_TYPE_MSI && !msi_can_target(cpu_id)) {
+            return false;
+        }
+
+        uint8_t vector = irq_vector_alloc(cpu_id, irq);
+        if (vector == 0) {
+            return false;
+        }
+
+        if (irq->type == IRQ_TYPE_IOAPIC && irq->ioapic.retarget) {
+            // the line still points at the previous vector, so
+            // the current one was never used and can go right away
+            irq_vector_release(irq->cpu_id, irq->vector);
+        } else {
+            // keep the current vector around for interrupts that
+            // are already on their way to it
+            if (irq->prev_vector != 0) {
+                irq_vector_release(irq->prev_cpu_id, irq->prev_vector);
+            }
+            irq_vector_retire(irq->cpu_id, irq->vector);
+            irq->prev_cpu_id = irq->cpu_id;
+            irq->prev_vector = irq->vector;
+        }
+
+        irq->cpu_id = cpu_id;
+        irq->vector = vector;
+
+        if (irq->type == IRQ_TYPE_IOAPIC) {
+            irq->ioapic.retarget = !ioapic_set_destination(irq);
+        }
+    }
+
+    // the device has to be reprogrammed by its driver
+    if (irq->type == IRQ_TYPE_MSI && message != nullptr) {
+        msi_compose(irq, message);
+    }
+
+    return true;
+}
+
+/**
+ * Measure how often each interrupt on the cpu fired since the last
+ * pass, returns how many interrupts the cpu took in total
+ */
+static uint64_t irq_balance_measure(int cpu_id) {
+    irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(cpu_id);
+    bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
+
+    uint64_t total = 0;
+    for (int i = 0; i < ARRAY_LENGTH(dispatcher->used); i++) {
+        // the interrupts of retired vectors are counted where they are now
+        uint64_t live = dispatcher->used[i] & ~dispatcher->retired[i];
+        while (live != 0) {
+            irq_t* irq = dispatcher->table[i * 64 + __builtin_ctzll(live)];
+            live &= live - 1;
+
+            uint64_t count = atomic_load_relaxed(&irq->count);
+            irq->balance_rate = count - irq->balance_count;
+            irq->balance_count = count;
+            total += irq->balance_rate;
+        }
+    }
+
+    atomic_store_relaxed(&dispatcher->rate, total);
+
+    irq_spinlock_release(&dispatcher->lock, irq_state);
+
+    return total;
+}
+
+/**
+ * Find the busiest interrupt on the cpu the kernel may move that fired less
+ * than the given rate, so moving it won't just move the imbalance elsewhere,
+ * only io-apic lines are moved since the kernel can't reprogram a device, and
+ * only masking ones since moving a live line might lose an interrupt
+ */
+static irq_t* irq_balance_find(int cpu_id, uint64_t max_rate) {
+    irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(cpu_id);
+    bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
+
+    irq_t* best = nullptr;
+    for (int i = 0; i < ARRAY_LENGTH(dispatcher->used); i++) {
+        uint64_t live = dispatcher->used[i] & ~dispatcher->retired[i];
+        while (live != 0) {
+            irq_t* irq = dispatcher->table[i * 64 + __builtin_ctzll(live)];
+            live &= live - 1;
+
+            if (!irq->balanced || irq->type != IRQ_TYPE_IOAPIC || irq->mode != IRQ_MODE_MASK) {
+                continue;
+            }
+
+            if (irq->balance_rate == 0 || irq->balance_rate >= max_rate) {
+                continue;
+            }
+
+            if (best == nullptr || irq->balance_rate > best->balance_rate) {
+                best = irq;
+            }
+        }
+    }
+
+    irq_spinlock_release(&dispatcher->lock, irq_state);
+
+    return best;
+}
+
+static void irq_balance(timer_t* timer) {
+    bool balance_state = irq_spinlock_acquire(&m_irq_balance_lock);
+
+    // find the busiest and idlest cores by their interrupt rates
+    int busiest = -1;
+    int idlest = -1;
+    uint64_t busiest_rate = 0;
+    uint64_t idlest_rate = 0;
+    for (int cpu = 0; cpu < g_cpu_count; cpu++) {
+        uint64_t rate = irq_balance_measure(cpu);
+        if (busiest < 0 || rate > busiest_rate) {
+            busiest = cpu;
+            busiest_rate = rate;
+        }
+        if (idlest < 0 || rate < idlest_rate) {
+            idlest = cpu;
+            idlest_rate = rate;
+        }
+    }
+
+    // move a single interrupt per pass, and only once the busiest
+    // core takes clearly more interrupts than the idlest one
+    uint64_t diff = busiest_rate - idlest_rate;
+    if (busiest != idlest && busiest_rate >= IRQ_BALANCE_MIN_RATE && diff > busiest_rate / 4) {
+        irq_t* irq = irq_balance_find(busiest, diff);
+        if (irq != nullptr) {
+            // the affinity might have been set since we looked at it
+            bool irq_state = irq_spinlock_acquire(&irq->lock);
+            if (irq->balanced && irq->cpu_id == busiest) {
+                irq_move(irq, idlest, nullptr);
+            }
+            irq_spinlock_release(&irq->lock, irq_state);
+        }
+    }
+
+    irq_spinlock_release(&m_irq_balance_lock, balance_state);
+
+    irq_balance_arm();
+}
+
 static void irq_mask(irq_t* irq) {
     if (irq->type == IRQ_TYPE_IOAPIC) {
         ioapic_set_mask(irq, true);
+    } else if (irq->type == IRQ_TYPE_MSI || irq->type == IRQ_TYPE_UNREGISTERED) {
+        // nothing to mask on our side
     } else {
         ASSERT(!"Invalid interrupt type for mask");
     }
@@ -56,14 +361,43 @@ static void irq_mask(irq_t* irq) {
 
 void irq_unmask(irq_t* irq) {
     if (irq->type == IRQ_TYPE_IOAPIC) {
+        // the last interrupt masked the line, so a move that
+        // found it live can point it at the new cpu now
+        bool irq_state = irq_spinlock_acquire(&irq->lock);
+        if (irq->ioapic.retarget) {
+            irq->ioapic.retarget = !ioapic_set_destination(irq);
+        }
         ioapic_set_mask(irq, false);
+        irq_spinlock_release(&irq->lock, irq_state);
+    } else if (irq->type == IRQ_TYPE_MSI) {
+        // never masked by us
     } else {
         ASSERT(!"Invalid interrupt type for unmask");
     }    
 }
 
-irq_t* irq_create(int cpu_id) {
-    irq_t* irq = mem_alloc(&m_irq_alloc);
+void irq_get_stats(irq_t* irq, irq_stats_t* stats) {
+    stats->count = atomic_load_relaxed(&irq->count);
+    stats->cpu = irq->cpu_id;
+    stats->vector = irq->vector;
+    stats->balanced = irq->balanced;
+    stats->mode = irq->mode;
+    for (int i = 0; i < IRQ_LATENCY_BUCKETS; i++) {
+        stats->latency[i] = atomic_load_relaxed(&irq->latency[i]);
+    }
+}
+
+irq_t* irq_create(uint32_t cpu_id, irq_type_t type) {
+    bool balanced = cpu_id == IRQ_CPU_ANY;
+    if (balanced) {
+        int cpu = irq_pick_cpu(type);
+        if (cpu < 0) {
+            return nullptr;
+        }
+        cpu_id = cpu;
+    }
+
+    irq_t* irq = mem_calloc(&m_irq_alloc);
     if (irq == nullptr) {
         return nullptr;
     }
@@ -72,75 +406,235 @@ irq_t* irq_create(int cpu_id) {
     irq->object.type = KERNEL_OBJECT_TYPE_IRQ;
     irq->object.ref_count = 1;
 
+    irq->lock = IRQ_SPINLOCK_INIT;
+    irq->waiter_lock = SPINLOCK_INIT;
     irq->type = IRQ_TYPE_UNREGISTERED;
+    irq->mode = IRQ_MODE_MASK;
     irq->cpu_id = cpu_id;
+    irq->balanced = balanced;
 
-    // acquire the spinlock of the given cpu
-    irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(cpu_id);
-    bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
+    // get a vector on the cpu, fail if it has none left
+    irq->vector = irq_vector_alloc(cpu_id, irq);
+    if (irq->vector == 0) {
+        mem_free(&m_irq_alloc, irq);
+        return nullptr;
+    }
+
+    if (balanced) {
+        irq_balance_start();
+    }
+
+    return irq;
+}
+
+irq_affinity_status_t irq_set_affinity(irq_t* irq, uint32_t cpu_id, msi_message_t* message) {
+    bool balanced = cpu_id == IRQ_CPU_ANY;
+    if (balanced) {
+        int cpu = irq_pick_cpu(irq->type);
+        if (cpu < 0) {
+            return IRQ_AFFINITY_NO_SPACE;
+        }
+        cpu_id = cpu;
+    }
+
+    bool irq_state = irq_spinlock_acquire(&irq->lock);
+    irq_affinity_status_t status;
+    if (irq->type == IRQ_TYPE_IOAPIC && irq->mode == IRQ_MODE_AUTO_ACK) {
+        // nothing masks an auto-ack line for us, and masking it
+        // around the move could lose an edge that comes in
+        status = IRQ_AFFINITY_NOT_SUPPORTED;
+    } else if (irq_move(irq, cpu_id, message)) {
+        irq->balanced = balanced;
+        status = IRQ_AFFINITY_SUCCESS;
+    } else {
+        status = IRQ_AFFINITY_NO_SPACE;
+    }
+    irq_spinlock_release(&irq->lock, irq_state);
+
+    if (status == IRQ_AFFINITY_SUCCESS && balanced) {
+        irq_balance_start();
+    }
+
+    return status;
+}
 
-    // get its interrupt table and search for an unused entry
-    int idx = -1;
-    for (int i = 0; i < ARRAY_LENGTH(dispatcher->table); i++) {
-        if (dispatcher->table[i] == nullptr) {
-            idx = i;
+/**
+ * Raise the user counter to the given count, interrupts on the old and
+ * new vector of a moved interrupt may publish out of order
+ */
+static void irq_publish_count(_Atomic(uint64_t)* counter, uint64_t count) {
+    uint64_t current = atomic_load_relaxed(counter);
+    while (current < count) {
+        if (atomic_compare_exchange_weak_explicit(counter, &current, count, memory_order_release, memory_order_relaxed)) {
             break;
         }
     }
+}
 
-    // if not found then fail
-    if (idx < 0) {
-        irq_spinlock_release(&dispatcher->lock, irq_state);
-        mem_free(&m_irq_alloc, irq);
-        return nullptr;
+bool irq_set_mode(irq_t* irq, irq_mode_t mode, _Atomic(uint64_t)* counter) {
+    if (mode == IRQ_MODE_AUTO_ACK) {
+        // a level triggered line left unmasked would fire again right away
+        if (irq->type == IRQ_TYPE_UNREGISTERED) {
+            return false;
+        } else if (irq->type == IRQ_TYPE_IOAPIC && irq->ioapic.level) {
+            return false;
+        }
     }
 
-    // save it and return
-    irq->vector = INTR_VECTOR_FIRST + idx;
-    dispatcher->table[idx] = irq;
+    bool irq_state = irq_spinlock_acquire(&irq->lock);
 
-    irq_spinlock_release(&dispatcher->lock, irq_state);
+    // start the counter off at the current count
+    if (counter != nullptr) {
+        user_access_enable();
+        irq_publish_count(counter, atomic_load_relaxed(&irq->count));
+        user_access_disable();
+    }
+    atomic_store_relaxed(&irq->event_counter, counter);
+    irq->mode = mode;
 
-    return irq;
+    irq_spinlock_release(&irq->lock, irq_state);
+
+    // nothing is going to unmask the line from now on
+    if (mode == IRQ_MODE_AUTO_ACK) {
+        irq_unmask(irq);
+    }
+
+    return true;
+}
+
+static void irq_account_latency(irq_t* irq, uint64_t latency) {
+    // convert to microseconds, clamping to avoid overflows
+    uint64_t us = MIN(latency, g_tsc_freq_hz) * US_PER_S / g_tsc_freq_hz;
+
+    size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    bucket = MIN(bucket, IRQ_LATENCY_BUCKETS - 1);
+    atomic_fetch_add_explicit(&irq->latency[bucket], 1, memory_order_relaxed);
+}
+
+wait_status_t irq_wait(irq_t* irq, uint64_t seen, uint64_t deadline, uint64_t* count) {
+    thread_t* thread = get_current_thread();
+    bool irq_state = irq_save();
+
+    // Start parking now, an interrupt that wakes us from here on
+    // makes the schedule below return right away
+    atomic_store_relaxed(&thread->state, THREAD_STATE_PARKING);
+
+    // the interrupt counts before it looks for a waiter, so checking
+    // the count under the lock can't miss an interrupt
+    spinlock_acquire(&irq->waiter_lock);
+    wait_status_t status = WAIT_STATUS_SUCCESS;
+    if (atomic_load_relaxed(&irq->count) != seen) {
+        status = WAIT_STATUS_NOT_EQUAL;
+    } else if (irq->waiter != nullptr) {
+        status = WAIT_STATUS_BUSY;
+    } else {
+        irq->waiter = thread;
+    }
+    spinlock_release(&irq->waiter_lock);
+
+    if (status == WAIT_STATUS_SUCCESS) {
+        if (deadline == -1) {
+            scheduler_schedule();
+        } else {
+            scheduler_schedule_deadline(deadline);
+        }
+
+        // either the interrupt took us out and we can tell how
+        // long it took us to run, or we got here by the deadline
+        spinlock_acquire(&irq->waiter_lock);
+        if (irq->waiter == thread) {
+            irq->waiter = nullptr;
+        } else {
+            irq_account_latency(irq, get_tsc() - irq->waiter_wake_tsc);
+        }
+        spinlock_release(&irq->waiter_lock);
+    } else {
+        atomic_store_relaxed(&thread->state, THREAD_STATE_RUNNING);
+    }
+
+    irq_restore(irq_state);
+
+    *count = atomic_load_relaxed(&irq->count);
+    return status;
 }
 
 void irq_free(irq_t* irq) {
-    // acquire the spinlock of the given cpu
-    irq_dispatcher_t* dispatcher = get_irq_dispatcher_of(irq->cpu_id);
-    bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
-    dispatcher->table[irq->vector - INTR_VECTOR_FIRST] = nullptr;
+    // the balancer finds interrupts through the dispatch
+    // tables, so wait for it to be done with them
+    bool balance_state = irq_spinlock_acquire(&m_irq_balance_lock);
+
     irq_mask(irq);
-    irq_spinlock_release(&dispatcher->lock, irq_state);
-    
+    irq_vector_release(irq->cpu_id, irq->vector);
+    if (irq->prev_vector != 0) {
+        irq_vector_release(irq->prev_cpu_id, irq->prev_vector);
+    }
+
+    irq_spinlock_release(&m_irq_balance_lock, balance_state);
+
     // and we can free it
     mem_free(&m_irq_alloc, irq);
 }
 
 static void irq_dispatch(uint8_t index) {
+    // the latency of waking the waiter counts from here
+    uint64_t entry_tsc = get_tsc();
+
+    // disable preemption so a thread woken up by the
+    // irq can only preempt us once we are done
+    preempt_disable();
+    cpu_time_kind_t prev_kind = sched_account_enter(CPU_TIME_IRQ);
+
     irq_dispatcher_t* dispatcher = get_irq_dispatcher();
     bool irq_state = irq_spinlock_acquire(&dispatcher->lock);
 
     irq_t* irq = dispatcher->table[index - INTR_VECTOR_FIRST];
     if (irq != nullptr) {
-        // mask the interrupt so it won't fire again
-        irq_mask(irq);
+        // a moved interrupt can still come in on its retired vector
+        // on another cpu, so the count must be a real atomic add
+        uint64_t count = atomic_fetch_add_explicit(&irq->count, 1, memory_order_relaxed) + 1;
+
+        // mask the interrupt so it won't fire again, message signaled
+        // interrupts are edge triggered so they don't need it, and
+        // auto-ack lines only count the interrupts that come in
+        if (irq->mode == IRQ_MODE_MASK) {
+            irq_mask(irq);
+        }
 
         void* wait_key = irq->wait_key;
         uint64_t wait_mask = irq->wait_mask;
+        uint64_t wait_waiters_bit = irq->wait_waiters_bit;
         wait_key_size_t wait_key_size = irq->wait_key_size;
+        _Atomic(uint64_t)* counter = atomic_load_relaxed(&irq->event_counter);
 
         // For IRQs the abi is to OR the mask with the key itself, that way usermode 
         // can decide on which bits it want to be enabled from an IRQ firing up
+        uint64_t old;
         user_access_enable();
+        if (counter != nullptr) {
+            irq_publish_count(counter, count);
+        }
         if (wait_key_size == WAIT_KEY_UINT32) {
-            atomic_fetch_or_explicit((_Atomic(uint32_t)*)wait_key, wait_mask, memory_order_release);
+            old = atomic_fetch_or_explicit((_Atomic(uint32_t)*)wait_key, wait_mask, memory_order_release);
         } else {
-            atomic_fetch_or_explicit((_Atomic(uint64_t)*)wait_key, wait_mask, memory_order_release);
+            old = atomic_fetch_or_explicit((_Atomic(uint64_t)*)wait_key, wait_mask, memory_order_release);
         }
         user_access_disable();
 
-        // wakeup with the mask
-        atomic_notify(wait_key, wait_mask, 0);
+        // wakeup with the mask, only going through the wait queues if
+        // the bits were clear and someone might be waiting for them
+        if ((old & wait_mask) != wait_mask && (wait_waiters_bit == 0 || (old & wait_waiters_bit) != 0)) {
+            atomic_notify(wait_key, wait_mask, 0);
+        }
+
+        // and wake the direct waiter
+        spinlock_acquire(&irq->waiter_lock);
+        thread_t* waiter = irq->waiter;
+        if (waiter != nullptr) {
+            irq->waiter = nullptr;
+            irq->waiter_wake_tsc = entry_tsc;
+            scheduler_try_unpark(waiter, entry_tsc);
+        }
+        spinlock_release(&irq->waiter_lock);
 
     } else {
         WARN("irq: got #%d on cpu #%d with no handler attached", index, get_cpu_id());
@@ -150,6 +644,13 @@ static void irq_dispatch(uint8_t index) {
 
     // we can ack the interrupt now
     lapic_eoi();
+
+    // back to what the thread was doing before the interrupt
+    sched_account_enter(prev_kind);
+
+    // this will switch to the woken up thread right
+    // away if it has a higher rank than us
+    preempt_enable();
 }
 
 #define IRQ_STUB(num) \
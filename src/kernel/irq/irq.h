@@ -1,6 +1,9 @@
 #pragma once
 
 #include "lib/defs.h"
+#include "sync/spinlock.h"
+#include "thread/thread.h"
+#include "uapi/irq.h"
 #include "uapi/wait.h"
 #include "user/object.h"
 
@@ -16,6 +19,12 @@ typedef enum irq_type : uint8_t {
      * IRQ connected to the io-apic
      */
     IRQ_TYPE_IOAPIC,
+
+    /**
+     * Message signaled IRQ, written by the device directly to the lapic, there
+     * is no line to mask so masking is left to the driver of the device
+     */
+    IRQ_TYPE_MSI,
 } irq_type_t;
 
 typedef struct irq {
@@ -35,21 +44,83 @@ typedef struct irq {
              * The index in the io-apic requested
              */
             uint8_t index;
+
+            /**
+             * The redirection entry still points at the previous vector, it
+             * is only rewritten while the line is masked and idle
+             */
+            bool retarget;
+
+            /**
+             * The line is level triggered, so it can't be left unmasked
+             */
+            bool level;
         } ioapic;
     };
 
+    /**
+     * Protects the cpu and vector of the interrupt while it is moved
+     */
+    irq_spinlock_t lock;
+
     /**
      * The cpu id this interrupt is attached to
      */
     uint32_t cpu_id;
 
+    /**
+     * The cpu and vector the interrupt was moved away from, kept registered
+     * so interrupts already on their way there are still handled, released
+     * on the next move, zero as the vector if there is none
+     */
+    uint32_t prev_cpu_id;
+    uint8_t prev_vector;
+
+    /**
+     * The kernel picks the cpu of this interrupt, and may move it
+     */
+    bool balanced;
+
+    /**
+     * The count at the last balance pass and the amount of times the
+     * interrupt fired in the period before it, protected by the balance lock
+     */
+    uint64_t balance_count;
+    uint64_t balance_rate;
+
     /**
      * The wait parameters
      */
     void* wait_key;
     uint64_t wait_mask;
+    uint64_t wait_waiters_bit;
     wait_key_size_t wait_key_size;
 
+    /**
+     * How the interrupt is acknowledged
+     */
+    irq_mode_t mode;
+
+    /**
+     * A user counter the kernel keeps up to date with the
+     * amount of times the interrupt fired, null for none
+     */
+    _Atomic(void*) event_counter;
+
+    /**
+     * The thread waiting on the interrupt directly, woken without going
+     * through the wait queues, and when the interrupt that woke it came in
+     */
+    spinlock_t waiter_lock;
+    thread_t* waiter;
+    uint64_t waiter_wake_tsc;
+
+    /**
+     * Histogram of the time from the interrupt coming in
+     * until the waiter it woke up ran
+     */
+    _Atomic(uint64_t) latency[IRQ_LATENCY_BUCKETS];
+
     /**
      * The type of interrupt this is
      */
@@ -59,6 +130,11 @@ typedef struct irq {
      * The vector of this interrupt
      */
     uint8_t vector;
+
+    /**
+     * The amount of times the interrupt fired
+     */
+    _Atomic(uint64_t) count;
 } irq_t;
 
 /**
@@ -69,8 +145,11 @@ INIT_CODE void init_irq_handling(void);
 /**
  * Create a new interrupt object, will already allocate a vector, 
  * will not register it yet 
+ *
+ * @param cpu_id    [IN] The cpu to deliver to, or IRQ_CPU_ANY for the least loaded one
+ * @param type      [IN] What the interrupt is going to be registered as
  */
-irq_t* irq_create(int cpu_id);
+irq_t* irq_create(uint32_t cpu_id, irq_type_t type);
 
 /**
  * Free the IRQ, unregistering it properly
@@ -81,3 +160,48 @@ void irq_free(irq_t* irq);
  * Unmask the given interrupt
  */
 void irq_unmask(irq_t* irq);
+
+/**
+ * Move the interrupt to another cpu, or let the kernel pick the cpu with
+ * IRQ_CPU_ANY, the vector on the old cpu stays registered until the next move.
+ * A message signaled interrupt gets the new message the device should be
+ * programmed with, an io-apic line is pointed at the new cpu right away if it
+ * is masked and otherwise the next time it is unmasked. An auto-ack io-apic
+ * line is never masked, so it can't be moved and IRQ_AFFINITY_NOT_SUPPORTED
+ * is returned for it.
+ *
+ * @param irq       [IN] The interrupt to move
+ * @param cpu_id    [IN] The new cpu
+ * @param message   [OUT] The new message of an MSI
+ */
+irq_affinity_status_t irq_set_affinity(irq_t* irq, uint32_t cpu_id, msi_message_t* message);
+
+/**
+ * Set how the interrupt is acknowledged and the user counter to keep up to
+ * date with the amount of times it fired, fails for auto-ack of a level
+ * triggered line, switching to auto-ack unmasks the line
+ *
+ * @param irq       [IN] The interrupt
+ * @param mode      [IN] The new mode
+ * @param counter   [IN] The user counter, null for none
+ */
+bool irq_set_mode(irq_t* irq, irq_mode_t mode, _Atomic(uint64_t)* counter);
+
+/**
+ * Wait until the interrupt fired more than the given amount of times, only a
+ * single thread can wait like this at a time, it is woken by the interrupt
+ * directly
+ *
+ * @param irq       [IN] The interrupt
+ * @param seen      [IN] The amount of times the caller saw the interrupt fire
+ * @param deadline  [IN] The deadline to wait for, -1 for no deadline
+ * @param count     [OUT] The amount of times the interrupt fired
+ * @return WAIT_STATUS_NOT_EQUAL if the interrupt already fired more than seen,
+ *         WAIT_STATUS_BUSY if another thread is already waiting on it
+ */
+wait_status_t irq_wait(irq_t* irq, uint64_t seen, uint64_t deadline, uint64_t* count);
+
+/**
+ * Get the statistics of the interrupt
+ */
+void irq_get_stats(irq_t* irq, irq_stats_t* stats);
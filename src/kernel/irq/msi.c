@@ -0,0 +1,34 @@
+#include "msi.h"
+
+#include "lib/log.h"
+#include "lib/pcpu.h"
+
+uint64_t msi_compose_address(uint32_t apic_id) {
+    return MSI_ADDRESS_BASE | ((uint64_t)apic_id << MSI_ADDRESS_DEST_ID_SHIFT);
+}
+
+uint32_t msi_compose_data(uint8_t vector) {
+    return (vector & MSI_DATA_VECTOR_MASK) | MSI_DATA_DELIVERY_FIXED | MSI_DATA_TRIGGER_EDGE;
+}
+
+bool msi_can_target(uint32_t cpu_id) {
+    return get_apic_id_of(cpu_id) <= MSI_ADDRESS_DEST_ID_MAX;
+}
+
+void msi_compose(irq_t* irq, msi_message_t* message) {
+    message->address = msi_compose_address(get_apic_id_of(irq->cpu_id));
+    message->data = msi_compose_data(irq->vector);
+    message->reserved = 0;
+}
+
+bool msi_register(irq_t* irq, msi_message_t* message) {
+    if (!msi_can_target(irq->cpu_id)) {
+        WARN("msi: cpu #%d has apic id %u which can't be targeted", irq->cpu_id, get_apic_id_of(irq->cpu_id));
+        return false;
+    }
+
+    msi_compose(irq, message);
+    irq->type = IRQ_TYPE_MSI;
+
+    return true;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "irq/irq.h"
+#include "uapi/irq.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * The address window of the local apics, a write of the data into it
+ * delivers the vector to the apic that the address selects
+ */
+#define MSI_ADDRESS_BASE                0xFEE00000ull
+#define MSI_ADDRESS_DEST_ID_SHIFT       12
+#define MSI_ADDRESS_DEST_ID_MAX         0xFF
+
+/**
+ * Fixed delivery and edge triggered are both zero, so
+ * the data of a plain interrupt is just the vector
+ */
+#define MSI_DATA_VECTOR_MASK            0xFF
+#define MSI_DATA_DELIVERY_FIXED         (0u << 8)
+#define MSI_DATA_TRIGGER_EDGE           (0u << 15)
+
+/**
+ * Compose the address that targets the given apic, physical destination mode
+ */
+uint64_t msi_compose_address(uint32_t apic_id);
+
+/**
+ * Compose the data for the given vector, fixed delivery and edge triggered
+ */
+uint32_t msi_compose_data(uint8_t vector);
+
+/**
+ * Check whether an MSI can be delivered to the cpu, without interrupt
+ * remapping the address only has room for 8bit apic ids
+ */
+bool msi_can_target(uint32_t cpu_id);
+
+/**
+ * Compose the message that raises the interrupt on its current cpu and vector
+ */
+void msi_compose(irq_t* irq, msi_message_t* message);
+
+/**
+ * Turn the interrupt into an MSI and compose the message the device should
+ * write to raise it, fails if the apic of the cpu can't be addressed by an MSI
+ */
+bool msi_register(irq_t* irq, msi_message_t* message);
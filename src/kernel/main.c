@@ -21,8 +21,10 @@
 #include "mem/vmar.h"
 #include "lib/pcpu.h"
 #include "mem/stack.h"
+#include "thread/group.h"
 #include "thread/sched.h"
 #include "thread/wait.h"
+#include "time/clock.h"
 #include "time/tsc.h"
 #include "user/syscall.h"
 #include "time/timer.h"
@@ -79,6 +81,28 @@ INIT_CODE static void set_extended_state_features(void) {
     }
     _xsetbv(0, xcr0);
 
+    // prefer xsaves, it saves in the compacted format so the area only
+    // takes the space of the enabled features, we don't use any of the
+    // supervisor features so they are all disabled
+    CPUID_EXTENDED_STATE_SUB_LEAF_EAX extended_state_sub_leaf_eax = {};
+    ASSERT(__get_cpuid_count(
+        CPUID_EXTENDED_STATE,
+        CPUID_EXTENDED_STATE_SUB_LEAF,
+        &extended_state_sub_leaf_eax.raw,
+        &b, &c, &d
+    ));
+
+    if (first) {
+        g_xsaves_supported = extended_state_sub_leaf_eax.XSAVES;
+        if (g_xsaves_supported) TRACE("cpu: using XSAVES");
+    } else {
+        ASSERT(g_xsaves_supported == extended_state_sub_leaf_eax.XSAVES);
+    }
+
+    if (g_xsaves_supported) {
+        __wrmsr(MSR_IA32_XSS, 0);
+    }
+
     first = false;
 }
 
@@ -110,6 +134,7 @@ INIT_CODE static void validate_cpu_features(void) {
     ASSERT(structured_extended_feature_flags_ebx.FSGSBASE, "Missing FSGSBASE support");
     ASSERT(structured_extended_feature_flags_ebx.INVPCID, "Missing INVPCID support");
     ASSERT(structured_extended_feature_flags_ecx.UMIP, "Missing UMIP support");
+    ASSERT(structured_extended_feature_flags_ecx.RDPID, "Missing RDPID support");
     ASSERT(structured_extended_feature_flags_ebx.RDSEED, "Missing RDSEED support");
 
     CPUID_EXTENDED_STATE_SUB_LEAF_EAX extended_state_sub_leaf_eax = {};
@@ -131,6 +156,7 @@ INIT_CODE static void validate_cpu_features(void) {
     ));
     ASSERT(extended_cpu_sig_edx.EXECUTE_DIS, "Missing EXECUTE_DIS support");
     ASSERT(extended_cpu_sig_edx.SYSCALL_SYSRET_64, "Missing SYSCALL/SYSRET support");
+    ASSERT(extended_cpu_sig_edx.RDTSCP, "Missing RDTSCP support");
 
     CPUID_EXTENDED_TIME_STAMP_COUNTER_EDX extended_time_stamp_counter_edx = {};
     ASSERT(__get_cpuid(
@@ -382,8 +408,14 @@ OMIT_ENDBR INIT_CODE void _start() {
     init_irq_handling();
     init_timers_per_core();
 
+    // publish the clocks to the user, and keep refining the
+    // tsc calibration in the background now that we have timers
+    RETHROW(init_clock());
+    tsc_start_refinement();
+
     // thread related init
-    init_threads();
+    RETHROW(init_threads());
+    init_sched_groups();
     init_sched_per_core();
 
     // setup the runtime
@@ -403,6 +435,9 @@ OMIT_ENDBR INIT_CODE void _start() {
     g_cpu_count = response->cpu_count;
     TRACE("smp: Starting CPUs (%zu)", g_cpu_count);
 
+    // the wait queues scale with the amount of cores
+    RETHROW(init_wait_queues(g_cpu_count));
+
     // we need to allow interrupts so ipis from other
     // cores will work
     irq_enable();
@@ -180,10 +180,19 @@ INIT_CODE bool early_should_map(struct limine_memmap_entry* entry) {
            entry->type == LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE;
 }
 
+/**
+ * Should the entry be tracked by the buddy, this includes the memory that
+ * we map right away and the modules which are reclaimed later on
+ */
+INIT_CODE static bool early_should_track(struct limine_memmap_entry* entry) {
+    return early_should_map(entry) ||
+           entry->type == LIMINE_MEMMAP_EXECUTABLE_AND_MODULES;
+}
+
 INIT_CODE static uintptr_t early_get_top_address(void) {
     struct limine_memmap_response* response = g_limine_memmap_request.response;
     for (int i = response->entry_count - 1; i >= 0; i--) {
-        if (early_should_map(response->entries[i])) {
+        if (early_should_track(response->entries[i])) {
             return response->entries[i]->base + response->entries[i]->length;
         }
     }
@@ -284,7 +293,7 @@ INIT_CODE static err_t early_map_buddy_bitmap(uint64_t* pml4) {
     // map all the ranges now
     for (int i = 0; i < response->entry_count; i++) {
         struct limine_memmap_entry* entry = response->entries[i];
-        if (entry->type != LIMINE_MEMMAP_BOOTLOADER_RECLAIMABLE && entry->type != LIMINE_MEMMAP_USABLE) {
+        if (!early_should_track(entry)) {
             continue;
         }
 
@@ -4,6 +4,7 @@
 #include "early.h"
 #include "limine_requests.h"
 #include "phys_map.h"
+#include "virt.h"
 #include "arch/paging.h"
 #include "lib/list.h"
 #include "lib/pcpu.h"
@@ -339,3 +340,32 @@ cleanup:
 
     return err;
 }
+
+err_t phys_reclaim_reserved(uint64_t start, size_t length) {
+    err_t err = NO_ERROR;
+
+    CHECK((start % PAGE_SIZE) == 0);
+    CHECK((length % PAGE_SIZE) == 0);
+
+    // ensure that this is actually a kernel reserved range,
+    // we don't want to accidently free anything else
+    phys_map_type_t type;
+    RETHROW(phys_map_get_type(start, length, &type));
+    CHECK(type == PHYS_MAP_KERNEL_RESERVED);
+
+    TRACE("memory: Reclaiming %016lx-%016lx", start, start + length - 1);
+
+    // mark as ram
+    phys_map_convert(PHYS_MAP_RAM, start, length);
+
+    // the reserved ranges are not part of the direct map, so map every page
+    // before giving it to the buddy, the buddy will merge them as it goes
+    for (size_t offset = 0; offset < length; offset += PAGE_SIZE) {
+        void* ptr = phys_to_direct(start + offset);
+        RETHROW(virt_map_direct(ptr, false));
+        phys_free(ptr, PAGE_SIZE);
+    }
+
+cleanup:
+    return err;
+}
@@ -32,6 +32,14 @@ INIT_CODE err_t init_phys(void);
  */
 INIT_CODE err_t reclaim_bootloader_memory(void);
 
+/**
+ * Return a kernel reserved physical range (like the initrd) to the
+ * physical memory allocator, mapping it into the direct map as it goes
+ *
+ * NOTE: requires the vmar lock to be taken
+ */
+err_t phys_reclaim_reserved(uint64_t start, size_t length);
+
 /**
  * Allocate physical memory
  *
@@ -32,11 +32,6 @@ static int phys_map_cmp_contains(const void* key, const struct rb_node* n) {
     return 0;
 }
 
-static bool phys_map_should_merge(phys_map_entry_t* entry, phys_map_type_t type) {
-    // only merge if matches
-    return entry->type == type;
-}
-
 static phys_map_entry_t* phys_map_insert_new_entry(uint64_t start, uint64_t end, phys_map_type_t type) {
     phys_map_entry_t* entry = mem_calloc(&m_phys_map_alloc);
     ASSERT(entry != NULL);
@@ -72,7 +67,8 @@ void phys_map_convert_locked(phys_map_type_t type, uint64_t start, size_t length
         entry = rb_entry(found, phys_map_entry_t, node);
         ASSERT(entry->end >= end, "phys_map: partial overlap not supported");
 
-        if (!phys_map_should_merge(entry, type)) {
+        // already of the requested type, nothing to do
+        if (entry->type == type) {
             return;
         }
 
@@ -133,7 +129,7 @@ err_t phys_map_to_user(uint64_t start, size_t length) {
     CHECK_ERROR(found != NULL, ERROR_NOT_FOUND);
 
     phys_map_entry_t* entry = rb_entry(found, phys_map_entry_t, node);
-    CHECK_ERROR(top_address < entry->end, ERROR_NOT_FOUND);
+    CHECK_ERROR(top_address - 1 <= entry->end, ERROR_NOT_FOUND);
 
     // ensure its a valid type, for simplicity we allow to 
     // map the same region multiple times
@@ -167,7 +163,7 @@ err_t phys_map_get_type(uint64_t start, size_t length, phys_map_type_t* type) {
     CHECK_ERROR(found != NULL, ERROR_NOT_FOUND);
 
     phys_map_entry_t* entry = rb_entry(found, phys_map_entry_t, node);
-    CHECK_ERROR(top_address < entry->end, ERROR_NOT_FOUND);
+    CHECK_ERROR(top_address - 1 <= entry->end, ERROR_NOT_FOUND);
 
     *type = entry->type;
 
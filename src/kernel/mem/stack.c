@@ -2,19 +2,172 @@
 
 #include "virt.h"
 #include "arch/intrin.h"
+#include "arch/smp.h"
 #include "mem/mappings.h"
 #include "mem/vmar.h"
 #include "lib/assert.h"
+#include "lib/atomic.h"
+#include "lib/pcpu.h"
 #include "lib/rbtree/rbtree.h"
+#include "sync/spinlock.h"
 #include "thread/thread.h"
 
 LATE_RO bool g_shadow_stack_supported = false;
 
+//----------------------------------------------------------------------------------------------------------------------
+// Stack cache
+//----------------------------------------------------------------------------------------------------------------------
+
+typedef struct stack_cache_entry {
+    /**
+     * The guard region of the stack
+     */
+    vmar_t* region;
+
+    /**
+     * The stacks, ready to be used
+     */
+    stack_alloc_t alloc;
+
+    /**
+     * The size of the stack
+     */
+    size_t size;
+} stack_cache_entry_t;
+
+typedef struct stack_cache {
+    /**
+     * Protects the cache, it is only taken by other cpus
+     * when the limit is lowered
+     */
+    spinlock_t lock;
+
+    stack_cache_entry_t entries[STACK_CACHE_MAX];
+    size_t count;
+} stack_cache_t;
+
+/**
+ * Per-cpu cache of ready to use thread stacks, we have one for kernel
+ * stacks (+ supervisor shadow stacks) and one for user stacks
+ */
+static CPU_LOCAL stack_cache_t m_kernel_stack_cache;
+static CPU_LOCAL stack_cache_t m_user_stack_cache;
+
+/**
+ * The max amount of entries each cache is allowed to hold
+ */
+static atomic_size_t m_stack_cache_limit = STACK_CACHE_MAX;
+
+static stack_cache_t* get_stack_cache(bool user) {
+    return pcpu_get_pointer(user ? &m_user_stack_cache : &m_kernel_stack_cache);
+}
+
+static bool stack_cache_pop(bool user, size_t size, stack_cache_entry_t* out_entry) {
+    bool found = false;
+
+    bool irq_state = irq_save();
+
+    stack_cache_t* cache = get_stack_cache(user);
+    spinlock_acquire(&cache->lock);
+    if (cache->count != 0 && cache->entries[cache->count - 1].size == size) {
+        *out_entry = cache->entries[--cache->count];
+        found = true;
+    }
+    spinlock_release(&cache->lock);
+
+    irq_restore(irq_state);
+
+    return found;
+}
+
+static bool stack_cache_push(bool user, stack_cache_entry_t* entry) {
+    bool pushed = false;
+
+    bool irq_state = irq_save();
+
+    stack_cache_t* cache = get_stack_cache(user);
+    spinlock_acquire(&cache->lock);
+    if (cache->count < atomic_load_relaxed(&m_stack_cache_limit)) {
+        cache->entries[cache->count++] = *entry;
+        pushed = true;
+    }
+    spinlock_release(&cache->lock);
+
+    irq_restore(irq_state);
+
+    return pushed;
+}
+
+static bool stack_cache_has_space(bool user) {
+    bool irq_state = irq_save();
+    stack_cache_t* cache = get_stack_cache(user);
+    bool has_space = cache->count < atomic_load_relaxed(&m_stack_cache_limit);
+    irq_restore(irq_state);
+    return has_space;
+}
+
+/**
+ * Free the stacks the given cache holds above the limit
+ */
+static void stack_cache_trim(stack_cache_t* cache) {
+    for (;;) {
+        vmar_t* region = nullptr;
+
+        bool irq_state = irq_save();
+        spinlock_acquire(&cache->lock);
+        if (cache->count > atomic_load_relaxed(&m_stack_cache_limit)) {
+            region = cache->entries[--cache->count].region;
+        }
+        spinlock_release(&cache->lock);
+        irq_restore(irq_state);
+
+        if (region == nullptr) {
+            break;
+        }
+
+        vmar_lock();
+        vmar_free(region);
+        vmar_unlock();
+    }
+}
+
+void stack_cache_set_limit(size_t limit) {
+    atomic_store_relaxed(&m_stack_cache_limit, MIN(limit, STACK_CACHE_MAX));
+
+    // drain the caches of all the cpus right away, a push that
+    // races with this still sees the new limit, so no cache is
+    // left above it once we are done
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        stack_cache_trim(pcpu_get_pointer_of(&m_kernel_stack_cache, cpu));
+        stack_cache_trim(pcpu_get_pointer_of(&m_user_stack_cache, cpu));
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Stack allocation
+//----------------------------------------------------------------------------------------------------------------------
+
 err_t stack_alloc(stack_alloc_t* alloc, const char* name, size_t size, stack_alloc_flag_t flags) {
     err_t err = NO_ERROR;
     bool user = flags & STACK_ALLOC_USER;
     vmar_t* top_vmar = user ? &g_user_memory : &g_kernel_memory;
 
+    // thread stacks can be taken from the cache, they are already
+    // fully setup so we only need the vmar lock to rename them
+    if ((flags & STACK_ALLOC_IST) == 0) {
+        stack_cache_entry_t entry;
+        if (stack_cache_pop(user, ALIGN_UP(size, PAGE_SIZE), &entry)) {
+            // the name is only touched under the vmar lock, but this
+            // is the only vmar operation we need for a cached stack
+            vmar_lock();
+            vmar_set_name(entry.region, name);
+            vmar_unlock();
+
+            *alloc = entry.alloc;
+            return NO_ERROR;
+        }
+    }
+
     vmar_lock();
 
     // 1 page to each side for guard
@@ -117,32 +270,67 @@ void stack_free(void* ptr, bool user) {
     ASSERT(vmar->parent == top_vmar);
 
     // ensure that this looks like a stack guard region
-    bool found_stack = false;
-    bool found_shadow_stack = false;
+    vmar_t* stack = nullptr;
+    vmar_t* shadow_stack = nullptr;
     for (rb_node_t* node = rb_first(&vmar->region.root); node != nullptr; node = rb_next(node)) {
         vmar_t* child = rb_entry(node, vmar_t, node);
         if (child->type == VMAR_TYPE_STACK) {
-            ASSERT(!found_stack);
-            found_stack = true;
+            ASSERT(stack == nullptr);
+            stack = child;
         } else if (child->type == VMAR_TYPE_SHADOW_STACK) {
             ASSERT(g_shadow_stack_supported);
-            ASSERT(!found_shadow_stack);
-            found_shadow_stack = true;
+            ASSERT(shadow_stack == nullptr);
+            shadow_stack = child;
         } else {
             ASSERT(!"Invalid vmar type in stack region");
         }
     }
 
     // ensure we found the entries at all
-    ASSERT(found_stack);
+    ASSERT(stack != nullptr);
     if (g_shadow_stack_supported) {
-        ASSERT(found_shadow_stack);
+        ASSERT(shadow_stack != nullptr);
     } else {
-        ASSERT(!found_shadow_stack);
+        ASSERT(shadow_stack == nullptr);
     }
 
-    // free the entire region
-    vmar_free(vmar);
+    // attempt to keep the stack in the cache
+    if (stack_cache_has_space(user)) {
+        stack_cache_entry_t entry = {
+            .region = vmar,
+            .alloc.stack = vmar_end(stack) + 1,
+            .size = PAGES_TO_SIZE(stack->page_count),
+        };
+
+        if (user) {
+            // discard the user stacks, they will be faulted back in as zero
+            // pages, so nothing leaks between threads, the reaper frees each
+            // thread in an unmap batch so both stacks share a TLB shootdown
+            virt_unmap(stack->base, stack->page_count, true);
+            if (shadow_stack != nullptr) {
+                virt_unmap(shadow_stack->base, shadow_stack->page_count, true);
+            }
+        } else if (shadow_stack != nullptr) {
+            // kernel stacks are pre-faulted, just prepare the
+            // shadow stack for a new thread entry
+            ASSERT(!IS_ERROR(virt_reset_shadow_stack_token(vmar_end(shadow_stack) + 1 - 8, true)));
+        }
+
+        if (shadow_stack != nullptr) {
+            entry.alloc.shadow_stack = vmar_end(shadow_stack) + 1 - 8;
+        }
+
+        // we might have raced with something that filled the cache
+        if (stack_cache_push(user, &entry)) {
+            vmar_set_name(vmar, "cached-stack");
+            vmar = nullptr;
+        }
+    }
+
+    // free the entire region if we did not cache it
+    if (vmar != nullptr) {
+        vmar_free(vmar);
+    }
 
     vmar_unlock();
 }
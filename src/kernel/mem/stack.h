@@ -28,6 +28,25 @@ typedef enum stack_alloc_flag {
     STACK_ALLOC_IST = BIT1,
 } stack_alloc_flag_t;
 
+/**
+ * The max amount of thread stacks each cpu keeps around
+ */
+#define STACK_CACHE_MAX  32
+
+/**
+ * Allocate a new stack, non-IST stacks are taken from the per-cpu
+ * stack cache if possible
+ */
 err_t stack_alloc(stack_alloc_t* alloc, const char* name, size_t size, stack_alloc_flag_t flags);
 
+/**
+ * Free a stack, returning it to the per-cpu stack cache if possible
+ */
 void stack_free(void* ptr, bool user);
+
+/**
+ * Change the amount of stacks each cpu is allowed to cache, lowering
+ * this frees the stacks above the new limit in the caches of all cpus
+ */
+void stack_cache_set_limit(size_t limit);
+
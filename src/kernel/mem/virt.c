@@ -8,6 +8,8 @@
 #include "arch/intr.h"
 #include "arch/paging.h"
 #include "lib/ipi.h"
+#include "lib/pcpu.h"
+#include "lib/rbtree/rbtree.h"
 #include "sync/spinlock.h"
 #include "thread/thread.h"
 #include "uapi/mapping.h"
@@ -83,6 +85,32 @@ static uint8_t m_tlb_flush_count = 0;
  */
 static bool m_tlb_flush_global = false;
 
+/**
+ * Unmaps that were deferred while batching, the ptes are already
+ * marked as not present but the pages are not yet released
+ */
+typedef struct virt_deferred_unmap {
+    void* virt;
+    size_t page_count;
+    bool free;
+} virt_deferred_unmap_t;
+
+typedef struct virt_unmap_batch {
+    virt_deferred_unmap_t deferred[32];
+    size_t count;
+
+    /**
+     * The nesting depth of unmap batches
+     */
+    size_t depth;
+} virt_unmap_batch_t;
+
+/**
+ * The unmap batch of each core, a batch belongs to the core that started
+ * it and never migrates since it is done entirely under the vmar lock
+ */
+static CPU_LOCAL virt_unmap_batch_t m_unmap_batch;
+
 typedef struct invpcid_desc {
     uint64_t pcid : 12;
     uint64_t : 52;
@@ -199,6 +227,14 @@ static uint64_t* virt_get_pte(void* virt, bool allocate, bool kernel) {
     return &pml1[index1];
 }
 
+void* virt_get_direct(void* virt) {
+    uint64_t* pte = virt_get_pte(virt, false, false);
+    if (pte == nullptr || (*pte & IA32_PG_P) == 0) {
+        return nullptr;
+    }
+    return phys_to_direct(*pte & PAGING_4K_ADDRESS_MASK) + ((uintptr_t)virt & PAGE_MASK);
+}
+
 void virt_make_global(void* virt) {
     uint64_t* pte = virt_get_pte(virt, false, true);
     ASSERT(pte != nullptr);
@@ -255,7 +291,10 @@ static err_t virt_unmap_direct(void* virt) {
     tlb_invl_queue(virt, false);
     *pte = 0;
 
-    tlb_invl_commit();
+    // when batching the flush is done at the end of the batch
+    if (m_unmap_batch_depth == 0) {
+        tlb_invl_commit();
+    }
 
 cleanup:
     return err;
@@ -289,25 +328,22 @@ void virt_protect(void* virt, size_t page_count, mapping_protection_t protection
     tlb_invl_commit();
 }
 
-void virt_unmap(void* virt, size_t page_count, bool free) {
-    // first mark everything as unmapped so we can properly free it without races
+static void virt_unmap_mark(void* virt, size_t page_count) {
     for (size_t i = 0; i < page_count; i++) {
         void* cur = virt + i * PAGE_SIZE;
 
-        // get the pte
+        // get the pte, when batching the page might already
+        // be marked and pending release, so skip it as well
         uint64_t* pte = virt_get_pte(cur, false, false);
-        if (pte == nullptr || !pte_is_present(pte)) {
+        if (pte == nullptr || (*pte & IA32_PG_P) == 0) {
             continue;
         }
         *pte &= ~IA32_PG_P;
         tlb_invl_queue(cur, *pte & IA32_PG_G);
     }
+}
 
-    // actually commit to all the cores that we are now unmapped
-    tlb_invl_commit();
-
-    // now that all the cores see it as unmapped, we are going to
-    // actually unmap everything
+static void virt_unmap_release(void* virt, size_t page_count, bool free) {
     for (size_t i = 0; i < page_count; i++) {
         // get the pte
         uint64_t* pte = virt_get_pte(virt + i * PAGE_SIZE, false, false);
@@ -327,14 +363,59 @@ void virt_unmap(void* virt, size_t page_count, bool free) {
     }
 }
 
-err_t virt_setup_shadow_stack_token(void* virt, bool thread_entry) {
-    err_t err = NO_ERROR;
+static void virt_unmap_flush_deferred(virt_unmap_batch_t* batch) {
+    // a single shootdown for everything that was deferred
+    tlb_invl_commit();
 
-    // allocate the page
-    void* page = phys_alloc(PAGE_SIZE);
-    CHECK_ERROR(page != nullptr, ERROR_OUT_OF_MEMORY);
+    for (size_t i = 0; i < batch->count; i++) {
+        virt_deferred_unmap_t* unmap = &batch->deferred[i];
+        virt_unmap_release(unmap->virt, unmap->page_count, unmap->free);
+    }
+    batch->count = 0;
+}
 
-    // setup the shadow stack token
+void virt_unmap(void* virt, size_t page_count, bool free) {
+    virt_unmap_batch_t* batch = pcpu_get_pointer(&m_unmap_batch);
+    if (batch->depth != 0) {
+        // make sure we have space to defer it
+        if (batch->count == ARRAY_LENGTH(batch->deferred)) {
+            virt_unmap_flush_deferred(batch);
+        }
+
+        // mark as unmapped, the rest will be done once the batch is done
+        virt_unmap_mark(virt, page_count);
+        batch->deferred[batch->count++] = (virt_deferred_unmap_t){
+            .virt = virt,
+            .page_count = page_count,
+            .free = free,
+        };
+        return;
+    }
+
+    // first mark everything as unmapped so we can properly free it without races
+    virt_unmap_mark(virt, page_count);
+
+    // actually commit to all the cores that we are now unmapped
+    tlb_invl_commit();
+
+    // now that all the cores see it as unmapped, we are going to
+    // actually unmap everything
+    virt_unmap_release(virt, page_count, free);
+}
+
+void virt_unmap_batch_begin(void) {
+    pcpu_get_pointer(&m_unmap_batch)->depth++;
+}
+
+void virt_unmap_batch_end(void) {
+    virt_unmap_batch_t* batch = pcpu_get_pointer(&m_unmap_batch);
+    ASSERT(batch->depth != 0);
+    if (--batch->depth == 0) {
+        virt_unmap_flush_deferred(batch);
+    }
+}
+
+static void virt_write_shadow_stack_token(void* page, void* virt, bool thread_entry) {
     uintptr_t* ssp_token = page + ((uintptr_t)virt & PAGE_MASK);
     if (thread_entry) {
         // mark the supervisor SSP as busy
@@ -353,6 +434,17 @@ err_t virt_setup_shadow_stack_token(void* virt, bool thread_entry) {
         // stack
         ssp_token[0] = (uintptr_t)virt;
     }
+}
+
+err_t virt_setup_shadow_stack_token(void* virt, bool thread_entry) {
+    err_t err = NO_ERROR;
+
+    // allocate the page
+    void* page = phys_alloc(PAGE_SIZE);
+    CHECK_ERROR(page != nullptr, ERROR_OUT_OF_MEMORY);
+
+    // setup the shadow stack token
+    virt_write_shadow_stack_token(page, virt, thread_entry);
 
     // remove it from the direct map
     virt_unmap_direct(page);
@@ -368,6 +460,26 @@ cleanup:
     return err;
 }
 
+err_t virt_reset_shadow_stack_token(void* virt, bool thread_entry) {
+    err_t err = NO_ERROR;
+
+    // the page must already be a shadow stack page
+    uint64_t* pte = virt_get_pte(virt, false, true);
+    CHECK(pte != nullptr);
+    CHECK(*pte & IA32_PG_P);
+    CHECK((*pte & IA32_PG_RW) == 0);
+
+    // the shadow stack page can't be written normally, so temporarily
+    // map it in the direct map to write the token again
+    void* page = phys_to_direct(*pte & PAGING_4K_ADDRESS_MASK);
+    RETHROW(virt_map_direct(page, false));
+    virt_write_shadow_stack_token(page, virt, thread_entry);
+    RETHROW(virt_unmap_direct(page));
+
+cleanup:
+    return err;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Init memory reclamation
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -425,6 +537,70 @@ void reclaim_init_mem(void) {
 // Page fault handling
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Get the bump of a memory region if its growth is controlled by a user
+ * control word, null otherwise
+ */
+static vmar_t* virt_get_controlled_bump(vmar_t* region) {
+    if (region->subtype != VMAR_SUBTYPE_MEM && region->subtype != VMAR_SUBTYPE_MAPPABLE) {
+        return nullptr;
+    }
+
+    vmar_t* bump = vmar_find(region, region->base);
+    if (bump == nullptr || bump->subtype != VMAR_SUBTYPE_BUMP || bump->alloc.control == nullptr) {
+        return nullptr;
+    }
+
+    return bump;
+}
+
+/**
+ * Resolve the mapping of a fault inside of a memory region controlled by the
+ * user, the bump is grown up to the accessible size on demand, and anything
+ * else in the region is only valid above the accessible size
+ */
+static vmar_t* virt_resolve_controlled_mapping(vmar_t* mapping, void* addr) {
+    vmar_t* region = mapping != nullptr ? mapping->parent : vmar_find_region(&g_user_memory, addr);
+    vmar_t* bump = virt_get_controlled_bump(region);
+    if (bump == nullptr) {
+        return mapping;
+    }
+
+    // the control word is read through the direct map, its page was
+    // faulted in when the region was reserved so this can't fault
+    uint32_t accessible = ((volatile const mem_control_t*)bump->alloc.control)->accessible;
+    void* accessible_end = bump->base + (size_t)accessible * MEM_CONTROL_UNIT;
+
+    // other mappings can't overlap the accessible range
+    if (mapping != nullptr && mapping != bump) {
+        return addr >= accessible_end ? mapping : nullptr;
+    }
+
+    if (addr >= accessible_end) {
+        return nullptr;
+    }
+
+    // already inside of the bump
+    if (bump->page_count != 0 && addr <= vmar_end(bump)) {
+        return bump;
+    }
+
+    // grow the bump up to the accessible end, without going over the next
+    // mapping or the end of the region
+    void* end = MIN(accessible_end, vmar_end(region) + 1);
+    rb_node_t* next = rb_next(&bump->node);
+    if (next != nullptr) {
+        end = MIN(end, rb_entry(next, vmar_t, node)->base);
+    }
+
+    if (addr >= end) {
+        return nullptr;
+    }
+
+    ASSERT(vmar_resize(bump, (end - bump->base) / PAGE_SIZE));
+    return bump;
+}
+
 err_t virt_handle_page_fault(uintptr_t addr, uint32_t code) {
     err_t err = NO_ERROR;
 
@@ -449,8 +625,12 @@ err_t virt_handle_page_fault(uintptr_t addr, uint32_t code) {
         CHECK_FAIL();
     }
 
-    // search for the actual mapping where we faulted
+    // search for the actual mapping where we faulted, memory regions
+    // with a control word are grown lazily by the fault itself
     mapping = vmar_find_mapping(mapping, (void*)addr);
+    if (!kernel) {
+        mapping = virt_resolve_controlled_mapping(mapping, (void*)addr);
+    }
     CHECK(mapping != NULL);
 
     // if the type is alloc there are some extra restrictions
@@ -464,6 +644,11 @@ err_t virt_handle_page_fault(uintptr_t addr, uint32_t code) {
             CHECK((code & IA32_PF_EC_WRITE) == 0);
         }
 
+    } else if (mapping->type == VMAR_TYPE_PHYS) {
+        // same for read-only physical mappings
+        if (mapping->phys.protection == MAPPING_PROTECTION_RO) {
+            CHECK((code & IA32_PF_EC_WRITE) == 0);
+        }
     }
 
     if (mapping->type == VMAR_TYPE_SHADOW_STACK) {
@@ -532,14 +717,15 @@ err_t virt_handle_page_fault(uintptr_t addr, uint32_t code) {
         new_pte |= IA32_PG_G;
 
     // check if the mapping should be uncached
-    if (mapping->type == VMAR_TYPE_PHYS) {
+    if (mapping->type == VMAR_TYPE_PHYS && !mapping->phys.cached) {
         new_pte |= IA32_PG_CACHE_UCM;
     }
 
     // check if the mapping should be writable
     if (
         (mapping->type == VMAR_TYPE_ALLOC && mapping->alloc.protection == MAPPING_PROTECTION_RW) ||
-        mapping->type == VMAR_TYPE_PHYS || mapping->type == VMAR_TYPE_STACK
+        (mapping->type == VMAR_TYPE_PHYS && mapping->phys.protection == MAPPING_PROTECTION_RW) ||
+        mapping->type == VMAR_TYPE_STACK
     ) {
         // we don't need the dirty bit, so set it right away, we don't
         // always set it because for shadow stacks we need it to be on
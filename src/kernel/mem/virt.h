@@ -42,6 +42,15 @@ void virt_remove_global(void* virt);
  */
 bool virt_is_mapped(uintptr_t virt);
 
+/**
+ * Get the direct map address of a mapped page, null if the page is not
+ * present, the caller must make sure the page stays mapped for as long
+ * as it uses the result
+ *
+ * Lock must be taken before entering the function
+ */
+void* virt_get_direct(void* virt);
+
 /**
  * Map something into the direct map right now
  */
@@ -65,11 +74,30 @@ void virt_protect(void* virt, size_t page_count, mapping_protection_t protection
  */
 void virt_unmap(void* virt, size_t page_count, bool free);
 
+/**
+ * Start batching unmaps on the current core, until the batch is done all the
+ * unmaps share a single TLB shootdown and the pages are only released at the end
+ *
+ * The vmar lock must be held and interrupts disabled for the entire batch
+ */
+void virt_unmap_batch_begin(void);
+
+/**
+ * Finish the batch, performing the TLB shootdown and releasing the pages
+ */
+void virt_unmap_batch_end(void);
+
 /**
  * Sets up a page as a shadow stack with supervisor token
  */
 err_t virt_setup_shadow_stack_token(void* virt, bool thread_entry);
 
+/**
+ * Re-write the supervisor token of an already setup shadow stack page,
+ * used when reusing a shadow stack for a new thread
+ */
+err_t virt_reset_shadow_stack_token(void* virt, bool thread_entry);
+
 /**
  * Handle a TLB flush ipi
  */
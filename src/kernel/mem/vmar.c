@@ -108,6 +108,19 @@ vmar_t* vmar_find_mapping(vmar_t* entry, void* addr) {
     }
 }
 
+vmar_t* vmar_find_region(vmar_t* entry, void* addr) {
+    assert_vmar_locked();
+
+    ASSERT(entry->type == VMAR_TYPE_REGION);
+    for (;;) {
+        vmar_t* child = vmar_find(entry, addr);
+        if (child == nullptr || child->type != VMAR_TYPE_REGION) {
+            return entry;
+        }
+        entry = child;
+    }
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Range allocation
 //----------------------------------------------------------------------------------------------------------------------
@@ -244,6 +257,8 @@ vmar_t* vmar_map_phys(vmar_t* parent, size_t phys_base, size_t page_count, void*
     child->base = addr;
     child->page_count = page_count;
     child->phys.phys = phys_base;
+    child->phys.protection = MAPPING_PROTECTION_RW;
+    child->phys.cached = false;
 
     // reserve it
     if (!vmar_reserve_static(parent, child)) {
@@ -272,6 +287,36 @@ void vmar_protect(vmar_t* vmar, mapping_protection_t protection) {
     virt_protect(vmar->base, vmar->page_count, protection);
 }
 
+bool vmar_resize(vmar_t* vmar, size_t page_count) {
+    assert_vmar_locked();
+
+    ASSERT(vmar->type == VMAR_TYPE_ALLOC);
+    ASSERT(!vmar->pinned);
+
+    if (page_count < vmar->page_count) {
+        // release everything past the new end
+        virt_unmap(vmar->base + PAGES_TO_SIZE(page_count), vmar->page_count - page_count, true);
+
+    } else if (page_count > vmar->page_count) {
+        // make sure we stay inside of the parent
+        vmar_t* parent = vmar->parent;
+        size_t available = parent->page_count - (vmar->base - parent->base) / PAGE_SIZE;
+        if (page_count > available) {
+            return false;
+        }
+
+        // and don't run into the next mapping
+        void* end = vmar->base + PAGES_TO_SIZE(page_count);
+        rb_node_t* next = rb_next(&vmar->node);
+        if (next != nullptr && end > rb_entry(next, vmar_t, node)->base) {
+            return false;
+        }
+    }
+
+    vmar->page_count = page_count;
+    return true;
+}
+
 void vmar_protect_ptr(void* mapping, mapping_protection_t protection) {
     assert_vmar_locked();
 
@@ -311,6 +356,11 @@ void vmar_free(vmar_t* vmar) {
         case VMAR_TYPE_ALLOC:
         case VMAR_TYPE_SHADOW_STACK:
         case VMAR_TYPE_STACK: {
+            // a bump takes its control word page with it
+            if (vmar->type == VMAR_TYPE_ALLOC && vmar->subtype == VMAR_SUBTYPE_BUMP) {
+                vmar_free_control(vmar);
+            }
+
             // for these types we just need to free the entire region
             virt_unmap(vmar->base, vmar->page_count, true);
         } break;
@@ -328,6 +378,20 @@ void vmar_free(vmar_t* vmar) {
     rb_erase(&vmar->node, &vmar->parent->region.root);
 }
 
+void vmar_free_control(vmar_t* bump) {
+    assert_vmar_locked();
+
+    ASSERT(bump->subtype == VMAR_SUBTYPE_BUMP);
+    if (bump->alloc.control_page == nullptr) {
+        return;
+    }
+
+    // the fault handler must not see the word once its page is gone
+    bump->alloc.control = nullptr;
+    vmar_free(bump->alloc.control_page);
+    bump->alloc.control_page = nullptr;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // VMAR Debug
 //----------------------------------------------------------------------------------------------------------------------
@@ -79,6 +79,28 @@ typedef enum vmar_subtype {
     VMAR_SUBTYPE_JIT_RX,
     VMAR_SUBTYPE_JIT_RO,
 
+    /**
+     * The initrd module pages, mapped directly
+     * from where the bootloader loaded them
+     */
+    VMAR_SUBTYPE_INITRD,
+
+    /**
+     * The read-only timekeeping page
+     */
+    VMAR_SUBTYPE_CLOCK_PAGE,
+
+    /**
+     * The read-only page telling which threads are on a cpu
+     */
+    VMAR_SUBTYPE_THREAD_RUN_PAGE,
+
+    /**
+     * The page holding the control word of a memory
+     * region, owned by the bump of the region
+     */
+    VMAR_SUBTYPE_MEM_CONTROL,
+
 } vmar_subtype_t;
 
 typedef struct vmar {
@@ -140,6 +162,20 @@ typedef struct vmar {
              * The protection used for the mapping
              */
             mapping_protection_t protection;
+
+            /**
+             * For bump allocations, the user control word that tells how
+             * far the bump can be grown on fault, null if the bump is
+             * only grown explicitly, points into the direct map so the
+             * fault handler can read it without touching user memory
+             */
+            const mem_control_t* control;
+
+            /**
+             * The page the control word is in, allocated for the bump
+             * alone and freed together with it
+             */
+            struct vmar* control_page;
         } alloc;
 
         struct {
@@ -147,6 +183,18 @@ typedef struct vmar {
              * The physical address that this VMAR maps
              */
             uintptr_t phys;
+
+            /**
+             * The protection used for the mapping
+             */
+            mapping_protection_t protection;
+
+            /**
+             * Is this normal memory that can be mapped as
+             * write-back, by default we assume its mmio
+             * and map it as uncached
+             */
+            bool cached;
         } phys;
     };
 
@@ -255,6 +303,20 @@ vmar_t* vmar_map_phys(vmar_t* parent, size_t phys_base, size_t page_count, void*
  */
 void vmar_protect(vmar_t* vmar, mapping_protection_t protection);
 
+/**
+ * Resize an allocated region in place, shrinking it unmaps and frees the
+ * pages past the new end, growing it only extends the range and the pages
+ * are faulted in on access
+ *
+ * Lock must be taken before entering the function
+ *
+ * @param vmar          [IN] The allocated region
+ * @param page_count    [IN] The new page count
+ * @return false if the region can't grow that much without
+ *         overlapping the next mapping or leaving its parent
+ */
+bool vmar_resize(vmar_t* vmar, size_t page_count);
+
 /**
  * Change the protection of the given region, must be an allocated region
  * that is not locked.
@@ -286,6 +348,17 @@ vmar_t* vmar_find(vmar_t* parent, void* addr);
  */
 vmar_t* vmar_find_mapping(vmar_t* root, void* addr);
 
+/**
+ * Search for the innermost region that contains the address
+ *
+ * Lock must be taken before entering the function
+ *
+ * @param root          [IN]
+ * @param addr          [IN]
+ * @return The innermost region, the root if no child region contains it
+ */
+vmar_t* vmar_find_region(vmar_t* root, void* addr);
+
 /**
  * Free the VMAR region at the address
  *
@@ -295,6 +368,14 @@ vmar_t* vmar_find_mapping(vmar_t* root, void* addr);
  */
 void vmar_free(vmar_t* vmar);
 
+/**
+ * Free the control word page of a bump, the bump is only grown
+ * explicitly from now on, does nothing if it has no control word
+ *
+ * Lock must be taken before entering the function
+ */
+void vmar_free_control(vmar_t* bump);
+
 INIT_CODE void vmar_remove(vmar_t* vmar);
 
 /**
@@ -0,0 +1,70 @@
+#include "group.h"
+
+#include "lib/assert.h"
+#include "lib/atomic.h"
+#include "lib/tsc.h"
+#include "mem/alloc.h"
+#include "sched.h"
+
+/**
+ * The allocator used to allocate scheduling groups
+ */
+static mem_alloc_t m_sched_group_alloc;
+
+INIT_CODE void init_sched_groups(void) {
+    mem_alloc_init(&m_sched_group_alloc, sizeof(sched_group_t), _Alignof(sched_group_t));
+}
+
+sched_group_t* sched_group_create(uint32_t weight) {
+    sched_group_t* group = mem_calloc(&m_sched_group_alloc);
+    if (group == nullptr) {
+        return nullptr;
+    }
+
+    // setup the object
+    group->object.type = KERNEL_OBJECT_TYPE_SCHED_GROUP;
+    group->object.ref_count = 1;
+
+    group->weight = weight;
+    group->created = get_tsc();
+
+    return group;
+}
+
+void sched_group_free(sched_group_t* group) {
+    // every thread holds a reference on its group
+    ASSERT(atomic_load_relaxed(&group->nr_threads) == 0);
+    mem_free(&m_sched_group_alloc, group);
+}
+
+bool sched_group_weight_is_valid(uint32_t weight) {
+    return weight != 0 && weight <= SCHED_WEIGHT_MAX;
+}
+
+void sched_group_set_weight(sched_group_t* group, uint32_t weight) {
+    ASSERT(sched_group_weight_is_valid(weight));
+    atomic_store_relaxed(&group->weight, weight);
+}
+
+void sched_group_get_stats(sched_group_t* group, sched_group_stats_t* stats) {
+    stats->runtime_us = tsc_to_us(atomic_load_relaxed(&group->runtime));
+    stats->elapsed_us = tsc_to_us(get_tsc() - group->created);
+    stats->weight = atomic_load_relaxed(&group->weight);
+    stats->nr_threads = atomic_load_relaxed(&group->nr_threads);
+    stats->nr_runnable = atomic_load_relaxed(&group->nr_runnable);
+
+    uint64_t cpu_time[CPU_TIME_KIND_COUNT];
+    for (size_t i = 0; i < CPU_TIME_KIND_COUNT; i++) {
+        cpu_time[i] = atomic_load_relaxed(&group->cpu_time[i]);
+    }
+
+    // threads only add their time when they leave the cpu, so add
+    // the time of those that are still running on other cores
+    sched_get_group_running_time(group, cpu_time);
+
+    stats->cpu_time.user_ns = tsc_to_ns(cpu_time[CPU_TIME_USER]);
+    stats->cpu_time.kernel_ns = tsc_to_ns(cpu_time[CPU_TIME_KERNEL]);
+    stats->cpu_time.irq_ns = tsc_to_ns(cpu_time[CPU_TIME_IRQ]);
+    stats->cpu_time.wait_ns = tsc_to_ns(cpu_time[CPU_TIME_WAIT]);
+    stats->cpu_time.blocked_ns = tsc_to_ns(cpu_time[CPU_TIME_BLOCKED]);
+}
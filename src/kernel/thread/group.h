@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "lib/defs.h"
+#include "thread.h"
+#include "uapi/sched.h"
+#include "user/object.h"
+
+/**
+ * A group of threads sharing a single weight, the normal threads of a group
+ * split the cpu share of the group between them, so a process with many
+ * threads gets the same share as a process with a single thread
+ */
+typedef struct sched_group {
+    /**
+     * The object header
+     */
+    kernel_object_t object;
+
+    /**
+     * The weight of the group
+     */
+    _Atomic(uint32_t) weight;
+
+    /**
+     * The amount of started threads that did not exit yet
+     */
+    atomic_size_t nr_threads;
+
+    /**
+     * The amount of threads that are either running or
+     * waiting to run, the weight is split between them
+     */
+    atomic_size_t nr_runnable;
+
+    /**
+     * The cpu time used by the threads of the group, in tsc ticks
+     */
+    _Atomic(uint64_t) runtime;
+
+    /**
+     * The cpu time of the threads of the group by kind, in tsc ticks,
+     * threads add to it when they are switched out, the time of threads
+     * still running is added when the stats are read
+     */
+    _Atomic(uint64_t) cpu_time[CPU_TIME_KIND_COUNT];
+
+    /**
+     * The tsc at which the group was created
+     */
+    uint64_t created;
+} sched_group_t;
+
+INIT_CODE void init_sched_groups(void);
+
+/**
+ * Create a new scheduling group with the given weight
+ */
+sched_group_t* sched_group_create(uint32_t weight);
+
+/**
+ * Free the group, called once the last reference is gone
+ */
+void sched_group_free(sched_group_t* group);
+
+/**
+ * Check that the weight is in range
+ */
+bool sched_group_weight_is_valid(uint32_t weight);
+
+/**
+ * Change the weight of the group, takes effect the
+ * next time its threads are accounted
+ */
+void sched_group_set_weight(sched_group_t* group, uint32_t weight);
+
+/**
+ * Get the current statistics of the group
+ */
+void sched_group_get_stats(sched_group_t* group, sched_group_stats_t* stats);
@@ -4,20 +4,108 @@
 #include <stdalign.h>
 #include <stdatomic.h>
 
+#include "group.h"
 #include "lib/log.h"
 #include "thread.h"
 #include "time/timer.h"
+#include "arch/apic.h"
 #include "arch/cpuid.h"
+#include "arch/intr.h"
 #include "arch/intrin.h"
+#include "arch/smp.h"
 #include "lib/atomic.h"
 #include "lib/except.h"
+#include "lib/pcpu.h"
+#include "lib/rbtree/rbtree.h"
+#include "lib/tsc.h"
 #include "mem/stack.h"
+#include "sync/spinlock.h"
 #include "user/syscall.h"
 
+/**
+ * How often a busy core checks if it should pull work from busier cores
+ */
+#define SCHED_BALANCE_INTERVAL_MS   20
+
+/**
+ * The time slice of every class, a thread runs for its slice before
+ * the tick preempts it, the tick only runs when threads are waiting
+ */
+static _Atomic(uint32_t) m_sched_slice_us[] = {
+    [SCHED_CLASS_NORMAL] = 10000,
+    [SCHED_CLASS_REALTIME] = 10000,
+    [SCHED_CLASS_IDLE] = 20000,
+};
+
+/**
+ * How late a timeout may fire, as a fraction of the timeout and at most
+ * SCHED_TIMEOUT_SLACK_MAX_US, letting nearby timeouts share an interrupt,
+ * kept well under a percent so sleeps and polls stay on time, short
+ * timeouts end up with less than a wheel tick and stay exact
+ */
+#define SCHED_TIMEOUT_SLACK_DIVISOR     256
+#define SCHED_TIMEOUT_SLACK_MAX_US      1000
+
+/**
+ * The minimal time an idle core should expect to stay idle before it
+ * enters each mwait c-state, deeper states take longer to exit so they
+ * only pay off for longer idle periods, indexed by the c-state
+ */
+static const uint32_t m_sched_cstate_residency_us[] = { 0, 0, 20, 80, 150, 300, 600, 1000 };
+
+/**
+ * The bits of the idle word of a core: the idle loop sets polling while it
+ * waits on the word with mwait, so waking it only needs to set need resched
+ */
+#define SCHED_IDLE_POLLING          BIT0
+#define SCHED_IDLE_NEED_RESCHED     BIT1
+
+/**
+ * Threads that ran in this window are considered cache hot, and
+ * periodic balancing is not going to migrate them
+ */
+#define SCHED_MIGRATION_COST_US     500
+
+/**
+ * Every class and priority has its own queue, indexed by the rank of
+ * the thread, the highest non-empty queue is the one that runs first
+ */
+#define SCHED_QUEUE_COUNT           (SCHED_RT_PRIORITY_COUNT + 2)
+STATIC_ASSERT(SCHED_QUEUE_COUNT <= 64);
+
+/**
+ * The queue of the normal class, which is ordered by vruntime
+ * in the fair queue instead of a plain list
+ */
+#define SCHED_FAIR_QUEUE            1
+
+/**
+ * How far behind the min vruntime a waking thread may be placed, gives
+ * threads that slept a small boost without letting them hog the cpu
+ */
+#define SCHED_SLEEPER_CREDIT_MS     5
+
+/**
+ * The weight of every normal priority, each priority gets about 25% more
+ * cpu than the one below it, with the default priority at the default weight
+ */
+static const uint32_t m_sched_prio_to_weight[SCHED_NORMAL_PRIORITY_COUNT] = {
+    /*  0 */        12,     15,     18,     23,     29,
+    /*  5 */        36,     45,     56,     70,     87,
+    /* 10 */       110,    137,    172,    215,    272,
+    /* 15 */       335,    423,    526,    655,    820,
+    /* 20 */      1024,   1277,   1586,   1991,   2501,
+    /* 25 */      3121,   3906,   4904,   6100,   7620,
+    /* 30 */      9548,  11916,  14949,  18705,  23254,
+    /* 35 */     29154,  36291,  46273,  56483,  71755,
+};
+STATIC_ASSERT(SCHED_NORMAL_PRIORITY_DEFAULT == 20);
+
 typedef enum last_thread_action {
     LAST_THREAD_ACTION_NONE,
     LAST_THREAD_ACTION_PARK,
     LAST_THREAD_ACTION_PUT,
+    LAST_THREAD_ACTION_ENQUEUE,
 } last_thread_action_t;
 
 typedef struct scheduler_context {
@@ -27,9 +115,119 @@ typedef struct scheduler_context {
     timer_t timer;
 
     /**
-     * The queue of threads to run
+     * Protects the run queue, must be taken with interrupts disabled,
+     * other cores take it when pulling work from this core
+     */
+    spinlock_t lock;
+
+    /**
+     * The queues of threads to run, one per rank
+     */
+    list_t run_queues[SCHED_QUEUE_COUNT];
+
+    /**
+     * The normal class threads, ordered by their vruntime
+     */
+    rb_root_cached_t fair_queue;
+
+    /**
+     * Bitmap of the non-empty run queues
+     */
+    uint64_t run_queues_bitmap;
+
+    /**
+     * Monotonic lower bound of the vruntime of the normal threads on
+     * the core, threads coming in are placed relative to it
+     */
+    _Atomic(uint64_t) min_vruntime;
+
+    /**
+     * The amount of threads in the run queue, can be read
+     * without the lock by other cores as a load hint
+     */
+    atomic_size_t nr_queued;
+
+    /**
+     * The tsc at which the core should balance next
+     */
+    uint64_t next_balance;
+
+    /**
+     * Load balancing statistics
+     */
+    _Atomic(uint64_t) migrations;
+    _Atomic(uint64_t) steals;
+    _Atomic(uint64_t) imbalances;
+
+    /**
+     * Set once the scheduler of the core can be pulled from
+     */
+    atomic_bool online;
+
+    /**
+     * Threads woken up by other cores, pushed without taking the
+     * run queue lock and moved to the run queue by the core itself
      */
-    list_t run_queue;
+    _Atomic(thread_t*) inbox;
+
+    /**
+     * Is the core running its idle thread right now
+     */
+    atomic_bool is_idle;
+
+    /**
+     * Is the tick stopped, which happens when no thread is waiting
+     * for the cpu, a remote wakeup must kick the core in that case
+     */
+    atomic_bool tick_stopped;
+
+    /**
+     * The rank of the thread running on the core, waking
+     * up a thread with a higher rank preempts it
+     */
+    atomic_uint current_rank;
+
+    /**
+     * The group of the thread running on the core, the tsc since which
+     * its time was last added to the group and what it was doing then,
+     * lets the group stats include threads still running on the core,
+     * the since is zero while the other two are being changed
+     */
+    _Atomic(sched_group_t*) running_group;
+    _Atomic(cpu_time_kind_t) running_kind;
+    _Atomic(uint64_t) running_since;
+
+    /**
+     * The id of the core
+     */
+    int cpu;
+
+    /**
+     * Does the core idle with mwait, and the mwait c-states it
+     * supports, bit n is set if Cn is supported
+     */
+    bool mwait_supported;
+    uint8_t mwait_cstates;
+
+    /**
+     * Idle statistics
+     */
+    _Atomic(uint64_t) idle_entries;
+    _Atomic(uint64_t) idle_time;
+    _Atomic(uint64_t) idle_store_wakeups;
+
+    /**
+     * A thread woken up by the running thread that takes over the
+     * cpu once it switches away, without going through the run queue
+     */
+    thread_t* handoff;
+
+    /**
+     * Wakeup statistics
+     */
+    _Atomic(uint64_t) remote_wakeups;
+    _Atomic(uint64_t) handoffs;
+    _Atomic(uint64_t) wakeup_latency[SCHED_WAKEUP_LATENCY_BUCKETS];
 
     /**
      * The idle thread of the core
@@ -45,6 +243,12 @@ typedef struct scheduler_context {
      * The action to perform on `last_thread` in the context of the newly-switched thread.
      */
     last_thread_action_t last_thread_action;
+
+    /**
+     * The word the idle loop monitors, kept on its own cache line so
+     * only the stores meant to wake the core are going to
+     */
+    alignas(64) atomic_uint idle_flags;
 } __attribute__((aligned(128))) scheduler_t;
 
 /**
@@ -59,51 +263,689 @@ static scheduler_t CPU_LOCAL m_scheduler;
 thread_t* CPU_LOCAL m_current;
 
 /**
- * Preemption is disabled if non-zero, this can be used
- * to quickly pin a thread for a while to do stuff that
- * should not preempt.
+ * Preemption is disabled if non-zero, this can be used
+ * to quickly pin a thread for a while to do stuff that
+ * should not preempt.
+ *
+ * Its a thread local to make it easier to modify without
+ * needing to disable interrupts or anything alike because
+ * we don't have per-cpu variables that we can access
+ * atomically.
+ */
+static CPU_LOCAL int32_t m_preempt_count = 0;
+
+/**
+ * Do we need to preempt whe restoring preempt count to zero?
+ */
+static CPU_LOCAL bool m_want_preempt = false;
+
+/**
+ * What the current thread is doing and since when, the time is
+ * charged to the thread whenever this changes
+ */
+static CPU_LOCAL cpu_time_kind_t m_cpu_time_kind = CPU_TIME_KERNEL;
+static CPU_LOCAL uint64_t m_cpu_time_since = 0;
+
+thread_t* get_current_thread(void) {
+    return m_current;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Private API
+//----------------------------------------------------------------------------------------------------------------------
+
+static scheduler_t* get_scheduler(void) {
+    return pcpu_get_pointer(&m_scheduler);
+}
+
+uint32_t scheduler_get_rank(thread_t* thread) {
+    if (thread->sched_class == SCHED_CLASS_REALTIME) {
+        return 3 + thread->priority;
+    } else if (thread->sched_class == SCHED_CLASS_NORMAL) {
+        return 2;
+    } else {
+        return 1;
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Fair share
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Compare vruntimes, safe against wraparound
+ */
+static bool scheduler_vruntime_before(uint64_t a, uint64_t b) {
+    return (int64_t)(a - b) < 0;
+}
+
+static __always_inline bool scheduler_vruntime_less(rb_node_t* a, const rb_node_t* b) {
+    thread_t* ta = rb_entry(a, thread_t, run_node);
+    thread_t* tb = rb_entry(b, thread_t, run_node);
+    return scheduler_vruntime_before(ta->vruntime, tb->vruntime);
+}
+
+/**
+ * Get the weight of a normal thread, the threads of a group split the
+ * weight of the group between all of its runnable threads
+ */
+static uint64_t scheduler_get_weight(thread_t* thread) {
+    uint64_t weight = m_sched_prio_to_weight[thread->priority];
+
+    sched_group_t* group = thread->group;
+    if (group != nullptr) {
+        size_t nr_runnable = MAX(atomic_load_relaxed(&group->nr_runnable), 1);
+        weight = weight * atomic_load_relaxed(&group->weight) / (SCHED_WEIGHT_DEFAULT * nr_runnable);
+    }
+
+    return MAX(weight, 1);
+}
+
+/**
+ * Account the time the thread ran since it was last accounted
+ */
+static void scheduler_charge(thread_t* thread, uint64_t now) {
+    uint64_t delta = now - thread->exec_start;
+    thread->exec_start = now;
+
+    if (thread->group != nullptr) {
+        atomic_fetch_add_explicit(&thread->group->runtime, delta, memory_order_relaxed);
+    }
+
+    if (thread->sched_class == SCHED_CLASS_NORMAL) {
+        thread->vruntime += delta * SCHED_WEIGHT_DEFAULT / scheduler_get_weight(thread);
+    }
+}
+
+/**
+ * Add time of the given kind to the thread, there is only a single writer at a
+ * time, either the core running the thread or the one waking it up
+ */
+static void scheduler_account_cpu_time(thread_t* thread, cpu_time_kind_t kind, uint64_t delta) {
+    atomic_store_relaxed(&thread->cpu_time[kind], atomic_load_relaxed(&thread->cpu_time[kind]) + delta);
+}
+
+/**
+ * Add the cpu time the thread got since it was last flushed to its group
+ */
+static void scheduler_flush_cpu_time(thread_t* thread) {
+    sched_group_t* group = thread->group;
+    if (group == nullptr) {
+        return;
+    }
+
+    for (size_t i = 0; i < CPU_TIME_KIND_COUNT; i++) {
+        uint64_t total = atomic_load_relaxed(&thread->cpu_time[i]);
+        uint64_t delta = total - thread->cpu_time_flushed[i];
+        if (delta != 0) {
+            atomic_fetch_add_explicit(&group->cpu_time[i], delta, memory_order_relaxed);
+            thread->cpu_time_flushed[i] = total;
+        }
+    }
+}
+
+/**
+ * Publish the thread that runs on the core from now on, its time
+ * since the given tsc is not part of its group yet
+ */
+static void scheduler_publish_running(scheduler_t* scheduler, thread_t* thread, uint64_t since) {
+    // a zero since tells readers the group and kind are changing,
+    // same as the odd count of a seqlock
+    atomic_store_relaxed(&scheduler->running_since, 0);
+    atomic_fence_release();
+
+    atomic_store_relaxed(&scheduler->running_group, thread->group);
+    atomic_store_relaxed(&scheduler->running_kind, m_cpu_time_kind);
+    atomic_store_release(&scheduler->running_since, since);
+}
+
+/**
+ * Move the min vruntime forward to the lowest vruntime on the core,
+ * current is the running normal thread if it can continue to run
+ */
+static void scheduler_update_min_vruntime(scheduler_t* scheduler, thread_t* current) {
+    uint64_t min_vruntime = atomic_load_relaxed(&scheduler->min_vruntime);
+    thread_t* lowest = current;
+
+    spinlock_acquire(&scheduler->lock);
+    rb_node_t* node = rb_first_cached(&scheduler->fair_queue);
+    if (node != nullptr) {
+        thread_t* first = rb_entry(node, thread_t, run_node);
+        if (lowest == nullptr || scheduler_vruntime_before(first->vruntime, lowest->vruntime)) {
+            lowest = first;
+        }
+    }
+
+    if (lowest != nullptr && scheduler_vruntime_before(min_vruntime, lowest->vruntime)) {
+        atomic_store_relaxed(&scheduler->min_vruntime, lowest->vruntime);
+    }
+    spinlock_release(&scheduler->lock);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Run queue
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * The vruntime is relative while the thread is off a core, make it absolute as it
+ * comes onto the core, limiting how much a thread that slept for a long time can
+ * be behind everyone else
+ */
+static void scheduler_place_vruntime(scheduler_t* scheduler, thread_t* thread) {
+    int64_t lag = MAX((int64_t)thread->vruntime, -(int64_t)ms_to_tsc(SCHED_SLEEPER_CREDIT_MS));
+    thread->vruntime = atomic_load_relaxed(&scheduler->min_vruntime) + lag;
+}
+
+static void scheduler_queue_locked(scheduler_t* scheduler, thread_t* thread) {
+    size_t index = scheduler_get_rank(thread) - 1;
+    if (index == SCHED_FAIR_QUEUE) {
+        scheduler_place_vruntime(scheduler, thread);
+        rb_add_cached(&thread->run_node, &scheduler->fair_queue, scheduler_vruntime_less);
+    } else {
+        list_add_tail(&scheduler->run_queues[index], &thread->link);
+    }
+    scheduler->run_queues_bitmap |= 1ull << index;
+    atomic_store_relaxed(&scheduler->nr_queued, atomic_load_relaxed(&scheduler->nr_queued) + 1);
+}
+
+static void scheduler_dequeue_locked(scheduler_t* scheduler, thread_t* thread) {
+    size_t index = scheduler_get_rank(thread) - 1;
+    if (index == SCHED_FAIR_QUEUE) {
+        rb_erase_cached(&thread->run_node, &scheduler->fair_queue);
+        if (RB_EMPTY_ROOT(&scheduler->fair_queue.rb_root)) {
+            scheduler->run_queues_bitmap &= ~(1ull << index);
+        }
+    } else {
+        list_del(&thread->link);
+        if (list_is_empty(&scheduler->run_queues[index])) {
+            scheduler->run_queues_bitmap &= ~(1ull << index);
+        }
+    }
+    atomic_store_relaxed(&scheduler->nr_queued, atomic_load_relaxed(&scheduler->nr_queued) - 1);
+}
+
+/**
+ * Take the highest ranked thread from the run queue, if the previous thread can
+ * continue to run then only take a thread that should run instead of it, which
+ * is a thread of a higher rank, or a normal thread with a lower vruntime
+ */
+static thread_t* scheduler_pop(scheduler_t* scheduler, thread_t* prev) {
+    thread_t* thread = nullptr;
+    uint32_t min_rank = prev != nullptr ? scheduler_get_rank(prev) : 0;
+
+    spinlock_acquire(&scheduler->lock);
+    if (scheduler->run_queues_bitmap != 0) {
+        size_t index = 63 - __builtin_clzll(scheduler->run_queues_bitmap);
+        if (index == SCHED_FAIR_QUEUE) {
+            thread = rb_entry(rb_first_cached(&scheduler->fair_queue), thread_t, run_node);
+        } else {
+            thread = list_first_entry(&scheduler->run_queues[index], thread_t, link);
+        }
+
+        if (index + 1 < min_rank) {
+            thread = nullptr;
+        } else if (
+            index + 1 == min_rank && index == SCHED_FAIR_QUEUE &&
+            !scheduler_vruntime_before(thread->vruntime, prev->vruntime)
+        ) {
+            thread = nullptr;
+        }
+
+        if (thread != nullptr) {
+            scheduler_dequeue_locked(scheduler, thread);
+        }
+    }
+    spinlock_release(&scheduler->lock);
+
+    return thread;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Load balancing
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool scheduler_is_cache_hot(thread_t* thread, uint64_t now) {
+    return now - thread->last_ran < us_to_tsc(SCHED_MIGRATION_COST_US);
+}
+
+/**
+ * Find the core with the most queued threads, only considering
+ * cores with at least the given amount of queued threads
+ */
+static scheduler_t* scheduler_find_busiest(scheduler_t* scheduler, size_t min_queued) {
+    scheduler_t* busiest = nullptr;
+    size_t busiest_queued = 0;
+
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        scheduler_t* other = pcpu_get_pointer_of(&m_scheduler, cpu);
+        if (other == scheduler || !atomic_load_acquire(&other->online)) {
+            continue;
+        }
+
+        size_t queued = atomic_load_relaxed(&other->nr_queued);
+        if (queued >= min_queued && queued > busiest_queued) {
+            busiest = other;
+            busiest_queued = queued;
+        }
+    }
+
+    return busiest;
+}
+
+static bool scheduler_is_allowed(scheduler_t* scheduler, thread_t* thread) {
+    return cpu_mask_test(&thread->affinity, scheduler->cpu);
+}
+
+/**
+ * Take up to count threads that may run on the target core out of the run queue,
+ * highest ranked and longest waiting first, cache hot threads are only taken if
+ * allowed, their vruntime is made relative so they can be placed on the target
+ */
+static size_t scheduler_detach_locked(
+    scheduler_t* scheduler, scheduler_t* target,
+    size_t count, bool allow_hot, uint64_t now,
+    list_t* detached
+) {
+    size_t moved = 0;
+    thread_t* thread;
+    thread_t* next;
+
+    for (int index = SCHED_QUEUE_COUNT - 1; index >= 0 && moved != count; index--) {
+        if (index == SCHED_FAIR_QUEUE) {
+            // the normal threads that are the most behind go first
+            uint64_t min_vruntime = atomic_load_relaxed(&scheduler->min_vruntime);
+            rb_node_t* node = rb_first_cached(&scheduler->fair_queue);
+            while (node != nullptr && moved != count) {
+                thread = rb_entry(node, thread_t, run_node);
+                node = rb_next(node);
+
+                if (!scheduler_is_allowed(target, thread)) {
+                    continue;
+                }
+
+                if (!allow_hot && scheduler_is_cache_hot(thread, now)) {
+                    continue;
+                }
+
+                scheduler_dequeue_locked(scheduler, thread);
+                thread->vruntime -= min_vruntime;
+                list_add_tail(detached, &thread->link);
+                moved++;
+            }
+            continue;
+        }
+
+        list_for_each_entry_safe(thread, next, &scheduler->run_queues[index], link) {
+            if (moved == count) {
+                break;
+            }
+
+            if (!scheduler_is_allowed(target, thread)) {
+                continue;
+            }
+
+            if (!allow_hot && scheduler_is_cache_hot(thread, now)) {
+                continue;
+            }
+
+            scheduler_dequeue_locked(scheduler, thread);
+            list_add_tail(detached, &thread->link);
+            moved++;
+        }
+    }
+
+    return moved;
+}
+
+/**
+ * Move up to count threads from the busiest core into our own run queue,
+ * cache hot threads are only moved if allowed, returns the amount moved
+ */
+static size_t scheduler_pull(scheduler_t* scheduler, scheduler_t* busiest, size_t count, bool allow_hot, uint64_t now) {
+    list_t pulled = LIST_INIT(&pulled);
+
+    spinlock_acquire(&busiest->lock);
+    size_t moved = scheduler_detach_locked(busiest, scheduler, count, allow_hot, now, &pulled);
+    spinlock_release(&busiest->lock);
+
+    if (moved == 0) {
+        return 0;
+    }
+
+    // we never hold two run queue locks at once, so there
+    // is no lock ordering between the cores
+    spinlock_acquire(&scheduler->lock);
+    while (!list_is_empty(&pulled)) {
+        thread_t* thread = list_first_entry(&pulled, thread_t, link);
+        list_del(&thread->link);
+        scheduler_queue_locked(scheduler, thread);
+    }
+    spinlock_release(&scheduler->lock);
+
+    atomic_fetch_add_explicit(&scheduler->migrations, moved, memory_order_relaxed);
+    return moved;
+}
+
+static void scheduler_push_remote(scheduler_t* target, thread_t* thread);
+
+/**
+ * A core running a single thread has its tick stopped, so it never balances
+ * on its own, hand it one of our threads if more than one is waiting
+ */
+static void scheduler_push_tickless(scheduler_t* scheduler) {
+    if (atomic_load_relaxed(&scheduler->nr_queued) < 2) {
+        return;
+    }
+
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        scheduler_t* other = pcpu_get_pointer_of(&m_scheduler, cpu);
+        if (other == scheduler || !atomic_load_acquire(&other->online)) {
+            continue;
+        }
+
+        // idle cores are kicked to steal on their own
+        if (
+            !atomic_load_relaxed(&other->tick_stopped) ||
+            atomic_load_relaxed(&other->is_idle) ||
+            atomic_load_relaxed(&other->nr_queued) != 0
+        ) {
+            continue;
+        }
+
+        list_t pushed = LIST_INIT(&pushed);
+        spinlock_acquire(&scheduler->lock);
+        size_t moved = scheduler_detach_locked(scheduler, other, 1, true, 0, &pushed);
+        spinlock_release(&scheduler->lock);
+
+        // none of our threads can run there, try another core
+        if (moved == 0) {
+            continue;
+        }
+
+        thread_t* thread = list_first_entry(&pushed, thread_t, link);
+        list_del(&thread->link);
+        atomic_fetch_add_explicit(&other->migrations, 1, memory_order_relaxed);
+        scheduler_push_remote(other, thread);
+        return;
+    }
+}
+
+/**
+ * Periodic balancing, pull half of the difference from the
+ * busiest core if it has more threads waiting than us
+ */
+static void scheduler_balance(scheduler_t* scheduler, uint64_t now) {
+    scheduler_t* busiest = scheduler_find_busiest(scheduler, 2);
+    if (busiest != nullptr) {
+        // moving a single thread would just move the imbalance around
+        size_t local = atomic_load_relaxed(&scheduler->nr_queued);
+        size_t remote = atomic_load_relaxed(&busiest->nr_queued);
+        if (remote > local + 1) {
+            atomic_fetch_add_explicit(&scheduler->imbalances, 1, memory_order_relaxed);
+            scheduler_pull(scheduler, busiest, (remote - local) / 2, false, now);
+            return;
+        }
+    }
+
+    scheduler_push_tickless(scheduler);
+}
+
+/**
+ * Select the next thread to run from the run queue, only taking threads that should
+ * preempt the previous thread if it can continue to run, if there is nothing to run
+ * and we are allowed then steal a thread from the busiest core
+ */
+static thread_t* scheduler_select_thread(scheduler_t* scheduler, thread_t* prev, bool steal, uint64_t now) {
+    thread_t* thread = scheduler_pop(scheduler, prev);
+    if (thread != nullptr || !steal) {
+        return thread;
+    }
+
+    // we are going idle anyways, so even a cache hot thread is
+    // better than nothing
+    scheduler_t* busiest = scheduler_find_busiest(scheduler, 1);
+    if (busiest != nullptr && scheduler_pull(scheduler, busiest, 1, true, now) != 0) {
+        atomic_fetch_add_explicit(&scheduler->steals, 1, memory_order_relaxed);
+        thread = scheduler_pop(scheduler, nullptr);
+    }
+
+    return thread;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Wakeups
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Move all the threads woken up by other cores into the run queue
+ */
+static void scheduler_drain_inbox(scheduler_t* scheduler) {
+    thread_t* thread = atomic_exchange_explicit(&scheduler->inbox, nullptr, memory_order_acquire);
+    if (thread == nullptr) {
+        return;
+    }
+
+    // the inbox is a stack, reverse it to queue in wakeup order
+    thread_t* reversed = nullptr;
+    while (thread != nullptr) {
+        thread_t* next = thread->inbox_next;
+        thread->inbox_next = reversed;
+        reversed = thread;
+        thread = next;
+    }
+
+    spinlock_acquire(&scheduler->lock);
+    while (reversed != nullptr) {
+        thread = reversed;
+        reversed = thread->inbox_next;
+        thread->inbox_next = nullptr;
+        scheduler_queue_locked(scheduler, thread);
+    }
+    spinlock_release(&scheduler->lock);
+}
+
+/**
+ * Make another core go through the scheduler, a core waiting in mwait
+ * only needs its idle word set, anything else needs an ipi
+ */
+static void scheduler_kick(scheduler_t* target) {
+    uint32_t flags = atomic_fetch_or(&target->idle_flags, SCHED_IDLE_NEED_RESCHED);
+    if (flags & SCHED_IDLE_POLLING) {
+        atomic_fetch_add_explicit(&target->idle_store_wakeups, 1, memory_order_relaxed);
+        return;
+    }
+
+    lapic_send_ipi_to(INTR_VECTOR_RESCHED, get_apic_id_of(target->cpu));
+}
+
+/**
+ * Push a thread into the inbox of another core, kicking it if it is idle
+ */
+static void scheduler_push_remote(scheduler_t* target, thread_t* thread) {
+    thread_t* head = atomic_load_relaxed(&target->inbox);
+    do {
+        thread->inbox_next = head;
+    } while (!atomic_compare_exchange_weak(&target->inbox, &head, thread));
+
+    // an idle core only looks at its inbox once something wakes it up, this
+    // pairs with the idle loop checking the inbox after it marked itself
+    // as idle, so one of us is going to see the other, the same goes for a
+    // core without a tick, and a busy core needs to be kicked if the thread
+    // should preempt what it is running
+    if (
+        atomic_load(&target->is_idle) ||
+        atomic_load(&target->tick_stopped) ||
+        scheduler_get_rank(thread) > atomic_load_relaxed(&target->current_rank)
+    ) {
+        scheduler_kick(target);
+    }
+}
+
+/**
+ * Choose the core a woken up thread should run on, out of the cores its affinity
+ * allows: its previous core if it is idle since the cache might still be warm,
+ * otherwise any idle core, otherwise the waker's core unless it is more loaded
+ * than the previous one, since the wakee is likely to consume what the waker
+ * just produced, and if neither is allowed then the least loaded allowed core.
  *
- * Its a thread local to make it easier to modify without
- * needing to disable interrupts or anything alike because
- * we don't have per-cpu variables that we can access
- * atomically.
+ * Threads with a home core go back to it first, always for the home placement
+ * and when it is idle for the spread placement, and spread threads skip the
+ * waker's core and go to the least loaded one instead.
  */
-static CPU_LOCAL int32_t m_preempt_count = 0;
+static scheduler_t* scheduler_select_wake_target(scheduler_t* scheduler, thread_t* thread) {
+    if (thread->placement != SCHED_PLACEMENT_DEFAULT) {
+        scheduler_t* home = pcpu_get_pointer_of(&m_scheduler, thread->home_cpu);
+        if (
+            scheduler_is_allowed(home, thread) && atomic_load_acquire(&home->online) &&
+            (thread->placement == SCHED_PLACEMENT_HOME || atomic_load_relaxed(&home->is_idle))
+        ) {
+            return home;
+        }
+    }
+
+    scheduler_t* prev = pcpu_get_pointer_of(&m_scheduler, thread->cpu);
+    bool prev_allowed = scheduler_is_allowed(prev, thread);
+    if (prev_allowed && atomic_load_relaxed(&prev->is_idle)) {
+        return prev;
+    }
+
+    scheduler_t* least_loaded = nullptr;
+    for (size_t i = 1; i < g_cpu_count; i++) {
+        scheduler_t* other = pcpu_get_pointer_of(&m_scheduler, (thread->cpu + i) % g_cpu_count);
+        if (!atomic_load_acquire(&other->online) || !scheduler_is_allowed(other, thread)) {
+            continue;
+        }
+
+        if (atomic_load_relaxed(&other->is_idle)) {
+            return other;
+        }
+
+        if (
+            least_loaded == nullptr ||
+            atomic_load_relaxed(&other->nr_queued) < atomic_load_relaxed(&least_loaded->nr_queued)
+        ) {
+            least_loaded = other;
+        }
+    }
+
+    if (thread->placement == SCHED_PLACEMENT_SPREAD) {
+        if (
+            prev_allowed &&
+            (least_loaded == nullptr || atomic_load_relaxed(&prev->nr_queued) <= atomic_load_relaxed(&least_loaded->nr_queued))
+        ) {
+            return prev;
+        }
+    } else if (
+        scheduler_is_allowed(scheduler, thread) &&
+        (!prev_allowed || atomic_load_relaxed(&scheduler->nr_queued) <= atomic_load_relaxed(&prev->nr_queued))
+    ) {
+        return scheduler;
+    }
+
+    if (prev_allowed) {
+        return prev;
+    }
+
+    if (least_loaded != nullptr) {
+        return least_loaded;
+    }
+
+    // during boot the allowed cores might not be online yet, the
+    // thread waits in the inbox of one of them until it comes up
+    for (size_t i = 0; i < g_cpu_count; i++) {
+        scheduler_t* other = pcpu_get_pointer_of(&m_scheduler, i);
+        if (scheduler_is_allowed(other, thread)) {
+            return other;
+        }
+    }
+
+    ASSERT(!"Thread is not allowed on any core");
+    return scheduler;
+}
 
 /**
- * Do we need to preempt whe restoring preempt count to zero?
+ * Place a thread that became ready on the core chosen for it
  */
-static CPU_LOCAL bool m_want_preempt = false;
+static void scheduler_place(scheduler_t* scheduler, thread_t* thread) {
+    scheduler_t* target = scheduler_select_wake_target(scheduler, thread);
+    if (target == scheduler) {
+        scheduler_enqueue(thread);
+    } else {
+        atomic_fetch_add_explicit(&target->remote_wakeups, 1, memory_order_relaxed);
+        scheduler_push_remote(target, thread);
+    }
+}
 
-thread_t* get_current_thread(void) {
-    return m_current;
+static void scheduler_account_wakeup(scheduler_t* scheduler, uint64_t latency) {
+    // convert to microseconds, clamping to avoid overflows
+    uint64_t us = MIN(latency, g_tsc_freq_hz) * US_PER_S / g_tsc_freq_hz;
+
+    size_t bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    bucket = MIN(bucket, SCHED_WAKEUP_LATENCY_BUCKETS - 1);
+    atomic_fetch_add_explicit(&scheduler->wakeup_latency[bucket], 1, memory_order_relaxed);
 }
 
 //----------------------------------------------------------------------------------------------------------------------
-// Private API
+// Tick
 //----------------------------------------------------------------------------------------------------------------------
 
-static scheduler_t* get_scheduler(void) {
-    return pcpu_get_pointer(&m_scheduler);
+/**
+ * Arm the tick to preempt the thread once its slice is over
+ */
+static void scheduler_start_tick(scheduler_t* scheduler, thread_t* thread) {
+    uint64_t slice = us_to_tsc(atomic_load_relaxed(&m_sched_slice_us[thread->sched_class]));
+    timer_set_deadline(&scheduler->timer, thread->exec_start + slice);
+    atomic_store_relaxed(&scheduler->tick_stopped, false);
 }
 
-static thread_t* scheduler_select_thread(scheduler_t* scheduler) {
-    if (list_is_empty(&scheduler->run_queue)) {
-        return scheduler->idle;
+/**
+ * Stop the tick, nothing is waiting for the cpu
+ */
+static void scheduler_stop_tick(scheduler_t* scheduler, uint64_t now) {
+    if (!atomic_load_relaxed(&scheduler->tick_stopped)) {
+        timer_cancel(&scheduler->timer);
+        atomic_store(&scheduler->tick_stopped, true);
+    }
+
+    // a remote wakeup that came after we drained the inbox might have seen
+    // the tick as running and not kicked us, go through the scheduler again
+    if (atomic_load(&scheduler->inbox) != nullptr) {
+        timer_set_deadline(&scheduler->timer, now);
     }
+}
 
-    thread_t* thread = list_first_entry(&scheduler->run_queue, thread_t, link);
-    list_del(&thread->link);
-    return thread;
+/**
+ * Kick an idle core to steal a thread that is waiting on our run queue
+ */
+static void scheduler_kick_idle(scheduler_t* scheduler) {
+    // pairs with the idle loop looking for waiting threads
+    // after it marked itself as idle
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        scheduler_t* other = pcpu_get_pointer_of(&m_scheduler, cpu);
+        if (other != scheduler && atomic_load_acquire(&other->online) && atomic_load_relaxed(&other->is_idle)) {
+            scheduler_kick(other);
+            return;
+        }
+    }
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Scheduling
+//----------------------------------------------------------------------------------------------------------------------
+
 static void scheduler_finish_park(thread_t* thread) {
     thread_state_t state = THREAD_STATE_PARKING;
+    sched_group_t* group = thread->group;
     if (atomic_compare_exchange_strong_release(&thread->state, &state, THREAD_STATE_PARKED)) {
         // We're done -- the thread is now safely parked and can no longer race with
         // `scheduler_try_unpark`. The release store above synchronizes-with the acquire fence
         // in `scheduler_try_unpark` to ensure that the thread's state is consistent if it ends
         // up being unparked on a different core.
+        if (group != nullptr) {
+            atomic_fetch_sub_explicit(&group->nr_runnable, 1, memory_order_relaxed);
+        }
         return;
     }
 
@@ -129,6 +971,9 @@ static void scheduler_after_schedule(void) {
     case LAST_THREAD_ACTION_PUT:
         thread_put(m_scheduler.last_thread);
         break;
+    case LAST_THREAD_ACTION_ENQUEUE:
+        scheduler_enqueue(m_scheduler.last_thread);
+        break;
     }
 
     m_scheduler.last_thread = nullptr;
@@ -142,23 +987,28 @@ void scheduler_schedule(void) {
 
     scheduler_t* scheduler = get_scheduler();
     thread_t* current = get_current_thread();
+    uint64_t now = get_tsc();
+
+    // can the current thread continue to run
+    bool runnable = false;
 
     thread_state_t state = atomic_load_relaxed(&current->state);
 
     if (state == THREAD_STATE_DEAD) {
         // The thread has died, drop the ref the scheduler owns.
         scheduler->last_thread_action = LAST_THREAD_ACTION_PUT;
+
+        // it no longer takes a share of its group
+        if (current->group != nullptr) {
+            atomic_fetch_sub_explicit(&current->group->nr_runnable, 1, memory_order_relaxed);
+            atomic_fetch_sub_explicit(&current->group->nr_threads, 1, memory_order_relaxed);
+        }
     } else if (state == THREAD_STATE_PARKING) {
         // Finish parking the thread once we've switched away from it.
         scheduler->last_thread_action = LAST_THREAD_ACTION_PARK;
     } else if (state == THREAD_STATE_RUNNING) {
-        // place back on the run queue and set the state as ready
-        atomic_store_relaxed(&current->state, THREAD_STATE_READY);
-
-        // only put non-idle threads into the run queue
-        if (current != scheduler->idle) {
-            list_add_tail(&scheduler->run_queue, &current->link);
-        }
+        // the idle thread only runs when there is nothing else to run
+        runnable = current != scheduler->idle;
     } else {
         ASSERT(!"Invalid thread state");
     }
@@ -166,18 +1016,129 @@ void scheduler_schedule(void) {
     // remember the last thread
     scheduler->last_thread = current;
 
-    // select a new thread
-    thread_t* new_thread = scheduler_select_thread(scheduler);
+    // account the time the thread ran, the idle thread never competes for the cpu
+    if (current != scheduler->idle) {
+        scheduler_charge(current, now);
+    }
+
+    // take in threads woken up by other cores
+    scheduler_drain_inbox(scheduler);
+
+    // periodically pull work from busier cores, idle
+    // cores instead steal when selecting a thread
+    if (runnable && now >= scheduler->next_balance) {
+        scheduler->next_balance = now + ms_to_tsc(SCHED_BALANCE_INTERVAL_MS);
+        scheduler_balance(scheduler, now);
+    }
+
+    // a thread whose affinity no longer allows this core must leave
+    // it, it is moved to another core once we switch away from it
+    bool stay = runnable && scheduler_is_allowed(scheduler, current);
+
+    // keep track of the lowest vruntime on the core before we select
+    bool fair = stay && current->sched_class == SCHED_CLASS_NORMAL;
+    scheduler_update_min_vruntime(scheduler, fair ? current : nullptr);
+
+    // a thread handed the cpu runs right away, unless the current thread
+    // continues to run or a higher ranked thread waits for the cpu, in
+    // which case it waits on the run queue like any other thread
+    thread_t* new_thread = nullptr;
+    thread_t* handoff = scheduler->handoff;
+    if (handoff != nullptr) {
+        scheduler->handoff = nullptr;
+
+        spinlock_acquire(&scheduler->lock);
+        uint32_t queued_rank = 64 - __builtin_clzll(scheduler->run_queues_bitmap | 1);
+        if (!stay && (scheduler->run_queues_bitmap == 0 || scheduler_get_rank(handoff) >= queued_rank)) {
+            if (handoff->sched_class == SCHED_CLASS_NORMAL) {
+                scheduler_place_vruntime(scheduler, handoff);
+            }
+            new_thread = handoff;
+        } else {
+            scheduler_queue_locked(scheduler, handoff);
+        }
+        spinlock_release(&scheduler->lock);
+
+        if (new_thread != nullptr) {
+            atomic_fetch_add_explicit(&scheduler->handoffs, 1, memory_order_relaxed);
+        }
+    }
+
+    // select a new thread, a runnable thread only gives up the cpu to
+    // threads with a higher rank or to normal threads that are behind it,
+    // if there is nothing else to run either continue with it or go idle
+    if (new_thread == nullptr) {
+        new_thread = scheduler_select_thread(scheduler, stay ? current : nullptr, !runnable, now);
+        if (new_thread == nullptr) {
+            new_thread = stay ? current : scheduler->idle;
+        }
+    }
+
+    if (new_thread != current) {
+        if (state == THREAD_STATE_RUNNING) {
+            // the thread is only placed back on the run queue once we have
+            // switched away from it, otherwise another core could steal it
+            // while we are still running on its stack
+            atomic_store_relaxed(&current->state, THREAD_STATE_READY);
+            if (runnable) {
+                scheduler->last_thread_action = LAST_THREAD_ACTION_ENQUEUE;
+            }
+        }
+
+        // for the cache hotness checks
+        current->last_ran = now;
+
+        // charge the thread for what it did until now, it continues
+        // doing the same once it is switched back in
+        scheduler_account_cpu_time(current, m_cpu_time_kind, now - m_cpu_time_since);
+        current->cpu_time_kind = m_cpu_time_kind;
+        current->off_cpu_since = now;
+        scheduler_flush_cpu_time(current);
+
+        // the thread is leaving the core, keep its vruntime relative
+        // to the core until it is placed on a run queue again
+        if (current != scheduler->idle && current->sched_class == SCHED_CLASS_NORMAL) {
+            current->vruntime -= atomic_load_relaxed(&scheduler->min_vruntime);
+        }
+
+        ASSERT(atomic_load_relaxed(&new_thread->state) == THREAD_STATE_READY);
+        atomic_store_relaxed(&new_thread->state, THREAD_STATE_RUNNING);
+        new_thread->cpu = scheduler->cpu;
+        new_thread->exec_start = now;
+
+        // the thread waited for the cpu since it was woken or preempted
+        if (new_thread != scheduler->idle) {
+            scheduler_account_cpu_time(new_thread, CPU_TIME_WAIT, now - new_thread->off_cpu_since);
+        }
+        m_cpu_time_kind = new_thread->cpu_time_kind;
+        m_cpu_time_since = now;
+        scheduler_publish_running(scheduler, new_thread, now);
+
+        // the first run since a notify woke it up
+        if (new_thread->wake_time != 0) {
+            scheduler_account_wakeup(scheduler, now - new_thread->wake_time);
+            new_thread->wake_time = 0;
+        }
+
+        // idle cores need to be kicked to notice remote wakeups
+        atomic_store(&scheduler->is_idle, new_thread == scheduler->idle);
+    }
+
+    // the idle thread has the lowest rank of all
+    uint32_t rank = new_thread == scheduler->idle ? 0 : scheduler_get_rank(new_thread);
+    atomic_store_relaxed(&scheduler->current_rank, rank);
 
-    ASSERT(atomic_load_relaxed(&new_thread->state) == THREAD_STATE_READY);
-    atomic_store_relaxed(&new_thread->state, THREAD_STATE_RUNNING);
+    // the tick is only needed when threads are waiting for the cpu, a preempted
+    // thread is placed back on the run queue only after we switched away from it
+    size_t waiting = atomic_load_relaxed(&scheduler->nr_queued);
+    if (new_thread != current && stay) {
+        waiting++;
+    }
 
-    // if the new thread is not the idle thread then setup
-    // a new preemption timer for 10ms
-    if (new_thread != scheduler->idle) {
-        timer_set_timeout(&scheduler->timer, 10);
+    if (new_thread != scheduler->idle && waiting != 0) {
+        scheduler_start_tick(scheduler, new_thread);
     } else {
-        timer_cancel(&scheduler->timer);
+        scheduler_stop_tick(scheduler, now);
     }
 
     if (new_thread != current) {
@@ -201,7 +1162,7 @@ static void schedule_timer_wakeup(timer_t* timer) {
 
     // wake up the thread if its not running already
     bool irq_state = irq_save();
-    scheduler_try_unpark(thread);
+    scheduler_try_unpark(thread, 0);
     irq_restore(irq_state);
 }
 
@@ -216,9 +1177,18 @@ void scheduler_schedule_deadline(uint64_t deadline) {
         .thread = thread
     };
 
+    // the thread only has to wake up some time after the deadline, so let it be
+    // a bit late and share the interrupt with other timers, real-time threads
+    // get exactly what they asked for
+    uint64_t slack = 0;
+    uint64_t now = get_tsc();
+    if (thread->sched_class != SCHED_CLASS_REALTIME && deadline > now) {
+        slack = MIN((deadline - now) / SCHED_TIMEOUT_SLACK_DIVISOR, us_to_tsc(SCHED_TIMEOUT_SLACK_MAX_US));
+    }
+
     // setup the timer, if we still race then the interrupt
     // will just fire as soon as we are done
-    timer_set_deadline(&timer.timer, deadline);
+    timer_set_deadline_slack(&timer.timer, deadline, slack);
 
     // schedule the thread now
     scheduler_schedule();
@@ -228,7 +1198,7 @@ void scheduler_schedule_deadline(uint64_t deadline) {
     timer_cancel(&timer.timer);
 }
 
-bool scheduler_try_unpark(thread_t* thread) {
+static bool scheduler_unpark(thread_t* thread, uint64_t wake_time, bool handoff) {
     ASSERT(!is_irq_enabled());
 
     bool should_enqueue = false;
@@ -254,14 +1224,70 @@ bool scheduler_try_unpark(thread_t* thread) {
     // Synchronizes-with release store in `scheduler_finish_park` to ensure we observe the thread's
     // pre-park state if it has migrated.
     atomic_fence_acquire();
-    scheduler_enqueue(thread);
+    thread->wake_time = wake_time;
+
+    // it was blocked since it left the cpu, from now on it waits for one
+    uint64_t now = get_tsc();
+    scheduler_account_cpu_time(thread, CPU_TIME_BLOCKED, now - thread->off_cpu_since);
+    thread->off_cpu_since = now;
+
+    if (thread->group != nullptr) {
+        atomic_fetch_add_explicit(&thread->group->nr_runnable, 1, memory_order_relaxed);
+    }
+
+    // only a single thread can be handed the cpu
+    scheduler_t* scheduler = get_scheduler();
+    if (handoff && scheduler->handoff == nullptr && scheduler_is_allowed(scheduler, thread)) {
+        scheduler->handoff = thread;
+    } else {
+        scheduler_place(scheduler, thread);
+    }
     return true;
 }
 
+bool scheduler_try_unpark(thread_t* thread, uint64_t wake_time) {
+    return scheduler_unpark(thread, wake_time, false);
+}
+
+bool scheduler_try_unpark_handoff(thread_t* thread, uint64_t wake_time) {
+    return scheduler_unpark(thread, wake_time, true);
+}
+
+void scheduler_wake(thread_t* thread) {
+    ASSERT(!is_irq_enabled());
+    scheduler_place(get_scheduler(), thread);
+}
+
 void scheduler_enqueue(thread_t *thread) {
     scheduler_t* scheduler = get_scheduler();
+
+    // the affinity of the thread changed while it ran here, move it
+    // to a core it is allowed on, its vruntime is relative already
+    if (!scheduler_is_allowed(scheduler, thread)) {
+        scheduler_t* target = scheduler_select_wake_target(scheduler, thread);
+        if (target != scheduler) {
+            scheduler_push_remote(target, thread);
+            return;
+        }
+    }
+
     // place on the run queue
-    list_add_tail(&scheduler->run_queue, &thread->link);
+    spinlock_acquire(&scheduler->lock);
+    scheduler_queue_locked(scheduler, thread);
+    spinlock_release(&scheduler->lock);
+
+    // preempt the current thread as soon as possible if the new thread
+    // has a higher rank, otherwise it has to wait for the cpu, so start
+    // the tick and let an idle core take it
+    uint32_t current_rank = atomic_load_relaxed(&scheduler->current_rank);
+    if (scheduler_get_rank(thread) > current_rank) {
+        m_want_preempt = true;
+    } else {
+        if (atomic_load_relaxed(&scheduler->tick_stopped)) {
+            scheduler_start_tick(scheduler, get_current_thread());
+        }
+        scheduler_kick_idle(scheduler);
+    }
 }
 
 /**
@@ -276,6 +1302,101 @@ static void scheduler_tick(timer_t* timer) {
     m_want_preempt = true;
 }
 
+void scheduler_handle_resched_ipi(void) {
+    // the scheduler will take the threads from the inbox,
+    // just make sure we go through it once the irq is done
+    preempt_disable();
+    m_want_preempt = true;
+    preempt_enable();
+}
+
+/**
+ * Choose the mwait hint for the idle period, the deepest c-state that
+ * pays off before the next timer fires, without a timer we don't know
+ * when we will wake up so the deepest one
+ */
+static uint32_t scheduler_select_cstate(scheduler_t* scheduler, uint64_t now) {
+    uint64_t idle_us = UINT64_MAX;
+    uint64_t deadline = timer_get_next_deadline();
+    if (deadline != 0) {
+        idle_us = deadline > now ? tsc_to_us(deadline - now) : 0;
+    }
+
+    uint32_t cstate = 1;
+    for (uint32_t i = 2; i < ARRAY_LENGTH(m_sched_cstate_residency_us); i++) {
+        if ((scheduler->mwait_cstates & (1u << i)) && idle_us >= m_sched_cstate_residency_us[i]) {
+            cstate = i;
+        }
+    }
+
+    // the hint holds the c-state minus one, with the first sub-state
+    return (cstate - 1) << 4;
+}
+
+/**
+ * Wait until there might be something to run, returns right away if
+ * there is already work waiting
+ */
+static void scheduler_idle(scheduler_t* scheduler) {
+    // from now on anyone that wants to wake us only has to set need resched,
+    // this also clears any need resched left from when we were busy
+    if (scheduler->mwait_supported) {
+        atomic_store(&scheduler->idle_flags, SCHED_IDLE_POLLING);
+    }
+
+    // we are marked as idle, so anyone pushing to the inbox from
+    // now on is going to kick us, catch anything pushed before that
+    if (atomic_load(&scheduler->inbox) != nullptr) {
+        goto done;
+    }
+
+    // the same goes for threads waiting on the run queue of busy
+    // cores, go through the scheduler again to steal them
+    atomic_thread_fence(memory_order_seq_cst);
+    if (scheduler_find_busiest(scheduler, 1) != nullptr) {
+        goto done;
+    }
+
+    uint64_t start = get_tsc();
+    if (scheduler->mwait_supported) {
+        uint32_t hint = scheduler_select_cstate(scheduler, start);
+
+        // arm the monitor and only then check the word, so a store
+        // that comes after the check is going to end the mwait
+        asm volatile ("monitor" : : "a"(&scheduler->idle_flags), "c"(0), "d"(0) : "memory");
+        if ((atomic_load(&scheduler->idle_flags) & SCHED_IDLE_NEED_RESCHED) == 0) {
+            // like hlt, the sti makes sure interrupts only come in once
+            // we are in the mwait, interrupts end the mwait as well
+            asm volatile (
+                "sti\n"
+                "mwait\n"
+                "cli\n"
+                :
+                : "a"(hint), "c"(0)
+                : "memory"
+            );
+        }
+    } else {
+        // hlt, we need the sti to come right before it to make sure
+        // we atomically hlt and enable interrupts
+        asm volatile (
+            "sti\n"
+            "hlt\n"
+            "cli\n"
+        );
+    }
+
+    atomic_fetch_add_explicit(&scheduler->idle_entries, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&scheduler->idle_time, get_tsc() - start, memory_order_relaxed);
+
+done:
+    // anyone waking us from now on sends an ipi, this synchronizes
+    // with whoever set need resched, so we see what they pushed
+    if (scheduler->mwait_supported) {
+        atomic_exchange(&scheduler->idle_flags, 0);
+    }
+}
+
 static void scheduler_idle_thread(void* arg) {
     scheduler_t* scheduler = get_scheduler();
 
@@ -287,14 +1408,15 @@ static void scheduler_idle_thread(void* arg) {
         // attempt to schedule, this will return once there is no 
         // more work to run
         scheduler_schedule();
-        
-        // hlt, we need the sti to come right before it to make sure 
-        // we atomically hlt and enable interrupts
-        asm volatile (
-            "sti\n"
-            "hlt\n"
-            "cli\n"
-        );
+
+        // we have nothing else to do, free any dead threads, one
+        // at a time so we check for more work in between them
+        if (thread_reaper_pending()) {
+            thread_reap();
+            continue;
+        }
+
+        scheduler_idle(scheduler);
     }
 }
 
@@ -316,14 +1438,48 @@ OMIT_ENDBR void thread_entry_point(thread_t* thread, thread_entry_t entry, void*
 INIT_CODE void init_sched_per_core(void) {
     // setup the scheduler context
     scheduler_t* scheduler = get_scheduler();
-    list_init(&scheduler->run_queue);
+    for (size_t i = 0; i < SCHED_QUEUE_COUNT; i++) {
+        list_init(&scheduler->run_queues[i]);
+    }
+    scheduler->fair_queue = RB_ROOT_CACHED;
+
+    // we start on the idle thread, without a tick
+    atomic_store_relaxed(&scheduler->tick_stopped, true);
 
     // the timer callback we use
     scheduler->timer.callback = scheduler_tick;
+    scheduler->cpu = get_cpu_id();
+
+    // idle with mwait if we can, C1 is always there, the deeper
+    // c-states are only known if the extensions are enumerated
+    uint32_t a, b, d;
+    CPUID_VERSION_INFO_ECX version_info_ecx = {};
+    CPUID_MONITOR_MWAIT_ECX monitor_mwait_ecx = {};
+    CPUID_MONITOR_MWAIT_EDX monitor_mwait_edx = {};
+    __cpuid(CPUID_VERSION_INFO, a, b, version_info_ecx.raw, d);
+    if (version_info_ecx.MONITOR) {
+        scheduler->mwait_supported = true;
+        scheduler->mwait_cstates = BIT1;
+
+        __cpuid(CPUID_MONITOR_MWAIT, a, b, monitor_mwait_ecx.raw, monitor_mwait_edx.raw);
+        if (monitor_mwait_ecx.MONITOR_MWAIT_EXTENSIONS) {
+            for (uint32_t i = 2; i < ARRAY_LENGTH(m_sched_cstate_residency_us); i++) {
+                if (((monitor_mwait_edx.raw >> (i * 4)) & 0xF) != 0) {
+                    scheduler->mwait_cstates |= 1u << i;
+                }
+            }
+        }
+    }
+
+    // setup the dead thread reaper
+    init_thread_reaper_per_core();
 
     // setup the idle thread
     scheduler->idle = thread_create(scheduler_idle_thread, nullptr, 0, "idle-%d", get_cpu_id());
     ASSERT(scheduler->idle != nullptr);
+
+    // other cores can now pull work from us
+    atomic_store_release(&scheduler->online, true);
 }
 
 INIT_CODE void sched_start_per_core(void) {
@@ -333,9 +1489,14 @@ INIT_CODE void sched_start_per_core(void) {
 
     // start by running the idle threads, just to get into a stable
     // stack, from there we will do the rest
-    thread_t* thread = get_scheduler()->idle;
+    scheduler_t* scheduler = get_scheduler();
+    thread_t* thread = scheduler->idle;
     atomic_store_relaxed(&thread->state, THREAD_STATE_RUNNING);
+    atomic_store(&scheduler->is_idle, true);
     m_current = thread;
+    m_cpu_time_kind = thread->cpu_time_kind;
+    m_cpu_time_since = get_tsc();
+    scheduler_publish_running(scheduler, thread, m_cpu_time_since);
     thread_bootstrap(thread);
 }
 
@@ -355,6 +1516,219 @@ void sched_yield(void) {
     }
 }
 
+bool sched_get_stats(size_t cpu, sched_stats_t* stats) {
+    if (cpu >= g_cpu_count) {
+        return false;
+    }
+
+    scheduler_t* scheduler = pcpu_get_pointer_of(&m_scheduler, cpu);
+    stats->nr_queued = atomic_load_relaxed(&scheduler->nr_queued);
+    stats->migrations = atomic_load_relaxed(&scheduler->migrations);
+    stats->steals = atomic_load_relaxed(&scheduler->steals);
+    stats->imbalances = atomic_load_relaxed(&scheduler->imbalances);
+    stats->remote_wakeups = atomic_load_relaxed(&scheduler->remote_wakeups);
+    stats->handoffs = atomic_load_relaxed(&scheduler->handoffs);
+    timer_get_stats(cpu, &stats->timer_interrupts, &stats->timer_writes, &stats->timer_skipped_writes, &stats->timer_expired);
+    stats->idle_entries = atomic_load_relaxed(&scheduler->idle_entries);
+    stats->idle_us = tsc_to_us(atomic_load_relaxed(&scheduler->idle_time));
+    stats->idle_store_wakeups = atomic_load_relaxed(&scheduler->idle_store_wakeups);
+    for (size_t i = 0; i < SCHED_WAKEUP_LATENCY_BUCKETS; i++) {
+        stats->wakeup_latency[i] = atomic_load_relaxed(&scheduler->wakeup_latency[i]);
+    }
+    return true;
+}
+
+cpu_time_kind_t sched_account_enter(cpu_time_kind_t kind) {
+    bool irq_state = irq_save();
+
+    cpu_time_kind_t prev = m_cpu_time_kind;
+    thread_t* current = m_current;
+    if (current != nullptr) {
+        uint64_t now = get_tsc();
+        scheduler_account_cpu_time(current, prev, now - m_cpu_time_since);
+        m_cpu_time_since = now;
+    }
+    m_cpu_time_kind = kind;
+
+    irq_restore(irq_state);
+    return prev;
+}
+
+void sched_flush_cpu_time(void) {
+    bool irq_state = irq_save();
+    sched_account_enter(m_cpu_time_kind);
+    scheduler_flush_cpu_time(m_current);
+    scheduler_publish_running(get_scheduler(), m_current, m_cpu_time_since);
+    irq_restore(irq_state);
+}
+
+void sched_get_group_running_time(sched_group_t* group, uint64_t* cpu_time) {
+    uint64_t now = get_tsc();
+
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        scheduler_t* other = pcpu_get_pointer_of(&m_scheduler, cpu);
+
+        // the core is in the middle of publishing
+        uint64_t since = atomic_load_acquire(&other->running_since);
+        if (since == 0) {
+            continue;
+        }
+
+        sched_group_t* running_group = atomic_load_relaxed(&other->running_group);
+        cpu_time_kind_t kind = atomic_load_relaxed(&other->running_kind);
+
+        // if the core switched or flushed in the meantime the group and
+        // kind might not match the since, and the time is already in the
+        // group anyway, don't count it twice
+        atomic_fence_acquire();
+        if (atomic_load_relaxed(&other->running_since) != since) {
+            continue;
+        }
+
+        if (running_group != group || now <= since) {
+            continue;
+        }
+
+        cpu_time[kind] += now - since;
+    }
+}
+
+void sched_get_cpu_time(cpu_time_stats_t* stats) {
+    bool irq_state = irq_save();
+    thread_t* current = m_current;
+    sched_account_enter(m_cpu_time_kind);
+    stats->user_ns = tsc_to_ns(atomic_load_relaxed(&current->cpu_time[CPU_TIME_USER]));
+    stats->kernel_ns = tsc_to_ns(atomic_load_relaxed(&current->cpu_time[CPU_TIME_KERNEL]));
+    stats->irq_ns = tsc_to_ns(atomic_load_relaxed(&current->cpu_time[CPU_TIME_IRQ]));
+    stats->wait_ns = tsc_to_ns(atomic_load_relaxed(&current->cpu_time[CPU_TIME_WAIT]));
+    stats->blocked_ns = tsc_to_ns(atomic_load_relaxed(&current->cpu_time[CPU_TIME_BLOCKED]));
+    irq_restore(irq_state);
+}
+
+bool sched_param_is_valid(const sched_param_t* param) {
+    switch (param->sched_class) {
+        case SCHED_CLASS_NORMAL: return param->priority < SCHED_NORMAL_PRIORITY_COUNT;
+        case SCHED_CLASS_REALTIME: return param->priority < SCHED_RT_PRIORITY_COUNT;
+        case SCHED_CLASS_IDLE: return param->priority == 0;
+        default: return false;
+    }
+}
+
+bool sched_set_slice(sched_class_t sched_class, uint32_t slice_us) {
+    if (sched_class > SCHED_CLASS_IDLE || slice_us < SCHED_SLICE_MIN_US || slice_us > SCHED_SLICE_MAX_US) {
+        return false;
+    }
+
+    // takes effect the next time the tick is armed
+    atomic_store_relaxed(&m_sched_slice_us[sched_class], slice_us);
+    return true;
+}
+
+void sched_get_param(thread_t* thread, sched_param_t* param) {
+    param->sched_class = thread->sched_class;
+    param->priority = thread->priority;
+}
+
+void sched_set_param(thread_t* thread, const sched_param_t* param) {
+    ASSERT(sched_param_is_valid(param));
+
+    // the thread is either not started yet or is the current thread,
+    // so it can't be on a run queue right now
+    thread_t* current = get_current_thread();
+    ASSERT(thread == current || atomic_load_relaxed(&thread->state) == THREAD_STATE_IDLE);
+
+    bool irq_state = irq_save();
+    if (thread == current) {
+        // account the time so far under the old parameters, a thread
+        // joining the normal class starts at the min vruntime
+        scheduler_t* scheduler = get_scheduler();
+        scheduler_charge(thread, get_tsc());
+        if (thread->sched_class != SCHED_CLASS_NORMAL) {
+            thread->vruntime = atomic_load_relaxed(&scheduler->min_vruntime);
+        }
+    }
+
+    thread->sched_class = param->sched_class;
+    thread->priority = param->priority;
+    if (thread == current) {
+        atomic_store_relaxed(&get_scheduler()->current_rank, scheduler_get_rank(thread));
+    }
+    irq_restore(irq_state);
+
+    // if we lowered our own rank let anything with
+    // a higher rank run right away
+    if (thread == current) {
+        sched_yield();
+    }
+}
+
+void sched_set_group(thread_t* thread, sched_group_t* group) {
+    // the group counts are only updated once the thread starts
+    ASSERT(atomic_load_relaxed(&thread->state) == THREAD_STATE_IDLE);
+
+    if (group != nullptr) {
+        kernel_object_get(&group->object);
+    }
+
+    if (thread->group != nullptr) {
+        kernel_object_put(&thread->group->object);
+    }
+
+    thread->group = group;
+}
+
+bool sched_affinity_is_valid(const cpu_mask_t* mask) {
+    for (size_t cpu = 0; cpu < g_cpu_count; cpu++) {
+        if (cpu_mask_test(mask, cpu)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void sched_get_affinity(thread_t* thread, cpu_mask_t* mask) {
+    *mask = thread->affinity;
+}
+
+void sched_set_affinity(thread_t* thread, const cpu_mask_t* mask) {
+    ASSERT(sched_affinity_is_valid(mask));
+
+    // the thread is either not started yet or is the current thread,
+    // so it can't be on a run queue right now
+    thread_t* current = get_current_thread();
+    ASSERT(thread == current || atomic_load_relaxed(&thread->state) == THREAD_STATE_IDLE);
+
+    bool irq_state = irq_save();
+    thread->affinity = *mask;
+    bool allowed = scheduler_is_allowed(get_scheduler(), thread);
+    irq_restore(irq_state);
+
+    // move away right now if we can no longer run here
+    if (thread == current && !allowed) {
+        sched_yield();
+    }
+}
+
+void sched_set_placement(thread_t* thread, size_t home_cpu, sched_placement_t placement) {
+    ASSERT(atomic_load_relaxed(&thread->state) == THREAD_STATE_IDLE);
+
+    // the thread is placed as if it last ran on its home
+    if (home_cpu < g_cpu_count) {
+        thread->cpu = home_cpu;
+        thread->home_cpu = home_cpu;
+        thread->placement = placement;
+    }
+}
+
+void sched_preempt_point(void) {
+    if (m_want_preempt && m_preempt_count == 0 && is_irq_enabled()) {
+        irq_disable();
+        m_want_preempt = false;
+        scheduler_schedule();
+        irq_enable();
+    }
+}
+
 void preempt_disable(void) {
     ASSERT(m_preempt_count >= 0);
     m_preempt_count++;
@@ -5,6 +5,7 @@
 
 #include "lib/except.h"
 #include "thread.h"
+#include "uapi/sched.h"
 
 INIT_CODE void init_sched_per_core(void);
 
@@ -30,8 +31,25 @@ void scheduler_schedule_deadline(uint64_t deadline);
 
 /**
  * Unparks the requested thread, if it is currently parked.
+ *
+ * The thread is placed on the core chosen by the wake policy, the wake
+ * time is the tsc of the notify that caused it, or zero if there is none
+ */
+bool scheduler_try_unpark(thread_t* thread, uint64_t wake_time);
+
+/**
+ * Unparks the requested thread like `scheduler_try_unpark`, but instead of
+ * placing it, it takes over the current core once the current thread switches
+ * away, the caller must be about to park. Falls back to a normal wake if the
+ * thread can't run here.
  */
-bool scheduler_try_unpark(thread_t* thread);
+bool scheduler_try_unpark_handoff(thread_t* thread, uint64_t wake_time);
+
+/**
+ * Place a thread that just became ready on a core, either the
+ * current one or another core it is allowed to run on
+ */
+void scheduler_wake(thread_t* thread);
 
 /**
  * Enqueues the requested thread for execution on the current core.
@@ -39,6 +57,18 @@ bool scheduler_try_unpark(thread_t* thread);
  */
 void scheduler_enqueue(thread_t* thread);
 
+/**
+ * Get the rank of the thread, derived from its class and priority,
+ * waking up a thread with a higher rank preempts the running thread
+ */
+uint32_t scheduler_get_rank(thread_t* thread);
+
+/**
+ * Handle a reschedule IPI, sent to idle cores when a thread
+ * was woken up into their inbox
+ */
+void scheduler_handle_resched_ipi(void);
+
 //----------------------------------------------------------------------------------------------------------------------
 // Public API
 //----------------------------------------------------------------------------------------------------------------------
@@ -53,6 +83,103 @@ void sched_yield(void);
  */
 thread_t* get_current_thread(void);
 
+/**
+ * Get the scheduler statistics of the given core
+ *
+ * @param cpu       [IN]    The core to get the stats of
+ * @param stats     [OUT]   The stats of the core
+ * @return false if the core does not exist
+ */
+bool sched_get_stats(size_t cpu, sched_stats_t* stats);
+
+/**
+ * Charge the current thread for what it did until now, and from now on
+ * charge it for the given kind, used when entering and leaving syscalls
+ * and interrupts
+ *
+ * @param kind      [IN]    What the thread is about to do
+ * @return what the thread was doing until now
+ */
+cpu_time_kind_t sched_account_enter(cpu_time_kind_t kind);
+
+/**
+ * Add the cpu time of the current thread to its group, so the group
+ * stats are up to date even if the thread did not leave the cpu
+ */
+void sched_flush_cpu_time(void);
+
+/**
+ * Add the time the threads of the group currently running on any core got
+ * since they last added their time to the group, all of it is counted as
+ * what each thread was doing when it last added its time
+ *
+ * @param group     [IN]        The group to look for
+ * @param cpu_time  [IN/OUT]    The cpu time by kind, in tsc ticks
+ */
+void sched_get_group_running_time(sched_group_t* group, uint64_t* cpu_time);
+
+/**
+ * Get where the time of the current thread went
+ */
+void sched_get_cpu_time(cpu_time_stats_t* stats);
+
+/**
+ * Set the time slice of the class, returns false if out of range
+ */
+bool sched_set_slice(sched_class_t sched_class, uint32_t slice_us);
+
+/**
+ * Check that the scheduling parameters are in range for their class
+ */
+bool sched_param_is_valid(const sched_param_t* param);
+
+/**
+ * Get the scheduling parameters of the thread
+ */
+void sched_get_param(thread_t* thread, sched_param_t* param);
+
+/**
+ * Set the scheduling parameters of the thread, the thread must either be
+ * the current thread or one that was not started yet
+ */
+void sched_set_param(thread_t* thread, const sched_param_t* param);
+
+/**
+ * Set the scheduling group of the thread, taking a reference to the
+ * group, the thread must not be started yet
+ */
+void sched_set_group(thread_t* thread, sched_group_t* group);
+
+/**
+ * Check that the mask allows at least one existing cpu
+ */
+bool sched_affinity_is_valid(const cpu_mask_t* mask);
+
+/**
+ * Get the cpus the thread is allowed to run on
+ */
+void sched_get_affinity(thread_t* thread, cpu_mask_t* mask);
+
+/**
+ * Set the cpus the thread is allowed to run on, the thread must either
+ * be the current thread or one that was not started yet, the current
+ * thread moves right away if the mask no longer allows its core
+ */
+void sched_set_affinity(thread_t* thread, const cpu_mask_t* mask);
+
+/**
+ * Set the home core of a thread that was not started yet, the thread starts
+ * on it and is placed relative to it on every wakeup, the affinity of the
+ * thread still takes priority, out of range is ignored
+ */
+void sched_set_placement(thread_t* thread, size_t home_cpu, sched_placement_t placement);
+
+/**
+ * Reschedule right away if a higher ranked thread was woken up on this
+ * core, does nothing if preemption or interrupts are disabled
+ */
+void sched_preempt_point(void);
+
 /**
  * Disable preemption, supports nesting
  */
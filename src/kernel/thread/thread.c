@@ -2,6 +2,7 @@
 
 #include <x86intrin.h>
 
+#include "group.h"
 #include "sched.h"
 #include "arch/intrin.h"
 #include "lib/assert.h"
@@ -11,10 +12,18 @@
 #include "arch/regs.h"
 #include "lib/atomic.h"
 #include "lib/except.h"
+#include "lib/log.h"
 #include "lib/printf.h"
+#include "lib/string.h"
 #include "lib/tsc.h"
 #include "mem/alloc.h"
+#include "mem/direct.h"
+#include "mem/phys.h"
 #include "mem/stack.h"
+#include "mem/virt.h"
+#include "mem/vmar.h"
+#include "uapi/page.h"
+#include "lib/pcpu.h"
 
 /**
  * The saved state when switching between threads
@@ -36,11 +45,125 @@ typedef struct thread_entry_frame {
  */
 static mem_alloc_t m_thread_alloc;
 
-INIT_CODE void init_threads(void) {
-    // Get the extended state size to allocate along size the thread itself
+/**
+ * The amount of pending dead threads at which thread_create
+ * frees some of them itself
+ */
+#define THREAD_REAPER_BATCH     32
+
+typedef struct thread_reaper {
+    /**
+     * Dead threads waiting to be freed
+     */
+    list_t dead;
+
+    /**
+     * The amount of threads in the dead list
+     */
+    size_t count;
+} thread_reaper_t;
+
+/**
+ * Per-core list of dead threads, threads are queued on the core that
+ * dropped the last ref and are freed from that core's idle thread
+ */
+static CPU_LOCAL thread_reaper_t m_thread_reaper;
+
+/**
+ * The allocator for kernel threads, which have no extended state
+ */
+static mem_alloc_t m_kernel_thread_alloc;
+
+/**
+ * The thread whose extended state is in the registers of this core, kernel
+ * threads don't touch the registers so it stays there while they run
+ */
+static CPU_LOCAL thread_t* m_fpu_owner = nullptr;
+
+static_assert(sizeof(thread_run_page_t) <= PAGE_SIZE, "The run page must fit in a single page");
+
+/**
+ * The run page, written through the direct map
+ */
+LATE_RO static thread_run_page_t* m_run_page;
+
+/**
+ * The slots of the run page that are in use
+ */
+static uint64_t m_run_slots[THREAD_RUN_SLOTS / 64];
+static irq_spinlock_t m_run_slots_lock = IRQ_SPINLOCK_INIT;
+
+/**
+ * The value last loaded into the TSC_AUX of this core, starts out of
+ * range of any slot so the first user thread always loads it
+ */
+static CPU_LOCAL uint64_t m_tsc_aux = UINT64_MAX;
+
+LATE_RO bool g_xsaves_supported = false;
+
+INIT_CODE err_t init_threads(void) {
+    err_t err = NO_ERROR;
+
+    // Get the extended state size to allocate along size the thread itself,
+    // the compacted format only takes the space of the enabled features
     uint32_t a, xsave_area_size, c, d;
-    __cpuid_count(CPUID_EXTENDED_STATE, CPUID_EXTENDED_STATE_MAIN_LEAF, a, xsave_area_size, c, d);
+    if (g_xsaves_supported) {
+        __cpuid_count(CPUID_EXTENDED_STATE, CPUID_EXTENDED_STATE_SUB_LEAF, a, xsave_area_size, c, d);
+    } else {
+        __cpuid_count(CPUID_EXTENDED_STATE, CPUID_EXTENDED_STATE_MAIN_LEAF, a, xsave_area_size, c, d);
+    }
+    TRACE("thread: extended state is %u bytes", xsave_area_size);
+
     mem_alloc_init(&m_thread_alloc, sizeof(thread_t) + xsave_area_size, alignof(thread_t));
+    mem_alloc_init(&m_kernel_thread_alloc, sizeof(thread_t), alignof(thread_t));
+
+    m_run_page = phys_alloc(PAGE_SIZE);
+    CHECK_ERROR(m_run_page != nullptr, ERROR_OUT_OF_MEMORY);
+    memset(m_run_page, 0, PAGE_SIZE);
+
+cleanup:
+    return err;
+}
+
+uint64_t thread_get_run_page_phys(void) {
+    return direct_to_phys(m_run_page);
+}
+
+static uint32_t thread_run_slot_alloc(void) {
+    uint32_t slot = THREAD_RUN_SLOT_NONE;
+
+    bool irq_state = irq_spinlock_acquire(&m_run_slots_lock);
+    for (size_t i = 0; i < ARRAY_LENGTH(m_run_slots); i++) {
+        if (m_run_slots[i] != UINT64_MAX) {
+            size_t bit = __builtin_ctzll(~m_run_slots[i]);
+            m_run_slots[i] |= 1ull << bit;
+            slot = i * 64 + bit;
+            break;
+        }
+    }
+    irq_spinlock_release(&m_run_slots_lock, irq_state);
+
+    return slot;
+}
+
+static void thread_run_slot_free(uint32_t slot) {
+    if (slot == THREAD_RUN_SLOT_NONE) {
+        return;
+    }
+
+    bool irq_state = irq_spinlock_acquire(&m_run_slots_lock);
+    m_run_slots[slot / 64] &= ~(1ull << (slot % 64));
+    irq_spinlock_release(&m_run_slots_lock, irq_state);
+}
+
+static mem_alloc_t* thread_get_alloc(thread_flags_t flags) {
+    return (flags & THREAD_FLAG_USER) ? &m_thread_alloc : &m_kernel_thread_alloc;
+}
+
+INIT_CODE void init_thread_reaper_per_core(void) {
+    thread_reaper_t* reaper = pcpu_get_pointer(&m_thread_reaper);
+    list_init(&reaper->dead);
+    reaper->count = 0;
 }
 
 static void thread_free(thread_t* thread) {
@@ -53,18 +176,98 @@ static void thread_free(thread_t* thread) {
             stack_free(thread->user_stack, true);
         }
 
-        mem_free(&m_thread_alloc, thread);
+        if (thread->group != nullptr) {
+            kernel_object_put(&thread->group->object);
+        }
+
+        thread_run_slot_free(thread->run_slot);
+
+        mem_free(thread_get_alloc(thread->flags), thread);
     }
 }
 
+static void thread_reaper_queue(thread_t* thread) {
+    bool irq_state = irq_save();
+    thread_reaper_t* reaper = pcpu_get_pointer(&m_thread_reaper);
+    list_add_tail(&reaper->dead, &thread->link);
+    reaper->count++;
+    irq_restore(irq_state);
+}
+
+static size_t thread_reaper_pending_count(void) {
+    bool irq_state = irq_save();
+    size_t count = pcpu_get_pointer(&m_thread_reaper)->count;
+    irq_restore(irq_state);
+    return count;
+}
+
+bool thread_reaper_pending(void) {
+    return thread_reaper_pending_count() != 0;
+}
+
+void thread_reap(void) {
+    // this runs without interrupts, the vmar lock is keyed by the core so
+    // nothing else may run on this core while we hold it, and the freed
+    // stacks go to the stack cache of this core before their pages are
+    // released, so only a single thread is freed to keep this section short
+    bool irq_state = irq_save();
+
+    thread_t* thread = nullptr;
+    thread_reaper_t* reaper = pcpu_get_pointer(&m_thread_reaper);
+    if (!list_is_empty(&reaper->dead)) {
+        thread = list_first_entry(&reaper->dead, thread_t, link);
+        list_del(&thread->link);
+        reaper->count--;
+    }
+
+    if (thread != nullptr) {
+        // the stack and shadow stack share the same TLB shootdown
+        vmar_lock();
+        virt_unmap_batch_begin();
+        thread_free(thread);
+        virt_unmap_batch_end();
+        vmar_unlock();
+    }
+
+    irq_restore(irq_state);
+}
+
 thread_t* thread_create(thread_entry_t entry_point, void* arg, thread_flags_t flags, const char* name_fmt, ...) {
     err_t err = NO_ERROR;
 
+    // if we have a lot of dead threads pending on this core free a batch
+    // of them before creating more, this makes sure busy cores that never
+    // get to idle don't grow without bound, each one is freed on its own
+    // so interrupts are not held off for the entire batch
+    if (thread_reaper_pending_count() >= THREAD_REAPER_BATCH) {
+        for (size_t i = 0; i < THREAD_REAPER_BATCH; i++) {
+            thread_reap();
+        }
+    }
+
     // allocate the thread itself
-    thread_t* thread = mem_calloc(&m_thread_alloc);
+    thread_t* thread = mem_calloc(thread_get_alloc(flags));
     CHECK_ERROR(thread != nullptr, ERROR_OUT_OF_MEMORY);
     thread->flags = flags;
 
+    // threads start as normal threads that can run anywhere,
+    // starting next to the core that created them
+    thread->sched_class = SCHED_CLASS_NORMAL;
+    thread->priority = SCHED_NORMAL_PRIORITY_DEFAULT;
+    memset(&thread->affinity, 0xFF, sizeof(thread->affinity));
+    thread->cpu = get_cpu_id();
+    thread->fpu_cpu = -1;
+
+    // only user threads spin on each other
+    thread->run_slot = THREAD_RUN_SLOT_NONE;
+    if (flags & THREAD_FLAG_USER) {
+        thread->run_slot = thread_run_slot_alloc();
+    }
+
+    // a user thread is in usermode for every accounting purpose
+    // until it makes a syscall or gets interrupted
+    thread->cpu_time_kind = (flags & THREAD_FLAG_USER) ? CPU_TIME_USER : CPU_TIME_KERNEL;
+
     // start with ref count of one
     thread->ref_count = 1;
     atomic_store_relaxed(&thread->state, THREAD_STATE_IDLE);
@@ -104,9 +307,17 @@ thread_t* thread_create(thread_entry_t entry_point, void* arg, thread_flags_t fl
     entry_frame->rsi = (uintptr_t)entry_point;
     entry_frame->rdx = (uintptr_t)arg;
 
-    // setup the extended state
-    xsave_legacy_region_t* extended_state = (xsave_legacy_region_t*)thread->extended_state;
-    extended_state->mxscr = 0x00001f80;
+    // setup the extended state, everything starts in its init state
+    if (flags & THREAD_FLAG_USER) {
+        xsave_legacy_region_t* extended_state = (xsave_legacy_region_t*)thread->extended_state;
+        extended_state->mxscr = 0x00001f80;
+
+        // xrstors only takes the compacted format
+        if (g_xsaves_supported) {
+            xsave_header_t* header = (xsave_header_t*)(thread->extended_state + sizeof(xsave_legacy_region_t));
+            header->xcomp_bv = XSAVE_XCOMP_BV_COMPACTED;
+        }
+    }
 
 cleanup:
     if (IS_ERROR(err)) {
@@ -120,7 +331,17 @@ void thread_start(thread_t* thread) {
     bool irq_state = irq_save();
     ASSERT(atomic_load_relaxed(&thread->state) == THREAD_STATE_IDLE);
     atomic_store_relaxed(&thread->state, THREAD_STATE_READY);
-    scheduler_enqueue(thread);
+
+    // from now on the thread waits for a cpu
+    thread->off_cpu_since = get_tsc();
+
+    // the thread now counts towards the share of its group
+    if (thread->group != nullptr) {
+        atomic_fetch_add_explicit(&thread->group->nr_threads, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&thread->group->nr_runnable, 1, memory_order_relaxed);
+    }
+
+    scheduler_wake(thread);
     irq_restore(irq_state);
 }
 
@@ -132,8 +353,10 @@ thread_t* thread_get(thread_t* thread) {
 void thread_put(thread_t* thread) {
     if (--thread->ref_count == 0) {
         ASSERT(atomic_load_relaxed(&thread->state) == THREAD_STATE_DEAD);
-        // TODO: place a thread in a queue for being deleted
-        //       and wakeup the thread GC
+
+        // we can't free the thread right away since we might be running
+        // with interrupts disabled, queue it for the reaper
+        thread_reaper_queue(thread);
     }
 }
 
@@ -152,13 +375,25 @@ static void save_thread_context(thread_t* thread) {
         thread->user_ssp = (void*)__rdmsr(MSR_IA32_PL3_SSP);
     }
 
+    // the thread is no longer on a cpu
+    if (thread->run_slot != THREAD_RUN_SLOT_NONE) {
+        atomic_store_relaxed(&m_run_page->on_cpu[thread->run_slot], 0);
+    }
+
     // save the fs/gs base since they may not match if
     // the user did fs/gs base write
     thread->fs_base = _readfsbase_u64();
     thread->gs_base = __rdmsr(MSR_IA32_KERNEL_GS_BASE);
 
-    // Save modified extended state
-    _xsaveopt64(thread->extended_state, ~0U);
+    // Save modified extended state, the registers still hold it so if
+    // only kernel threads run until it comes back it can skip the restore
+    if (thread->flags & THREAD_FLAG_USER) {
+        if (g_xsaves_supported) {
+            _xsaves64(thread->extended_state, ~0ULL);
+        } else {
+            _xsaveopt64(thread->extended_state, ~0ULL);
+        }
+    }
 }
 
 static void restore_thread_context(thread_t* thread) {
@@ -175,8 +410,31 @@ static void restore_thread_context(thread_t* thread) {
     // set the stack for the next thread
     tss_set_rsp0(thread->kernel_stack);
 
-    // Restore extended state
-    _xrstor64(thread->extended_state, ~0U);
+    // tell the user the thread is on a cpu, and let it find its own slot
+    if (thread->flags & THREAD_FLAG_USER) {
+        if (thread->run_slot != THREAD_RUN_SLOT_NONE) {
+            atomic_store_relaxed(&m_run_page->on_cpu[thread->run_slot], get_cpu_id() + 1);
+        }
+
+        if (m_tsc_aux != thread->run_slot) {
+            __wrmsr(MSR_IA32_TSC_AUX, thread->run_slot);
+            m_tsc_aux = thread->run_slot;
+        }
+    }
+
+    // Restore extended state, unless it is still in the registers
+    if (thread->flags & THREAD_FLAG_USER) {
+        int cpu = get_cpu_id();
+        if (m_fpu_owner != thread || thread->fpu_cpu != cpu) {
+            if (g_xsaves_supported) {
+                _xrstors64(thread->extended_state, ~0ULL);
+            } else {
+                _xrstor64(thread->extended_state, ~0ULL);
+            }
+            m_fpu_owner = thread;
+            thread->fpu_cpu = cpu;
+        }
+    }
 }
 
 void thread_switch(thread_t* to, thread_t* from) {
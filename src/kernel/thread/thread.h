@@ -4,11 +4,16 @@
 #include <stdatomic.h>
 #include <stdnoreturn.h>
 
+#include "lib/except.h"
 #include "lib/list.h"
+#include "lib/rbtree/rbtree.h"
 #include "sync/spinlock.h"
+#include "uapi/sched.h"
 
 typedef void (*thread_entry_t)(void* arg);
 
+typedef struct sched_group sched_group_t;
+
 /**
  * The various states in which a thread can be:
  *
@@ -72,6 +77,39 @@ typedef enum thread_state {
     THREAD_STATE_PARKED,
 } thread_state_t;
 
+/**
+ * What a thread spends its time on, time on the cpu is split between the
+ * first three, time off the cpu between the last two
+ */
+typedef enum cpu_time_kind : uint8_t {
+    /**
+     * Running in usermode
+     */
+    CPU_TIME_USER,
+
+    /**
+     * Running in the kernel on behalf of the thread
+     */
+    CPU_TIME_KERNEL,
+
+    /**
+     * Handling interrupts that came in while the thread was running
+     */
+    CPU_TIME_IRQ,
+
+    /**
+     * Runnable, but waiting for a cpu
+     */
+    CPU_TIME_WAIT,
+
+    /**
+     * Parked until something wakes it up
+     */
+    CPU_TIME_BLOCKED,
+
+    CPU_TIME_KIND_COUNT,
+} cpu_time_kind_t;
+
 typedef enum thread_flags {
     /**
      * This is a usermode thread
@@ -128,6 +166,100 @@ typedef struct thread {
      */
     list_entry_t link;
 
+    /**
+     * The node in the fair run queue, used instead
+     * of the link for normal class threads
+     */
+    rb_node_t run_node;
+
+    /**
+     * The weighted runtime of the thread, normal threads run in
+     * vruntime order, while the thread is not on a core it is kept
+     * relative to the min vruntime of the core it left
+     */
+    uint64_t vruntime;
+
+    /**
+     * The tsc at which the thread started its current run
+     */
+    uint64_t exec_start;
+
+    /**
+     * The scheduling group of the thread, null if the
+     * thread is not part of any group
+     */
+    sched_group_t* group;
+
+    /**
+     * The tsc at which the thread was last switched out, used
+     * to tell if its cache footprint is still hot
+     */
+    uint64_t last_ran;
+
+    /**
+     * The link in the wakeup inbox of another core
+     */
+    struct thread* inbox_next;
+
+    /**
+     * The core the thread last ran on
+     */
+    int cpu;
+
+    /**
+     * The home core of the thread, and how it is
+     * placed relative to it when it wakes up
+     */
+    int home_cpu;
+    sched_placement_t placement;
+
+    /**
+     * The cores the thread is allowed to run on
+     */
+    cpu_mask_t affinity;
+
+    /**
+     * The core whose registers hold the extended state of
+     * the thread, or -1 if only the saved copy is valid
+     */
+    int fpu_cpu;
+
+    /**
+     * The scheduling class and priority of the thread
+     */
+    sched_class_t sched_class;
+    uint8_t priority;
+
+    /**
+     * The tsc of the notify that woke the thread, zero
+     * if not woken by one, for the wakeup latency stats
+     */
+    uint64_t wake_time;
+
+    /**
+     * The time the thread spent on each kind, in tsc ticks, only
+     * updated by the core running the thread or by the one waking it
+     */
+    _Atomic(uint64_t) cpu_time[CPU_TIME_KIND_COUNT];
+
+    /**
+     * The part of the cpu time already added to the group
+     */
+    uint64_t cpu_time_flushed[CPU_TIME_KIND_COUNT];
+
+    /**
+     * What the thread was doing when it was switched out,
+     * it goes back to it once it is switched in
+     */
+    cpu_time_kind_t cpu_time_kind;
+
+    /**
+     * The tsc at which the thread left the cpu, or at which it was
+     * woken up if it was parked, the time since then is either wait
+     * or blocked time
+     */
+    uint64_t off_cpu_since;
+
     //
     // Misc thread context
     //
@@ -147,18 +279,51 @@ typedef struct thread {
      */
     _Atomic(thread_state_t) state;
 
+    /**
+     * The slot of the thread in the run page, THREAD_RUN_SLOT_NONE
+     * for kernel threads and when the page is full
+     */
+    uint32_t run_slot;
+
     /**
      * The name of the thread, for debug
      */
     char name[128];
 
     //
-    // FPU context
+    // FPU context, only user threads have one since the kernel
+    // never touches the extended registers
     //
     alignas(64) uint8_t extended_state[];
 } thread_t;
 
-INIT_CODE void init_threads(void);
+/**
+ * Are the extended states saved with xsaves, in the compacted format
+ */
+extern bool g_xsaves_supported;
+
+INIT_CODE err_t init_threads(void);
+
+/**
+ * Get the physical address of the run page, for mapping it into the user
+ */
+uint64_t thread_get_run_page_phys(void);
+
+/**
+ * Initialize the dead thread reaper of the current core
+ */
+INIT_CODE void init_thread_reaper_per_core(void);
+
+/**
+ * Are there any dead threads waiting to be freed on the current core
+ */
+bool thread_reaper_pending(void);
+
+/**
+ * Free a single dead thread queued on the current core, if there
+ * is any, interrupts are disabled while it is freed
+ */
+void thread_reap(void);
 
 
 /**
@@ -1,4 +1,5 @@
 #include "wait.h"
+#include <stdalign.h>
 #include <stdint.h>
 
 #include "arch/intrin.h"
@@ -9,6 +10,7 @@
 #include "lib/list.h"
 #include "lib/log.h"
 #include "lib/tsc.h"
+#include "mem/alloc.h"
 #include "mem/mappings.h"
 #include "mem/phys.h"
 #include "mem/vmar.h"
@@ -19,50 +21,152 @@
 #include "uapi/wait.h"
 #include "user/syscall.h"
 
-#define WAIT_HASH_SHIFT 8
-#define WAIT_HASH_SIZE (1 << WAIT_HASH_SHIFT)
-
-#define GOLDEN_RATIO_64 0x61C8864680B583EBull
+/**
+ * The amount of wait queues per core, and the minimum amount of
+ * wait queues, the table is rounded up to a power of two
+ */
+#define WAIT_HASH_BUCKETS_PER_CPU   256
+#define WAIT_HASH_MIN_SIZE          256
 
 typedef struct wait_queue {
     /**
-     * The lock to protect the queue
+     * The lock to protect the queue, every queue has its own
+     * cache line so cores don't fight over neighbouring queues
      */
-    spinlock_t lock;
+    alignas(64) spinlock_t lock;
 
     /**
      * The queue itself
      */
-    struct wait_queue_entry* head;
+    list_t waiters;
 } wait_queue_t;
 
 typedef struct wait_queue_entry {
     /**
-     * Link in the wait queue
+     * Link in the wait queue, next is null once the
+     * entry was removed from the queue
      */
-    struct wait_queue_entry* next;
+    list_entry_t link;
 
     /**
-     * The thread that is waiting
+     * The thread that is waiting, null if this is a member of a
+     * wait set, which stays queued until removed from the set
      */
     thread_t* thread;
 
     /**
-     * The key that the thread is waiting for
+     * The key that the thread is waiting for, a requeue can change
+     * it while the thread waits, under the locks of both queues
      */
-    void* key;
+    _Atomic(void*) key;
 
     /** 
      * Mask to apply on the key when checking it
      */
     uint64_t mask;
+
+    /**
+     * The bit kept set in the key while the entry is queued, zero for none
+     */
+    uint64_t waiters_bit;
+
+    /**
+     * The size of the key
+     */
+    wait_key_size_t key_size;
 } wait_queue_entry_t;
 
-static wait_queue_t m_wait_hash[WAIT_HASH_SIZE];
+typedef struct wait_set_member {
+    /**
+     * The entry in the wait queue of the key
+     */
+    wait_queue_entry_t wait;
+
+    /**
+     * The link in the member list of the set
+     */
+    list_entry_t set_link;
+
+    /**
+     * The link in the ready list of the set, next is
+     * null if the member is not on the ready list
+     */
+    list_entry_t ready_link;
+
+    /**
+     * The set the member is part of
+     */
+    wait_set_t* set;
+
+    /**
+     * The value returned when the member is ready
+     */
+    uint64_t user_data;
+} wait_set_member_t;
+
+/**
+ * A thread waiting on a wait set
+ */
+typedef struct wait_set_waiter {
+    list_entry_t link;
+    thread_t* thread;
+} wait_set_waiter_t;
+
+/**
+ * The allocators for wait sets and their members
+ */
+static mem_alloc_t m_wait_set_alloc;
+static mem_alloc_t m_wait_set_member_alloc;
+
+/**
+ * The wait queues, and the mask to turn a hash into an index
+ */
+static wait_queue_t* LATE_RO m_wait_hash;
+static size_t LATE_RO m_wait_hash_mask;
+
+INIT_CODE err_t init_wait_queues(size_t cpu_count) {
+    err_t err = NO_ERROR;
+
+    vmar_lock();
+
+    // scale the table with the amount of cores, so the queues
+    // stay short even with many threads parked on every core
+    size_t count = MAX(cpu_count * WAIT_HASH_BUCKETS_PER_CPU, WAIT_HASH_MIN_SIZE);
+    count = 1ull << (64 - __builtin_clzll(count - 1));
+
+    size_t size = count * sizeof(wait_queue_t);
+    vmar_t* region = vmar_allocate(&g_kernel_memory, SIZE_TO_PAGES(size), nullptr);
+    CHECK_ERROR(region != nullptr, ERROR_OUT_OF_MEMORY);
+    vmar_set_name(region, "wait-queues");
+    region->pinned = true;
+    region->locked = true;
+
+    m_wait_hash = region->base;
+    m_wait_hash_mask = count - 1;
+    for (size_t i = 0; i < count; i++) {
+        m_wait_hash[i].lock = SPINLOCK_INIT;
+        list_init(&m_wait_hash[i].waiters);
+    }
+
+    mem_alloc_init(&m_wait_set_alloc, sizeof(wait_set_t), _Alignof(wait_set_t));
+    mem_alloc_init(&m_wait_set_member_alloc, sizeof(wait_set_member_t), _Alignof(wait_set_member_t));
+
+cleanup:
+    vmar_unlock();
+
+    return err;
+}
 
 static wait_queue_t* get_wait_queue_for_key(void* key) {
-    size_t hash = ((uint64_t)key * GOLDEN_RATIO_64) >> (64 - WAIT_HASH_SHIFT);
-    return &m_wait_hash[hash];
+    // keys are mostly aligned addresses of neighbouring objects, so
+    // mix all the bits before taking the low ones as the index
+    uint64_t hash = (uintptr_t)key;
+    hash ^= hash >> 33;
+    hash *= 0xFF51AFD7ED558CCDull;
+    hash ^= hash >> 33;
+    hash *= 0xC4CEB9FE1A85EC53ull;
+    hash ^= hash >> 33;
+    return &m_wait_hash[hash & m_wait_hash_mask];
 }
 
 static bool atomic_check_user_key(void* key, wait_key_size_t size, uint64_t old) {
@@ -81,12 +185,111 @@ static bool atomic_check_user_key(void* key, wait_key_size_t size, uint64_t old)
     return result;
 }
 
-static bool wait_queue_prepare(
-    wait_queue_entry_t* entry,
-    wait_key_size_t key_size,
-    uint64_t old
-) {
-    void* key = entry->key;
+/**
+ * Check the key like `atomic_check_user_key` while also setting the waiters bit
+ * in it, as a single atomic operation, so whoever changes the key either does
+ * it before us and we don't wait, or sees the bit in the value it replaced,
+ * the bit itself is not part of the comparison
+ */
+static bool atomic_check_and_mark_user_key(void* key, wait_key_size_t size, uint64_t old, uint64_t waiters_bit) {
+    if (waiters_bit == 0) {
+        return atomic_check_user_key(key, size, old);
+    }
+
+    bool result = false;
+
+    user_access_enable();
+    if (size == WAIT_KEY_UINT32) {
+        _Atomic(uint32_t)* ptr = key;
+        uint32_t bit = (uint32_t)waiters_bit;
+        uint32_t value = atomic_load_relaxed(ptr);
+        while ((value & ~bit) == ((uint32_t)old & ~bit)) {
+            if ((value & bit) == bit || atomic_compare_exchange_weak_relaxed(ptr, &value, value | bit)) {
+                result = true;
+                break;
+            }
+        }
+    } else if (size == WAIT_KEY_UINT64) {
+        _Atomic(uint64_t)* ptr = key;
+        uint64_t value = atomic_load_relaxed(ptr);
+        while ((value & ~waiters_bit) == (old & ~waiters_bit)) {
+            if ((value & waiters_bit) == waiters_bit || atomic_compare_exchange_weak_relaxed(ptr, &value, value | waiters_bit)) {
+                result = true;
+                break;
+            }
+        }
+    } else {
+        ASSERT(!"Invalid key size");
+    }
+    user_access_disable();
+
+    return result;
+}
+
+static void atomic_set_user_key_bits(void* key, wait_key_size_t size, uint64_t bits) {
+    user_access_enable();
+    if (size == WAIT_KEY_UINT32) {
+        atomic_fetch_or_explicit((_Atomic(uint32_t)*) key, (uint32_t)bits, memory_order_relaxed);
+    } else {
+        atomic_fetch_or_explicit((_Atomic(uint64_t)*) key, bits, memory_order_relaxed);
+    }
+    user_access_disable();
+}
+
+/**
+ * Clear the waiters bits that are no longer kept by any entry still waiting
+ * on the key, called with the queue lock held after removing entries from it,
+ * any entry that sets the bit again has to take the same lock first
+ */
+static void wait_queue_clear_waiters_bits(wait_queue_t* queue, void* key, wait_key_size_t size, uint64_t bits) {
+    if (bits == 0) {
+        return;
+    }
+
+    wait_queue_entry_t* entry;
+    list_for_each_entry(entry, &queue->waiters, link) {
+        if (atomic_load_relaxed(&entry->key) == key) {
+            bits &= ~entry->waiters_bit;
+            if (bits == 0) {
+                return;
+            }
+        }
+    }
+
+    user_access_enable();
+    if (size == WAIT_KEY_UINT32) {
+        atomic_fetch_and_explicit((_Atomic(uint32_t)*) key, ~(uint32_t)bits, memory_order_relaxed);
+    } else {
+        atomic_fetch_and_explicit((_Atomic(uint64_t)*) key, ~bits, memory_order_relaxed);
+    }
+    user_access_disable();
+}
+
+/**
+ * Insert the entry to the queue, the queue is ordered by the rank of the waiting
+ * thread, and in arrival order within the same rank, so notify wakes up the
+ * highest ranked waiters first, most waiters have the same rank so search
+ * for the spot from the tail
+ */
+static uint32_t wait_queue_entry_rank(wait_queue_entry_t* entry) {
+    // wait set members go after all the threads
+    return entry->thread != nullptr ? scheduler_get_rank(entry->thread) : 0;
+}
+
+static void wait_queue_insert(wait_queue_t* queue, wait_queue_entry_t* entry) {
+    uint32_t rank = wait_queue_entry_rank(entry);
+    list_entry_t* prev = queue->waiters.prev;
+    while (
+        !list_is_head(&queue->waiters, prev) &&
+        wait_queue_entry_rank(list_entry(prev, wait_queue_entry_t, link)) < rank
+    ) {
+        prev = prev->prev;
+    }
+    __list_add(&entry->link, prev, prev->next);
+}
+
+static bool wait_queue_prepare(wait_queue_entry_t* entry, uint64_t old) {
+    void* key = atomic_load_relaxed(&entry->key);
     wait_queue_t* queue = get_wait_queue_for_key(key);
 
     spinlock_acquire(&queue->lock);
@@ -96,35 +299,63 @@ static bool wait_queue_prepare(
     // against concurrent notifications: anyone who has changed `key` and has
     // called `notify` will either observe us in the queue and wake us, or will
     // make their change visible to the check here when they release the lock.
-    if (!atomic_check_user_key(key, key_size, old)) {
+    if (!atomic_check_and_mark_user_key(key, entry->key_size, old, entry->waiters_bit)) {
         spinlock_release(&queue->lock);
         return false;
     }
 
-    entry->next = queue->head;
-    queue->head = entry;
+    wait_queue_insert(queue, entry);
+
     spinlock_release(&queue->lock);
     return true;
 }
 
 static void wait_queue_finish(wait_queue_entry_t* remove) {
-    wait_queue_t* queue = get_wait_queue_for_key(remove->key);
+    for (;;) {
+        void* key = atomic_load_relaxed(&remove->key);
+        wait_queue_t* queue = get_wait_queue_for_key(key);
 
-    spinlock_acquire(&queue->lock);
+        spinlock_acquire(&queue->lock);
 
-    wait_queue_entry_t** indirect = &queue->head;
-    while (*indirect != nullptr) {
-        wait_queue_entry_t* entry = *indirect;
+        // a requeue moved us to another queue before we got the lock
+        if (atomic_load_relaxed(&remove->key) != key) {
+            spinlock_release(&queue->lock);
+            continue;
+        }
 
-        if (entry == remove) {
-            *indirect = entry->next;
-            break;
-        } else {
-            indirect = &((*indirect)->next);
+        // a notify might have removed us already, if not we might
+        // have been the last one keeping the waiters bit set
+        if (remove->link.next != nullptr) {
+            list_del(&remove->link);
+            wait_queue_clear_waiters_bits(queue, key, remove->key_size, remove->waiters_bit);
         }
+
+        spinlock_release(&queue->lock);
+        return;
     }
+}
 
-    spinlock_release(&queue->lock);
+/**
+ * Lock the two queues, always in the same order so two requeues
+ * between the same queues in opposite directions can't deadlock
+ */
+static void wait_queue_lock_pair(wait_queue_t* a, wait_queue_t* b) {
+    if (a == b) {
+        spinlock_acquire(&a->lock);
+    } else if (a < b) {
+        spinlock_acquire(&a->lock);
+        spinlock_acquire(&b->lock);
+    } else {
+        spinlock_acquire(&b->lock);
+        spinlock_acquire(&a->lock);
+    }
+}
+
+static void wait_queue_unlock_pair(wait_queue_t* a, wait_queue_t* b) {
+    spinlock_release(&a->lock);
+    if (a != b) {
+        spinlock_release(&b->lock);
+    }
 }
 
 wait_status_t atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline) {
@@ -132,6 +363,9 @@ wait_status_t atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline
     ASSERT(!__builtin_mul_overflow(sizeof(wait_entry_t), count, &entries_len));
     assert_user_range(entries, entries_len);
 
+    size_t wait_entries_len;
+    ASSERT(!__builtin_mul_overflow(sizeof(wait_queue_entry_t), count, &wait_entries_len));
+
     thread_t* thread = get_current_thread();
     size_t queued = 0;
     wait_status_t status = WAIT_STATUS_SUCCESS;
@@ -142,20 +376,19 @@ wait_status_t atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline
     atomic_store_relaxed(&thread->state, THREAD_STATE_PARKING);
 
     // stack entries if small enough, otherwise allocate
-    STATIC_ASSERT(sizeof(wait_entry_t) == sizeof(wait_queue_entry_t));
     wait_queue_entry_t* wait_entries = nullptr;
     bool is_phys_alloc = false;
     vmar_t* vmar = nullptr;
 
-    wait_queue_entry_t stack_wait_entries[64];
+    wait_queue_entry_t stack_wait_entries[32];
     if (count <= ARRAY_LENGTH(stack_wait_entries)) {
         // the count is small enough to use the stack
         wait_entries = stack_wait_entries;
 
-    } else if (entries_len <= PHYS_BUDDY_MAX_SIZE) {
+    } else if (wait_entries_len <= PHYS_BUDDY_MAX_SIZE) {
         // the count might fit into a body allocation, 
         // try to do it first 
-        wait_entries = phys_alloc(entries_len);
+        wait_entries = phys_alloc(wait_entries_len);
         is_phys_alloc = true;
     }
     
@@ -163,7 +396,7 @@ wait_status_t atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline
         // the count was too big and we failed to allocate from 
         // the body, allocate a VMAR instead so we can do a non
         // contig allocation
-        vmar = vmar_allocate(&g_kernel_memory, SIZE_TO_PAGES(entries_len), nullptr);
+        vmar = vmar_allocate(&g_kernel_memory, SIZE_TO_PAGES(wait_entries_len), nullptr);
         wait_entries = vmar->base;
     }
 
@@ -189,10 +422,12 @@ wait_status_t atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline
         wait_entries[queued] = (wait_queue_entry_t){
             .key = entry.key,
             .mask = entry.mask,
+            .waiters_bit = entry.waiters_bit,
+            .key_size = entry.key_size,
             .thread = thread
         };
 
-        if (!wait_queue_prepare(&wait_entries[queued], entry.key_size, entry.old)) {
+        if (!wait_queue_prepare(&wait_entries[queued], entry.old)) {
             // We are going to abort our parking, we need to go back to RUNNING.
             atomic_store_relaxed(&thread->state, THREAD_STATE_RUNNING);
 
@@ -218,7 +453,7 @@ unpark:
 
     // free it if we need to
     if (is_phys_alloc) {
-        phys_free(wait_entries, entries_len);
+        phys_free(wait_entries, wait_entries_len);
     } else if (vmar != nullptr) {
         vmar_free(vmar);
     }
@@ -226,22 +461,73 @@ unpark:
     return status;
 }
 
-size_t atomic_notify(void* key, uint64_t mask, size_t count) {
+/**
+ * Put the member on the ready list of its set and wake a thread waiting on
+ * the set, called with the lock of the wait queue of the member held
+ */
+static void wait_set_member_notify(wait_set_member_t* member, uint64_t notify_time) {
+    wait_set_t* set = member->set;
+
+    spinlock_acquire(&set->lock);
+
+    if (member->ready_link.next == nullptr) {
+        list_add_tail(&set->ready, &member->ready_link);
+    }
+
+    // a single waiter is enough, it takes all the ready members
+    if (!list_is_empty(&set->waiters)) {
+        wait_set_waiter_t* waiter = list_first_entry(&set->waiters, wait_set_waiter_t, link);
+        list_del(&waiter->link);
+        scheduler_try_unpark(waiter->thread, notify_time);
+    }
+
+    spinlock_release(&set->lock);
+}
+
+/**
+ * Wake the threads waiting on the key, if handoff is set the first thread
+ * woken takes over the cpu once the current thread parks
+ */
+static size_t wait_queue_notify(void* key, uint64_t mask, size_t count, bool handoff) {
+    uint64_t notify_time = get_tsc();
     wait_queue_t* queue = get_wait_queue_for_key(key);
+    thread_t* current = get_current_thread();
 
     bool irq_state = irq_save();
     spinlock_acquire(&queue->lock);
 
-    // iterate the loop to find all the keys that match
+    // iterate the loop to find all the keys that match, skipping
+    // ourselves in case we are queued to wait on the same key
     size_t woken = 0;
-    wait_queue_entry_t** indirect = &queue->head;
-    while (*indirect != nullptr) {
-        wait_queue_entry_t* entry = *indirect;
+    uint64_t removed_bits = 0;
+    wait_key_size_t key_size = WAIT_KEY_UINT32;
+    wait_queue_entry_t* entry;
+    wait_queue_entry_t* next;
+    list_for_each_entry_safe(entry, next, &queue->waiters, link) {
+        if (atomic_load_relaxed(&entry->key) != key || (entry->mask & mask) == 0) {
+            continue;
+        }
+
+        // wait set members stay queued, and don't count as woken
+        // threads, since they only tell the set to check the key
+        if (entry->thread == nullptr) {
+            wait_set_member_notify(containerof(entry, wait_set_member_t, wait), notify_time);
+            continue;
+        }
 
-        if (entry->key == key && (entry->mask & mask)) {
-            *indirect = entry->next;
+        if (entry->thread != current) {
+            list_del(&entry->link);
+            removed_bits |= entry->waiters_bit;
+            key_size = entry->key_size;
 
-            if (scheduler_try_unpark(entry->thread)) {
+            bool unparked;
+            if (handoff && woken == 0) {
+                unparked = scheduler_try_unpark_handoff(entry->thread, notify_time);
+            } else {
+                unparked = scheduler_try_unpark(entry->thread, notify_time);
+            }
+
+            if (unparked) {
                 woken++;
             }
 
@@ -249,13 +535,367 @@ size_t atomic_notify(void* key, uint64_t mask, size_t count) {
             if (count != 0 && count == woken) {
                 break;
             }
-        } else {
-            indirect = &((*indirect)->next);
         }
     }
 
+    // let the notifiers know once there is no one left to wake
+    wait_queue_clear_waiters_bits(queue, key, key_size, removed_bits);
+
     spinlock_release(&queue->lock);
     irq_restore(irq_state);
 
     return woken;
 }
+
+size_t atomic_notify(void* key, uint64_t mask, size_t count) {
+    return wait_queue_notify(key, mask, count, false);
+}
+
+wait_status_t atomic_requeue(
+    const wait_entry_t* compare, size_t wake_count,
+    void* requeue_key, size_t requeue_count, uint64_t requeue_waiters_bit
+) {
+    size_t key_size_bytes = compare->key_size == WAIT_KEY_UINT32 ? sizeof(uint32_t) : sizeof(uint64_t);
+    assert_user_range(compare->key, key_size_bytes);
+    assert_user_range(requeue_key, sizeof(uint32_t));
+
+    // moving waiters to the queue they are already in
+    // would just go over them again and again
+    if (requeue_key == compare->key) {
+        requeue_count = 0;
+    }
+
+    uint64_t notify_time = get_tsc();
+    wait_queue_t* from = get_wait_queue_for_key(compare->key);
+    wait_queue_t* to = get_wait_queue_for_key(requeue_key);
+    thread_t* current = get_current_thread();
+
+    bool irq_state = irq_save();
+    wait_queue_lock_pair(from, to);
+
+    // like with a wait, checking the key under the lock makes sure that
+    // whoever changes it either sees the waiters already moved, or makes
+    // the change visible to us
+    if (!atomic_check_user_key(compare->key, compare->key_size, compare->old)) {
+        wait_queue_unlock_pair(from, to);
+        irq_restore(irq_state);
+        return WAIT_STATUS_NOT_EQUAL;
+    }
+
+    size_t woken = 0;
+    size_t requeued = 0;
+    uint64_t removed_bits = 0;
+    wait_queue_entry_t* entry;
+    wait_queue_entry_t* next;
+    list_for_each_entry_safe(entry, next, &from->waiters, link) {
+        if (
+            atomic_load_relaxed(&entry->key) != compare->key ||
+            (entry->mask & compare->mask) == 0 ||
+            entry->thread == nullptr ||
+            entry->thread == current
+        ) {
+            continue;
+        }
+
+        if (woken < wake_count) {
+            list_del(&entry->link);
+            removed_bits |= entry->waiters_bit;
+            if (scheduler_try_unpark(entry->thread, notify_time)) {
+                woken++;
+            }
+        } else if (requeued < requeue_count) {
+            // the entry now waits on the other key, if it lands in the
+            // same queue further down the iteration it no longer matches
+            list_del(&entry->link);
+            removed_bits |= entry->waiters_bit;
+            atomic_store_relaxed(&entry->key, requeue_key);
+            entry->key_size = WAIT_KEY_UINT32;
+            entry->waiters_bit = requeue_waiters_bit;
+            wait_queue_insert(to, entry);
+            requeued++;
+        } else {
+            break;
+        }
+    }
+
+    // the moved threads never set the bit on the new key themselves
+    if (requeued != 0 && requeue_waiters_bit != 0) {
+        atomic_set_user_key_bits(requeue_key, WAIT_KEY_UINT32, requeue_waiters_bit);
+    }
+    wait_queue_clear_waiters_bits(from, compare->key, compare->key_size, removed_bits);
+
+    wait_queue_unlock_pair(from, to);
+    irq_restore(irq_state);
+
+    return WAIT_STATUS_SUCCESS;
+}
+
+wait_status_t atomic_notify_wait(
+    void* notify_key, uint64_t notify_mask, size_t notify_count,
+    const wait_entry_t* entry, uint64_t deadline
+) {
+    assert_user_range(entry, sizeof(*entry));
+
+    // read the entry and make sure the key is in usermode
+    user_access_enable();
+    wait_entry_t wait = *entry;
+    user_access_disable();
+
+    size_t key_size_bytes = wait.key_size == WAIT_KEY_UINT32 ? sizeof(uint32_t) : sizeof(uint64_t);
+    assert_user_range(wait.key, key_size_bytes);
+
+    thread_t* thread = get_current_thread();
+    wait_queue_entry_t wait_entry = {
+        .key = wait.key,
+        .mask = wait.mask,
+        .waiters_bit = wait.waiters_bit,
+        .key_size = wait.key_size,
+        .thread = thread
+    };
+    wait_status_t status = WAIT_STATUS_SUCCESS;
+
+    // start parking, same as atomic_wait
+    atomic_store_relaxed(&thread->state, THREAD_STATE_PARKING);
+
+    const bool irq_state = irq_save();
+
+    // queue ourselves before the notify, so a reply to it can't be missed
+    bool parking = wait_queue_prepare(&wait_entry, wait.old);
+    if (!parking) {
+        atomic_store_relaxed(&thread->state, THREAD_STATE_RUNNING);
+        status = WAIT_STATUS_NOT_EQUAL;
+    }
+
+    // only hand off the cpu if we are going to give it up
+    wait_queue_notify(notify_key, notify_mask, notify_count, parking);
+
+    if (parking) {
+        if (deadline == -1) {
+            scheduler_schedule();
+        } else {
+            scheduler_schedule_deadline(deadline);
+        }
+
+        wait_queue_finish(&wait_entry);
+    }
+
+    irq_restore(irq_state);
+
+    return status;
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Wait sets
+//----------------------------------------------------------------------------------------------------------------------
+
+static bool wait_set_member_is_ready(wait_set_member_t* member) {
+    void* key = atomic_load_relaxed(&member->wait.key);
+    uint64_t value = 0;
+
+    user_access_enable();
+    if (member->wait.key_size == WAIT_KEY_UINT32) {
+        value = atomic_load_relaxed((_Atomic(uint32_t)*) key);
+    } else {
+        value = atomic_load_relaxed((_Atomic(uint64_t)*) key);
+    }
+    user_access_disable();
+
+    return (value & member->wait.mask) != 0;
+}
+
+wait_set_t* wait_set_create(void) {
+    wait_set_t* set = mem_calloc(&m_wait_set_alloc);
+    if (set == nullptr) {
+        return nullptr;
+    }
+
+    // setup the object
+    set->object.type = KERNEL_OBJECT_TYPE_WAIT_SET;
+    set->object.ref_count = 1;
+
+    set->lock = SPINLOCK_INIT;
+    list_init(&set->members);
+    list_init(&set->ready);
+    list_init(&set->waiters);
+
+    return set;
+}
+
+void wait_set_free(wait_set_t* set) {
+    // no one can reach the set anymore, but notifies can still find
+    // the members until we take them out of the wait queues
+    wait_set_member_t* member;
+    wait_set_member_t* next;
+    list_for_each_entry_safe(member, next, &set->members, set_link) {
+        wait_queue_t* queue = get_wait_queue_for_key(atomic_load_relaxed(&member->wait.key));
+
+        bool irq_state = irq_save();
+        spinlock_acquire(&queue->lock);
+        list_del(&member->wait.link);
+        wait_queue_clear_waiters_bits(queue, atomic_load_relaxed(&member->wait.key), member->wait.key_size, member->wait.waiters_bit);
+        spinlock_release(&queue->lock);
+        irq_restore(irq_state);
+
+        mem_free(&m_wait_set_member_alloc, member);
+    }
+
+    mem_free(&m_wait_set_alloc, set);
+}
+
+bool wait_set_add(
+    wait_set_t* set, void* key, wait_key_size_t key_size,
+    uint64_t mask, uint64_t waiters_bit, uint64_t user_data
+) {
+    ASSERT(key_size == WAIT_KEY_UINT32 || key_size == WAIT_KEY_UINT64);
+    size_t key_size_bytes = key_size == WAIT_KEY_UINT32 ? sizeof(uint32_t) : sizeof(uint64_t);
+    assert_user_range(key, key_size_bytes);
+
+    wait_set_member_t* member = mem_calloc(&m_wait_set_member_alloc);
+    if (member == nullptr) {
+        return false;
+    }
+
+    member->wait.key = key;
+    member->wait.mask = mask;
+    member->wait.waiters_bit = waiters_bit;
+    member->wait.key_size = key_size;
+    member->set = set;
+    member->user_data = user_data;
+
+    uint64_t notify_time = get_tsc();
+    wait_queue_t* queue = get_wait_queue_for_key(key);
+
+    bool irq_state = irq_save();
+
+    // checking the key under the queue lock makes sure that whoever changes
+    // it later sees the member and puts it on the ready list
+    spinlock_acquire(&queue->lock);
+    wait_queue_insert(queue, &member->wait);
+    if (waiters_bit != 0) {
+        atomic_set_user_key_bits(key, key_size, waiters_bit);
+    }
+    if (wait_set_member_is_ready(member)) {
+        wait_set_member_notify(member, notify_time);
+    }
+    spinlock_release(&queue->lock);
+
+    // only now can the member be found for removal
+    spinlock_acquire(&set->lock);
+    list_add_tail(&set->members, &member->set_link);
+    spinlock_release(&set->lock);
+
+    irq_restore(irq_state);
+
+    return true;
+}
+
+bool wait_set_remove(wait_set_t* set, void* key, uint64_t user_data) {
+    bool irq_state = irq_save();
+
+    // take the member off the set first, so no one else can remove it
+    spinlock_acquire(&set->lock);
+    wait_set_member_t* member = nullptr;
+    wait_set_member_t* it;
+    list_for_each_entry(it, &set->members, set_link) {
+        if (atomic_load_relaxed(&it->wait.key) == key && it->user_data == user_data) {
+            member = it;
+            list_del(&member->set_link);
+            break;
+        }
+    }
+    spinlock_release(&set->lock);
+
+    if (member == nullptr) {
+        irq_restore(irq_state);
+        return false;
+    }
+
+    // once it is out of the wait queue nothing can make it ready again
+    wait_queue_t* queue = get_wait_queue_for_key(key);
+    spinlock_acquire(&queue->lock);
+    list_del(&member->wait.link);
+    wait_queue_clear_waiters_bits(queue, key, member->wait.key_size, member->wait.waiters_bit);
+    spinlock_release(&queue->lock);
+
+    spinlock_acquire(&set->lock);
+    if (member->ready_link.next != nullptr) {
+        list_del(&member->ready_link);
+    }
+    spinlock_release(&set->lock);
+
+    irq_restore(irq_state);
+
+    mem_free(&m_wait_set_member_alloc, member);
+    return true;
+}
+
+/**
+ * Take the ready members of the set, members whose key no longer matches
+ * their mask leave the ready list, while the ones that still match are
+ * moved to the end of it so they are returned again until handled, but
+ * only after all the other ready members got a turn
+ */
+static size_t wait_set_collect(wait_set_t* set, uint64_t* user_data, size_t count) {
+    list_t delivered = LIST_INIT(&delivered);
+
+    size_t found = 0;
+    while (found < count && !list_is_empty(&set->ready)) {
+        wait_set_member_t* member = list_first_entry(&set->ready, wait_set_member_t, ready_link);
+        list_del(&member->ready_link);
+
+        if (wait_set_member_is_ready(member)) {
+            user_data[found++] = member->user_data;
+            list_add_tail(&delivered, &member->ready_link);
+        }
+    }
+
+    while (!list_is_empty(&delivered)) {
+        list_entry_t* link = list_pop(&delivered);
+        list_add_tail(&set->ready, link);
+    }
+
+    return found;
+}
+
+size_t wait_set_wait(wait_set_t* set, uint64_t* user_data, size_t count, uint64_t deadline) {
+    thread_t* thread = get_current_thread();
+    size_t found = 0;
+
+    bool irq_state = irq_save();
+
+    for (;;) {
+        spinlock_acquire(&set->lock);
+
+        found = wait_set_collect(set, user_data, count);
+        if (found != 0 || (deadline != -1 && tsc_check_deadline(deadline))) {
+            spinlock_release(&set->lock);
+            break;
+        }
+
+        // start parking before we let go of the lock, so a notify that
+        // comes after it either sees us on the list or aborts the park
+        wait_set_waiter_t waiter = { .thread = thread };
+        atomic_store_relaxed(&thread->state, THREAD_STATE_PARKING);
+        list_add_tail(&set->waiters, &waiter.link);
+
+        spinlock_release(&set->lock);
+
+        if (deadline == -1) {
+            scheduler_schedule();
+        } else {
+            scheduler_schedule_deadline(deadline);
+        }
+
+        // woken by the deadline, or by something else
+        // than a notify that took us off the list
+        spinlock_acquire(&set->lock);
+        if (waiter.link.next != nullptr) {
+            list_del(&waiter.link);
+        }
+        spinlock_release(&set->lock);
+    }
+
+    irq_restore(irq_state);
+
+    return found;
+}
@@ -4,7 +4,48 @@
 #include <stdint.h>
 
 #include "lib/defs.h"
+#include "lib/except.h"
+#include "lib/list.h"
+#include "sync/spinlock.h"
 #include "uapi/wait.h"
+#include "user/object.h"
+
+/**
+ * A set of keys registered once and waited on together, a notify on one of
+ * the keys puts it on the ready list of the set, so waiting on the set only
+ * costs as much as the amount of keys that are ready
+ */
+typedef struct wait_set {
+    /**
+     * The object header
+     */
+    kernel_object_t object;
+
+    /**
+     * Protects the lists of the set
+     */
+    spinlock_t lock;
+
+    /**
+     * All the members of the set
+     */
+    list_t members;
+
+    /**
+     * The members that were notified and were not handled yet
+     */
+    list_t ready;
+
+    /**
+     * The threads waiting on the set
+     */
+    list_t waiters;
+} wait_set_t;
+
+/**
+ * Allocate the wait queues, sized by the amount of cores
+ */
+INIT_CODE err_t init_wait_queues(size_t cpu_count);
 
 /**
  * Atomically checks that every entry's `key` still contains its expected `old`
@@ -17,6 +58,11 @@
  * If any entry's `key` no longer holds its expected `old` value the function
  * does not park and returns `false` immediately.
  *
+ * An entry with a `waiters_bit` sets that bit in its key as part of the
+ * compare, and the bit is cleared once no entry that wants it is left waiting
+ * on the key, so notifiers that see it clear may skip the notify. The bit is
+ * ignored when comparing against `old`.
+ *
  * Typical usage patterns involving memory reclamation (*by unrelated code*)
  * may cause this function to return spuriously, without any `key` having
  * changed, without `atomic_notify` having been invoked and without the
@@ -25,7 +71,7 @@
  *
  * @param entries   [IN] The array of keys to wait on, each with its expected value and size
  * @param count     [IN] The number of entries, between 1 and 64
- * @param deadline  [IN] The deadline to wait for, 0 for no deadline
+ * @param deadline  [IN] The deadline to wait for, -1 for no deadline
  * @returns true if we went to sleep, false if an entry failed to compare against its old value
  */
 wait_status_t atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline);
@@ -39,3 +85,89 @@ wait_status_t atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline
  * @return The number of threads woken
  */
 size_t atomic_notify(void* key, uint64_t mask, size_t count);
+
+/**
+ * Wakes up to `wake_count` threads waiting on the key of `compare`, and moves
+ * up to `requeue_count` of the rest to wait on `requeue_key` instead, as long
+ * as the key still holds the expected `old` value. The moved threads are only
+ * woken by a notify on `requeue_key`, which avoids waking a crowd of threads
+ * that would all fight over the same lock.
+ *
+ * @param compare       [IN] The key to wake, with its expected value, size and mask
+ * @param wake_count    [IN] The number of threads to wake
+ * @param requeue_key   [IN] The key to move the rest of the threads to
+ * @param requeue_count [IN] The number of threads to move
+ * @param requeue_waiters_bit [IN] The waiters bit the moved threads keep set in the 32bit `requeue_key`
+ * @return WAIT_STATUS_NOT_EQUAL if the key did not hold the expected value, in which
+ *         case no thread was touched
+ */
+wait_status_t atomic_requeue(
+    const wait_entry_t* compare, size_t wake_count,
+    void* requeue_key, size_t requeue_count, uint64_t requeue_waiters_bit
+);
+
+/**
+ * Wakes threads waiting on `notify_key` and parks the current thread on the
+ * key of `entry`, like an `atomic_notify` followed by an `atomic_wait` on a
+ * single entry, except that the first woken thread takes over the cpu right
+ * away instead of going through the run queue.
+ *
+ * The notify happens even if the entry fails to compare.
+ *
+ * @param notify_key    [IN] The key to wake
+ * @param notify_mask   [IN] The mask to wake
+ * @param notify_count  [IN] The number of threads to wake, 0 for all
+ * @param entry         [IN] The key to wait on, with its expected value and size
+ * @param deadline      [IN] The deadline to wait for, -1 for no deadline
+ */
+wait_status_t atomic_notify_wait(
+    void* notify_key, uint64_t notify_mask, size_t notify_count,
+    const wait_entry_t* entry, uint64_t deadline
+);
+
+/**
+ * Create a new empty wait set
+ */
+wait_set_t* wait_set_create(void);
+
+/**
+ * Free the set, called once the last reference is gone
+ */
+void wait_set_free(wait_set_t* set);
+
+/**
+ * Add a key to the set, the key is ready while any of the bits of the mask are
+ * set in it, and is noticed by the set on an `atomic_notify` of any of these bits
+ *
+ * @param set           [IN] The set to add to
+ * @param key           [IN] The key to watch
+ * @param key_size      [IN] The size of the key
+ * @param mask          [IN] The bits of the key to watch
+ * @param waiters_bit   [IN] The bit to keep set in the key while it is in the set, 0 for none
+ * @param user_data     [IN] The value to return when the key is ready
+ * @return false if out of memory
+ */
+bool wait_set_add(
+    wait_set_t* set, void* key, wait_key_size_t key_size,
+    uint64_t mask, uint64_t waiters_bit, uint64_t user_data
+);
+
+/**
+ * Remove a key that was added with the given user data from the set
+ *
+ * @return false if there is no such key in the set
+ */
+bool wait_set_remove(wait_set_t* set, void* key, uint64_t user_data);
+
+/**
+ * Wait until some of the keys of the set are ready, ready keys are returned
+ * until the bits are cleared from them, may return keys that are no longer
+ * ready if they were cleared at the same time
+ *
+ * @param set           [IN]  The set to wait on
+ * @param user_data     [OUT] The user data of the ready keys
+ * @param count         [IN]  The max amount of keys to return
+ * @param deadline      [IN]  The deadline to wait for, -1 for no deadline
+ * @return the amount of ready keys, zero if the deadline passed
+ */
+size_t wait_set_wait(wait_set_t* set, uint64_t* user_data, size_t count, uint64_t deadline);
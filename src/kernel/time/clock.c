@@ -0,0 +1,82 @@
+#include "clock.h"
+
+#include "rtc.h"
+#include "lib/atomic.h"
+#include "lib/defs.h"
+#include "lib/log.h"
+#include "lib/string.h"
+#include "lib/tsc.h"
+#include "mem/direct.h"
+#include "mem/phys.h"
+#include "uapi/clock.h"
+#include "uapi/page.h"
+
+/**
+ * The timekeeping page, written through the direct map
+ */
+LATE_RO static clock_page_t* m_clock_page;
+
+/**
+ * Calculate the nanoseconds per tsc tick multiplier
+ */
+static uint64_t clock_calc_mult(uint64_t freq) {
+    return ((uint64_t)NS_PER_S << CLOCK_MULT_SHIFT) / freq;
+}
+
+/**
+ * Update the parameters of the page, there is only a single
+ * writer so the sequence does not need a lock around it
+ */
+static void clock_publish(const clock_params_t* params) {
+    uint32_t seq = atomic_load_relaxed(&m_clock_page->seq);
+    atomic_store_relaxed(&m_clock_page->seq, seq + 1);
+    atomic_fence_release();
+    m_clock_page->params = *params;
+    atomic_store_release(&m_clock_page->seq, seq + 2);
+}
+
+INIT_CODE err_t init_clock(void) {
+    err_t err = NO_ERROR;
+
+    m_clock_page = phys_alloc(PAGE_SIZE);
+    CHECK_ERROR(m_clock_page != nullptr, ERROR_OUT_OF_MEMORY);
+    memset(m_clock_page, 0, PAGE_SIZE);
+
+    // the monotonic clock counts from the tsc reset, the
+    // rtc only has whole seconds so that is all we get
+    uint64_t unix_time = rtc_read_unix_time();
+    uint64_t now = get_tsc();
+    clock_params_t params = {
+        .tsc_base = now,
+        .monotonic_base_ns = tsc_to_ns(now),
+        .realtime_base_ns = unix_time * NS_PER_S,
+        .mult = clock_calc_mult(g_tsc_freq_hz),
+        .tsc_freq_hz = g_tsc_freq_hz,
+    };
+    clock_publish(&params);
+
+    TRACE("clock: Wall clock at %lu seconds since the epoch", unix_time);
+
+cleanup:
+    return err;
+}
+
+void clock_set_tsc_freq(uint64_t freq) {
+    clock_params_t params = m_clock_page->params;
+
+    // move the bases to now using the old frequency,
+    // and only use the new one from here on
+    uint64_t now = get_tsc();
+    uint64_t elapsed = (uint64_t)(((now - params.tsc_base) * (unsigned __int128)params.mult) >> CLOCK_MULT_SHIFT);
+    params.tsc_base = now;
+    params.monotonic_base_ns += elapsed;
+    params.realtime_base_ns += elapsed;
+    params.mult = clock_calc_mult(freq);
+    params.tsc_freq_hz = freq;
+
+    clock_publish(&params);
+}
+
+uint64_t clock_get_page_phys(void) {
+    return direct_to_phys(m_clock_page);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "lib/except.h"
+
+/**
+ * Setup the timekeeping page, starting the monotonic clock from the
+ * current tsc and the wall clock from the RTC
+ */
+INIT_CODE err_t init_clock(void);
+
+/**
+ * Publish a new tsc frequency, both clocks continue from where
+ * they are right now so they never jump
+ *
+ * @param freq  [IN] The new tsc frequency
+ */
+void clock_set_tsc_freq(uint64_t freq);
+
+/**
+ * Get the physical address of the timekeeping page, so it can be mapped to the user
+ */
+uint64_t clock_get_page_phys(void);
@@ -0,0 +1,122 @@
+#include "rtc.h"
+
+#include <stdbool.h>
+
+#include "acpi/acpi.h"
+#include "arch/intrin.h"
+
+/**
+ * The CMOS index and data ports
+ */
+#define CMOS_ADDRESS        0x70
+#define CMOS_DATA           0x71
+
+/**
+ * The RTC registers
+ */
+#define RTC_SECONDS         0x00
+#define RTC_MINUTES         0x02
+#define RTC_HOURS           0x04
+#define RTC_DAY             0x07
+#define RTC_MONTH           0x08
+#define RTC_YEAR            0x09
+#define RTC_STATUS_A        0x0A
+#define RTC_STATUS_B        0x0B
+
+#define RTC_STATUS_A_UPDATE_IN_PROGRESS     BIT7
+#define RTC_STATUS_B_24_HOUR                BIT1
+#define RTC_STATUS_B_BINARY                 BIT2
+#define RTC_HOURS_PM                        BIT7
+
+typedef struct rtc_time {
+    uint8_t seconds;
+    uint8_t minutes;
+    uint8_t hours;
+    uint8_t day;
+    uint8_t month;
+    uint8_t year;
+    uint8_t century;
+} rtc_time_t;
+
+INIT_CODE static uint8_t cmos_read(uint8_t reg) {
+    __outbyte(CMOS_ADDRESS, reg);
+    return __inbyte(CMOS_DATA);
+}
+
+INIT_CODE static void rtc_read_raw(rtc_time_t* time, uint8_t century_register) {
+    // don't read in the middle of an update
+    while ((cmos_read(RTC_STATUS_A) & RTC_STATUS_A_UPDATE_IN_PROGRESS) != 0) {
+        cpu_relax();
+    }
+
+    time->seconds = cmos_read(RTC_SECONDS);
+    time->minutes = cmos_read(RTC_MINUTES);
+    time->hours = cmos_read(RTC_HOURS);
+    time->day = cmos_read(RTC_DAY);
+    time->month = cmos_read(RTC_MONTH);
+    time->year = cmos_read(RTC_YEAR);
+    time->century = century_register != 0 ? cmos_read(century_register) : 0;
+}
+
+INIT_CODE static uint8_t rtc_from_bcd(uint8_t value) {
+    return (value & 0xF) + (value >> 4) * 10;
+}
+
+/**
+ * The days from the unix epoch to the given date, from
+ * http://howardhinnant.github.io/date_algorithms.html
+ */
+INIT_CODE static int64_t days_from_civil(int64_t year, unsigned month, unsigned day) {
+    year -= month <= 2;
+    int64_t era = (year >= 0 ? year : year - 399) / 400;
+    unsigned yoe = (unsigned)(year - era * 400);
+    unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+INIT_CODE uint64_t rtc_read_unix_time(void) {
+    // read until we get the same value twice, so we
+    // know an update did not happen in the middle
+    uint8_t century_register = acpi_get_century_register();
+    rtc_time_t time;
+    rtc_time_t last;
+    rtc_read_raw(&time, century_register);
+    do {
+        last = time;
+        rtc_read_raw(&time, century_register);
+    } while (
+        time.seconds != last.seconds || time.minutes != last.minutes ||
+        time.hours != last.hours || time.day != last.day ||
+        time.month != last.month || time.year != last.year ||
+        time.century != last.century
+    );
+
+    // normalize the format
+    uint8_t status_b = cmos_read(RTC_STATUS_B);
+    bool pm = (time.hours & RTC_HOURS_PM) != 0;
+    time.hours &= ~RTC_HOURS_PM;
+
+    if ((status_b & RTC_STATUS_B_BINARY) == 0) {
+        time.seconds = rtc_from_bcd(time.seconds);
+        time.minutes = rtc_from_bcd(time.minutes);
+        time.hours = rtc_from_bcd(time.hours);
+        time.day = rtc_from_bcd(time.day);
+        time.month = rtc_from_bcd(time.month);
+        time.year = rtc_from_bcd(time.year);
+        time.century = rtc_from_bcd(time.century);
+    }
+
+    if ((status_b & RTC_STATUS_B_24_HOUR) == 0) {
+        time.hours = (time.hours % 12) + (pm ? 12 : 0);
+    }
+
+    // without a century register assume we are in the 21st century
+    unsigned century = century_register != 0 ? time.century : 20;
+    int64_t days = days_from_civil(century * 100 + time.year, time.month, time.day);
+    if (days < 0) {
+        return 0;
+    }
+
+    return days * 86400 + time.hours * 3600 + time.minutes * 60 + time.seconds;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "lib/defs.h"
+
+/**
+ * Read the wall clock time from the CMOS RTC, in seconds since the unix
+ * epoch, the RTC only counts whole seconds and is assumed to be in UTC
+ */
+INIT_CODE uint64_t rtc_read_unix_time(void);
@@ -4,15 +4,48 @@
 #include "arch/apic.h"
 #include "thread/sched.h"
 #include "arch/intrin.h"
+#include "lib/atomic.h"
+#include "lib/defs.h"
 #include "lib/pcpu.h"
 #include "sync/spinlock.h"
 
+/**
+ * The timer wheel, every level has 64 slots and is 8 times coarser than
+ * the level below it, a tick of the lowest level is about TIMER_WHEEL_TICK_US
+ */
+#define TIMER_WHEEL_LEVELS          6
+#define TIMER_WHEEL_SLOTS           64
+#define TIMER_WHEEL_LEVEL_SHIFT     3
+#define TIMER_WHEEL_TICK_US         64
+
+static_assert(TIMER_WHEEL_SLOTS == 64, "The pending slots of a level are kept in a single 64bit mask");
+static_assert(TIMER_WHEEL_LEVELS < TIMER_WHEEL_NONE, "The wheel level must fit in the timer");
+
 typedef struct timers_queue {
     /**
-     * The root of timers
+     * The root of the exact timers, sorted by when they expire
      */
     rb_root_cached_t root;
 
+    /**
+     * The slots of the timer wheel, and a mask of
+     * the slots that have timers in every level
+     */
+    list_t wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t wheel_pending[TIMER_WHEEL_LEVELS];
+
+    /**
+     * The amount of timers in the wheel
+     */
+    size_t wheel_count;
+
+    /**
+     * The wheel tick up to which the wheel was processed, and the log2 of
+     * the tsc ticks in a wheel tick so it can be turned into a tsc deadline
+     */
+    uint64_t wheel_clock;
+    uint8_t wheel_shift;
+
     /**
      * The timers lock, must be taken with irqs disabled
      */
@@ -24,6 +57,20 @@ typedef struct timers_queue {
      * for new timers
      */
     bool dispatching;
+
+    /**
+     * The deadline currently programmed into the hardware,
+     * zero if the hardware timer is not armed
+     */
+    uint64_t armed_deadline;
+
+    /**
+     * Timer statistics
+     */
+    _Atomic(uint64_t) interrupts;
+    _Atomic(uint64_t) writes;
+    _Atomic(uint64_t) skipped_writes;
+    _Atomic(uint64_t) expired;
 } timers_queue_t;
 
 /**
@@ -34,24 +81,294 @@ static CPU_LOCAL timers_queue_t m_timer = {};
 static __always_inline bool timer_less(rb_node_t* a, const rb_node_t* b) {
     timer_t* ta = containerof(a, timer_t, node);
     timer_t* tb = containerof(b, timer_t, node);
-    return ta->deadline < tb->deadline;
+    return ta->expires < tb->expires;
+}
+
+static void timer_count(_Atomic(uint64_t)* counter) {
+    // only the owning core updates the counters
+    atomic_store_relaxed(counter, atomic_load_relaxed(counter) + 1);
 }
 
-static void arch_timer_set_deadline(uint64_t deadline) {
+static void arch_timer_set_deadline(timers_queue_t* timers, uint64_t deadline) {
+    // the msr write is expensive, skip it if nothing changes
+    if (timers->armed_deadline == deadline) {
+        timer_count(&timers->skipped_writes);
+        return;
+    }
+    timers->armed_deadline = deadline;
+    timer_count(&timers->writes);
+
     // TODO: LAPIC timer support
     tsc_timer_set_deadline(deadline);
 }
 
-static void arch_timer_clear(void) {
+static void arch_timer_clear(timers_queue_t* timers) {
+    if (timers->armed_deadline == 0) {
+        timer_count(&timers->skipped_writes);
+        return;
+    }
+    timers->armed_deadline = 0;
+    timer_count(&timers->writes);
+
     // TODO: LAPIC timer support
     tsc_timer_clear();
 }
 
+//----------------------------------------------------------------------------------------------------------------------
+// Timer wheel
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Find the next pending slot of a level, returns the wheel tick it
+ * expires at, or UINT64_MAX if there are no timers in the level
+ */
+static uint64_t timer_wheel_level_next(timers_queue_t* timers, size_t level, size_t* slot) {
+    uint64_t pending = timers->wheel_pending[level];
+    if (pending == 0) {
+        return UINT64_MAX;
+    }
+
+    // rotate the mask so the current slot is the first bit, timers are always
+    // placed after the current slot, so it can only be pending once overdue
+    size_t shift = level * TIMER_WHEEL_LEVEL_SHIFT;
+    uint64_t clock = timers->wheel_clock >> shift;
+    size_t pos = clock % TIMER_WHEEL_SLOTS;
+    uint64_t rotated = (pending >> pos) | (pending << ((TIMER_WHEEL_SLOTS - pos) % TIMER_WHEEL_SLOTS));
+    size_t offset = __builtin_ctzll(rotated);
+
+    *slot = (pos + offset) % TIMER_WHEEL_SLOTS;
+    return (clock + offset) << shift;
+}
+
+/**
+ * The wheel tick at which the next slot of the wheel expires
+ */
+static uint64_t timer_wheel_next(timers_queue_t* timers) {
+    uint64_t next = UINT64_MAX;
+    if (timers->wheel_count != 0) {
+        for (size_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            size_t slot;
+            next = MIN(next, timer_wheel_level_next(timers, level, &slot));
+        }
+    }
+    return next;
+}
+
+/**
+ * Move the wheel clock to the current time, only possible when no slot
+ * expired in between, otherwise the timer interrupt is about to collect
+ * them and will move the clock itself
+ */
+static void timer_wheel_forward(timers_queue_t* timers, uint64_t now) {
+    uint64_t now_tick = now >> timers->wheel_shift;
+    if (now_tick > timers->wheel_clock && timer_wheel_next(timers) > now_tick) {
+        timers->wheel_clock = now_tick;
+    }
+}
+
+/**
+ * Try to put the timer on the wheel, the timer fires at the end of its slot
+ * so it stays in the level only if the slot ends within the slack of the
+ * timer, otherwise it goes to the slot of the level that ends before its
+ * deadline, and cascades down to a finer level once that slot expires
+ */
+static bool timer_wheel_add(timers_queue_t* timers, timer_t* timer) {
+    // round the deadline up to a wheel tick, anything that is due
+    // on the current tick is too close for the wheel
+    uint64_t tick = 1ull << timers->wheel_shift;
+    if (timer->deadline > UINT64_MAX - tick) {
+        return false;
+    }
+    uint64_t deadline = (timer->deadline + tick - 1) >> timers->wheel_shift;
+    if (deadline <= timers->wheel_clock) {
+        return false;
+    }
+
+    // the lowest level that can hold the timer, we leave two slots of
+    // room so rounding to the slot never wraps around to the current one
+    uint64_t delta = deadline - timers->wheel_clock;
+    size_t level = 0;
+    while (delta >= ((uint64_t)(TIMER_WHEEL_SLOTS - 2) << (level * TIMER_WHEEL_LEVEL_SHIFT))) {
+        level++;
+        if (level == TIMER_WHEEL_LEVELS) {
+            return false;
+        }
+    }
+
+    // round up to the end of the slot, and make sure that is not too late
+    size_t shift = level * TIMER_WHEEL_LEVEL_SHIFT;
+    uint64_t expires = (deadline + (1ull << shift) - 1) >> shift;
+    uint64_t expires_tsc = (expires << shift) << timers->wheel_shift;
+    if (expires_tsc - timer->deadline > timer->slack) {
+        // the slots of the lowest level are too coarse already
+        if (level == 0) {
+            return false;
+        }
+
+        // round down instead, what is left once the slot expires fits a
+        // finer level, if that is the current slot then take the furthest
+        // slot of the level below, the delta covers all of it
+        expires = deadline >> shift;
+        if (expires <= (timers->wheel_clock >> shift)) {
+            level--;
+            shift = level * TIMER_WHEEL_LEVEL_SHIFT;
+            expires = (timers->wheel_clock >> shift) + TIMER_WHEEL_SLOTS - 2;
+        }
+        expires_tsc = (expires << shift) << timers->wheel_shift;
+    }
+
+    size_t slot = expires % TIMER_WHEEL_SLOTS;
+    list_add_tail(&timers->wheel[level][slot], &timer->link);
+    timers->wheel_pending[level] |= 1ull << slot;
+    timers->wheel_count++;
+
+    timer->expires = expires_tsc;
+    timer->wheel_level = level;
+    timer->wheel_slot = slot;
+    return true;
+}
+
+static void timer_wheel_remove(timers_queue_t* timers, timer_t* timer) {
+    list_t* slot = &timers->wheel[timer->wheel_level][timer->wheel_slot];
+    list_del(&timer->link);
+    if (list_is_empty(slot)) {
+        timers->wheel_pending[timer->wheel_level] &= ~(1ull << timer->wheel_slot);
+    }
+    timers->wheel_count--;
+}
+
+/**
+ * Put the timer on the exact timer tree, the tree is sorted by the latest time each
+ * timer may fire, so arming the hardware for the first one also covers the timers
+ * whose range overlaps it
+ */
+static void timer_tree_add(timers_queue_t* timers, timer_t* timer) {
+    timer->expires = timer->deadline > UINT64_MAX - timer->slack ? UINT64_MAX : timer->deadline + timer->slack;
+    timer->wheel_level = TIMER_WHEEL_NONE;
+    rb_add_cached(&timer->node, &timers->root, timer_less);
+}
+
+/**
+ * Move the timers of every slot that expired into the timer tree so they
+ * are dispatched with the exact timers, each slot is a single interrupt
+ * no matter how many timers share it, timers that expired before their
+ * deadline are cascaded into a finer level
+ */
+static void timer_wheel_collect(timers_queue_t* timers, uint64_t now) {
+    uint64_t now_tick = now >> timers->wheel_shift;
+
+    list_t cascade;
+    list_init(&cascade);
+
+    bool collected;
+    do {
+        collected = false;
+        for (size_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+            size_t slot;
+            if (timer_wheel_level_next(timers, level, &slot) > now_tick) {
+                continue;
+            }
+
+            list_t* head = &timers->wheel[level][slot];
+            while (!list_is_empty(head)) {
+                timer_t* timer = containerof(list_pop(head), timer_t, link);
+                timers->wheel_count--;
+
+                timer->wheel_level = TIMER_WHEEL_NONE;
+                if (timer->expires < timer->deadline) {
+                    list_add_tail(&cascade, &timer->link);
+                } else {
+                    rb_add_cached(&timer->node, &timers->root, timer_less);
+                }
+            }
+            timers->wheel_pending[level] &= ~(1ull << slot);
+            collected = true;
+        }
+    } while (collected);
+
+    // nothing is left before now, so the clock can move up to it
+    if (now_tick > timers->wheel_clock) {
+        timers->wheel_clock = now_tick;
+    }
+
+    // only now place the cascaded timers, relative to the new clock, the
+    // ones that are due by now or can't use the wheel go to the tree
+    while (!list_is_empty(&cascade)) {
+        timer_t* timer = containerof(list_pop(&cascade), timer_t, link);
+        if (!timer_wheel_add(timers, timer)) {
+            timer_tree_add(timers, timer);
+        }
+    }
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Timer queue
+//----------------------------------------------------------------------------------------------------------------------
+
+/**
+ * Add the timer to the queue, timers with slack go on the wheel when
+ * they can, everything else goes to the timer tree
+ */
+static void timer_enqueue(timers_queue_t* timers, timer_t* timer) {
+    timer->queue = timers;
+
+    if (timer->slack != 0) {
+        timer_wheel_forward(timers, get_tsc());
+        if (timer_wheel_add(timers, timer)) {
+            return;
+        }
+    }
+
+    timer_tree_add(timers, timer);
+}
+
+static void timer_dequeue(timers_queue_t* timers, timer_t* timer) {
+    if (timer->wheel_level == TIMER_WHEEL_NONE) {
+        rb_erase_cached(&timer->node, &timers->root);
+    } else {
+        timer_wheel_remove(timers, timer);
+    }
+    timer->queue = nullptr;
+}
+
+/**
+ * The time the next timer of the queue expires, UINT64_MAX if there are none
+ */
+static uint64_t timer_next_expiry(timers_queue_t* timers) {
+    uint64_t next = UINT64_MAX;
+
+    rb_node_t* node = rb_first_cached(&timers->root);
+    if (node != nullptr) {
+        next = containerof(node, timer_t, node)->expires;
+    }
+
+    uint64_t wheel = timer_wheel_next(timers);
+    if (wheel != UINT64_MAX) {
+        next = MIN(next, wheel << timers->wheel_shift);
+    }
+
+    return next;
+}
+
+/**
+ * Program the hardware for the next timer of the queue
+ */
+static void timer_rearm(timers_queue_t* timers) {
+    uint64_t next = timer_next_expiry(timers);
+    if (next != UINT64_MAX) {
+        arch_timer_set_deadline(timers, next);
+    } else {
+        arch_timer_clear(timers);
+    }
+}
+
+
 __attribute__((interrupt))
 void timer_interrupt_handler(interrupt_frame_t* frame) {
     // disable preemption so we won't switch context
     // while running timers
     preempt_disable();
+    cpu_time_kind_t prev_kind = sched_account_enter(CPU_TIME_IRQ);
 
     // we know the interrupt happened, we can ack it
     lapic_eoi();
@@ -62,16 +379,22 @@ void timer_interrupt_handler(interrupt_frame_t* frame) {
     spinlock_acquire(&timers->lock);
     timers->dispatching = true;
 
-    // go over the timers in the tree that should be executed right now
-    timer_t* timer = nullptr;
+    // the deadline msr is cleared once the timer fires
+    timers->armed_deadline = 0;
+    timer_count(&timers->interrupts);
+
+    // the expired slots of the wheel join the exact timers
+    timer_wheel_collect(timers, get_tsc());
+
+    // go over the timers in the tree that should be executed right now, the tree
+    // is sorted by expiry so we stop at the first timer that is not due yet
     for (;;) {
         rb_node_t* node = rb_first_cached(&timers->root);
         if (node == nullptr) {
-            timer = nullptr;
             break;
         }
 
-        timer = containerof(node, timer_t, node);
+        timer_t* timer = containerof(node, timer_t, node);
         spinlock_acquire(&timer->lock.lock);
         if (get_tsc() < timer->deadline) {
             spinlock_release(&timer->lock.lock);
@@ -79,9 +402,9 @@ void timer_interrupt_handler(interrupt_frame_t* frame) {
         }
 
         // remove from the tree
-        rb_erase_cached(&timer->node, &timers->root);
-        timer->queue = nullptr;
+        timer_dequeue(timers, timer);
         spinlock_release(&timer->lock.lock);
+        timer_count(&timers->expired);
 
         //
         // call the callback, this may modify the tree however it wants
@@ -101,17 +424,13 @@ void timer_interrupt_handler(interrupt_frame_t* frame) {
         spinlock_acquire(&timers->lock);
     }
 
-    // mark we finished dispatching and unlock
+    // setup the timer for whatever comes next, either in the tree or the wheel
     timers->dispatching = false;
+    timer_rearm(timers);
     spinlock_release(&timers->lock);
 
-    // if we still have a timer object in here it means that this is the next
-    // time we should run it, setup the timer
-    if (timer != nullptr) {
-        arch_timer_set_deadline(timer->deadline);
-    } else {
-        arch_timer_clear();
-    }
+    // back to what the thread was doing before the interrupt
+    sched_account_enter(prev_kind);
 
     // we re-enable preemption (tho right now
     // the interrupts are disabled), this will
@@ -123,9 +442,20 @@ INIT_CODE void init_timers_per_core(void) {
     // initialize all the roots
     m_timer.root = RB_ROOT_CACHED;
     m_timer.dispatching = false;
+
+    // a wheel tick is the power of two of tsc ticks closest below the tick length
+    timers_queue_t* timers = pcpu_get_pointer(&m_timer);
+    uint64_t tick = MAX(us_to_tsc(TIMER_WHEEL_TICK_US), 1);
+    timers->wheel_shift = 63 - __builtin_clzll(tick);
+    timers->wheel_clock = get_tsc() >> timers->wheel_shift;
+    for (size_t level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+        for (size_t slot = 0; slot < TIMER_WHEEL_SLOTS; slot++) {
+            list_init(&timers->wheel[level][slot]);
+        }
+    }
 }
 
-void timer_set_deadline(timer_t* timer, uint64_t deadline) {
+void timer_set_deadline_slack(timer_t* timer, uint64_t deadline, uint64_t slack) {
     // NOTE: we need to perform an irq save and not just preempt disable
     //       because we want to be able to set timers from interrupts.
     bool irq_state = irq_spinlock_acquire(&timer->lock);
@@ -133,26 +463,26 @@ void timer_set_deadline(timer_t* timer, uint64_t deadline) {
     // if already inside of a queue then remove it
     if (timer->queue != nullptr) {
         timers_queue_t* timers = timer->queue;
-        timer->queue = nullptr;
 
         spinlock_acquire(&timers->lock);
-        rb_erase_cached(&timer->node, &timers->root);
+        timer_dequeue(timers, timer);
         spinlock_release(&timers->lock);
     }
 
     timers_queue_t* timers = pcpu_get_pointer(&m_timer);
     spinlock_acquire(&timers->lock);
 
-    // update the time
+    // update the time and add it again
     timer->deadline = deadline;
-    timer->queue = timers;
+    timer->slack = slack;
+    timer_enqueue(timers, timer);
 
-    // and add it again
-    if (rb_add_cached(&timer->node, &timers->root, timer_less) != nullptr) {
-        if (!timers->dispatching) {
-            // if we are the new leftmost node then we are the next timer to arrive,
-            // so set the deadline to us, otherwise the dispatcher will set the deadline
-            arch_timer_set_deadline(timer->deadline);
+    // only move the hardware timer earlier, if it is armed for later
+    // then an earlier interrupt will arm it again for what comes next,
+    // while dispatching the dispatcher will set the deadline
+    if (!timers->dispatching) {
+        if (timers->armed_deadline == 0 || timer->expires < timers->armed_deadline) {
+            arch_timer_set_deadline(timers, timer->expires);
         }
     }
 
@@ -166,25 +496,36 @@ void timer_cancel(timer_t* timer) {
     if (timer->queue != nullptr) {
         // remove from the timers queue
         timers_queue_t* timers = timer->queue;
-        timer->queue = nullptr;
 
         spinlock_acquire(&timers->lock);
+        timer_dequeue(timers, timer);
 
-        timer_t* leftmost = rb_entry_safe(rb_erase_cached(&timer->node, &timers->root), timer_t, node);
-        if (!timers->dispatching && timers == pcpu_get_pointer(&m_timer)) {
-            // update the per-cpu timer, only do this if we are on the correct core, if we are not
-            // the timer on the other core will simply jump too early (or spuriously), and we handle
-            // that gracefully.
-            if (leftmost != nullptr) {
-                // we are the new leftmost timer
-                arch_timer_set_deadline(leftmost->deadline);
-            } else {
-                // no more timers
-                arch_timer_clear();
-            }
+        // we don't rearm the hardware for the next timer, if the cancelled timer was
+        // the next one the interrupt comes in early and arms for the next one, this
+        // saves the msr write when a timer is cancelled and set again right after,
+        // we only clear it on the current core when no timers are left at all
+        if (
+            !timers->dispatching &&
+            timers == pcpu_get_pointer(&m_timer) &&
+            rb_first_cached(&timers->root) == nullptr &&
+            timers->wheel_count == 0
+        ) {
+            arch_timer_clear(timers);
         }
         spinlock_release(&timers->lock);
     }
 
     irq_spinlock_release(&timer->lock, irq_state);
 }
+
+uint64_t timer_get_next_deadline(void) {
+    return pcpu_get_pointer(&m_timer)->armed_deadline;
+}
+
+void timer_get_stats(int cpu, uint64_t* interrupts, uint64_t* writes, uint64_t* skipped_writes, uint64_t* expired) {
+    timers_queue_t* timers = pcpu_get_pointer_of(&m_timer, cpu);
+    *interrupts = atomic_load_relaxed(&timers->interrupts);
+    *writes = atomic_load_relaxed(&timers->writes);
+    *skipped_writes = atomic_load_relaxed(&timers->skipped_writes);
+    *expired = atomic_load_relaxed(&timers->expired);
+}
@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include "arch/intr.h"
+#include "lib/list.h"
 #include "lib/tsc.h"
 #include "lib/rbtree/rbtree.h"
 #include "sync/spinlock.h"
@@ -12,11 +13,23 @@ typedef struct timers_queue timers_queue_t;
 
 typedef void (*timer_cb_t)(timer_t* timer);
 
+/**
+ * The wheel level of a timer that is in the exact timer tree
+ */
+#define TIMER_WHEEL_NONE    0xFF
+
 struct timer {
-    /**
-     * The node in the timer tree
-     */
-    rb_node_t node;
+    union {
+        /**
+         * The node in the timer tree
+         */
+        rb_node_t node;
+
+        /**
+         * The link in the wheel slot
+         */
+        list_entry_t link;
+    };
 
     /**
      * Lock to protect the timer
@@ -24,10 +37,22 @@ struct timer {
     irq_spinlock_t lock;
 
     /**
-     * The deadline of the timer
+     * The deadline of the timer, it never fires before it
      */
     uint64_t deadline;
 
+    /**
+     * How late after the deadline the timer may fire, timers with
+     * slack share interrupts with the timers around them
+     */
+    uint64_t slack;
+
+    /**
+     * The time the timer is going to fire at, somewhere
+     * between the deadline and the deadline plus the slack
+     */
+    uint64_t expires;
+
     /**
      * The callback for the timer
      */
@@ -37,6 +62,13 @@ struct timer {
      * The timers queue we are on right now
      */
     timers_queue_t* queue;
+
+    /**
+     * The wheel slot the timer is in, TIMER_WHEEL_NONE
+     * as the level if it is in the timer tree
+     */
+    uint8_t wheel_level;
+    uint8_t wheel_slot;
 };
 
 /**
@@ -50,12 +82,24 @@ void timer_interrupt_handler(interrupt_frame_t* frame);
 INIT_CODE void init_timers_per_core(void);
 
 /**
- * Set a deadline for this timer
+ * Set a deadline for this timer, allowing it to fire up to slack ticks late,
+ * timers with enough slack go on the timer wheel instead of the timer tree
  *
  * @param timer     [IN] The timer to set the deadline on
  * @param deadline  [IN] The deadline for the timer
+ * @param slack     [IN] How late the timer may fire, in tsc ticks
  */
-void timer_set_deadline(timer_t* timer, uint64_t deadline);
+void timer_set_deadline_slack(timer_t* timer, uint64_t deadline, uint64_t slack);
+
+/**
+ * Set an exact deadline for this timer
+ *
+ * @param timer     [IN] The timer to set the deadline on
+ * @param deadline  [IN] The deadline for the timer
+ */
+static inline void timer_set_deadline(timer_t* timer, uint64_t deadline) {
+    timer_set_deadline_slack(timer, deadline, 0);
+}
 
 /**
  * Set a timer with the given timeout in milliseconds
@@ -68,8 +112,27 @@ static inline void timer_set_timeout(timer_t* timer, uint64_t ms) {
 }
 
 /**
- * Cancel a timer, works across cores
+ * Cancel a timer, works across cores, the hardware timer is left armed
+ * and a spurious interrupt is handled gracefully
  *
  * @param timer     [IN] The timer to cancel
  */
 void timer_cancel(timer_t* timer);
+
+/**
+ * Get the deadline the hardware timer of the current core is armed with, zero
+ * if it is not armed, since cancelling does not rearm the hardware this may be
+ * earlier than the next timer, must be called with irqs disabled
+ */
+uint64_t timer_get_next_deadline(void);
+
+/**
+ * Get the timer statistics of the given core
+ *
+ * @param cpu               [IN] The core to get the stats of
+ * @param interrupts        [OUT] The amount of timer interrupts
+ * @param writes            [OUT] The amount of times the hardware timer was programmed
+ * @param skipped_writes    [OUT] The amount of times programming was skipped since nothing changed
+ * @param expired           [OUT] The amount of timers that fired
+ */
+void timer_get_stats(int cpu, uint64_t* interrupts, uint64_t* writes, uint64_t* skipped_writes, uint64_t* expired);
@@ -3,16 +3,74 @@
 
 #include <cpuid.h>
 
+#include "clock.h"
+#include "timer.h"
 #include "acpi/acpi.h"
 #include "arch/intrin.h"
 #include "lib/defs.h"
 #include "lib/list.h"
 
+/**
+ * How long to measure the TSC against the ACPI timer after boot, long enough
+ * for the cost of reading the timers to not matter, and short enough for
+ * a 24bit ACPI timer to not wrap around
+ */
+#define TSC_REFINE_WINDOW_MS    1000
+
+/**
+ * If the refinement timer fires this late the ACPI timer might have wrapped
+ * around, a 24bit timer wraps after ~4.6s, this leaves room for the early
+ * calibration to be far off
+ */
+#define TSC_REFINE_LATE_MS      2000
+
 /**
  * The calculated TSC resolution
  */
 uint64_t g_tsc_freq_hz = 0;
 
+/**
+ * The frequency came from the crystal the TSC is derived from, so there is nothing to refine
+ */
+LATE_RO static bool m_tsc_freq_known = false;
+
+/**
+ * The start of the refinement window
+ */
+static timer_t m_tsc_refine_timer;
+static uint64_t m_tsc_refine_start_tsc;
+static uint32_t m_tsc_refine_start_ticks;
+
+/**
+ * Get the TSC frequency from the cpuid, either from the crystal ratio or
+ * from the nominal frequency of the core, zero if the cpu does not report it
+ */
+INIT_CODE static uint64_t cpuid_tsc_freq(bool* exact) {
+    uint32_t a, b, c, d;
+    uint32_t max_leaf = __get_cpuid_max(0, nullptr);
+
+    // the TSC runs at a ratio of the core crystal clock
+    if (max_leaf >= 0x15) {
+        __cpuid(0x15, a, b, c, d);
+        if (a != 0 && b != 0 && c != 0) {
+            *exact = true;
+            return ((uint64_t)c * b) / a;
+        }
+    }
+
+    // the TSC runs at the nominal frequency, but only
+    // reported in MHz so it is just a good starting point
+    if (max_leaf >= 0x16) {
+        __cpuid(0x16, a, b, c, d);
+        if ((a & 0xFFFF) != 0) {
+            *exact = false;
+            return (uint64_t)(a & 0xFFFF) * 1000000;
+        }
+    }
+
+    return 0;
+}
+
 /**
  * Quick calibration using the ACPI timer, this is enough to get started with timers
  * and anything that requires delays, but it can be quite off from the real thing
@@ -27,20 +85,81 @@ INIT_CODE static uint64_t quick_acpi_timer_calibrate(void) {
     return (end_tsc - start_tsc) * 9861;
 }
 
+/**
+ * Sample the ACPI timer together with the TSC, the port read is slow
+ * so take the TSC on both sides of it and use the middle
+ */
+static void tsc_sample_acpi_timer(uint64_t* tsc, uint32_t* ticks) {
+    bool irq_state = irq_save();
+    uint64_t before = get_tsc();
+    *ticks = acpi_get_timer_tick();
+    uint64_t after = get_tsc();
+    irq_restore(irq_state);
+    *tsc = before + (after - before) / 2;
+}
+
+static void tsc_refine(timer_t* timer) {
+    uint64_t end_tsc;
+    uint32_t end_ticks;
+    tsc_sample_acpi_timer(&end_tsc, &end_ticks);
+
+    // if the timer fired late the ACPI timer might have wrapped around, the
+    // elapsed TSC tells us that even with the rough frequency, in that case
+    // start a new window from here
+    uint64_t elapsed_tsc = end_tsc - m_tsc_refine_start_tsc;
+    if (elapsed_tsc > (g_tsc_freq_hz / 1000) * TSC_REFINE_LATE_MS) {
+        WARN("timer: TSC refinement timer was late, measuring again");
+        m_tsc_refine_start_tsc = end_tsc;
+        m_tsc_refine_start_ticks = end_ticks;
+        timer_set_timeout(timer, TSC_REFINE_WINDOW_MS);
+        return;
+    }
+
+    // the timer might only be 24bit, the window is short enough for that
+    uint64_t ticks = (end_ticks - m_tsc_refine_start_ticks) & 0xFFFFFF;
+    if (ticks == 0) {
+        return;
+    }
+    uint64_t freq = (elapsed_tsc * ACPI_TIMER_FREQUENCY) / ticks;
+
+    TRACE("timer: Refined TSC calibration %lu.%03lu MHz",
+        freq / 1000000, (freq / 1000) % 1000);
+
+    g_tsc_freq_hz = freq;
+    clock_set_tsc_freq(freq);
+}
+
 INIT_CODE err_t init_tsc_early(void) {
     err_t err = NO_ERROR;
 
-    g_tsc_freq_hz = quick_acpi_timer_calibrate();
-    CHECK(g_tsc_freq_hz != 0);
-    TRACE("timer: Fast TSC calibration using ACPI Timer %lu.%03lu MHz",
-        g_tsc_freq_hz / 1000000, (g_tsc_freq_hz / 1000) % 1000);
-
-    // TODO: what should we do about refinement
+    g_tsc_freq_hz = cpuid_tsc_freq(&m_tsc_freq_known);
+    if (g_tsc_freq_hz != 0) {
+        TRACE("timer: TSC frequency from CPUID %lu.%03lu MHz%s",
+            g_tsc_freq_hz / 1000000, (g_tsc_freq_hz / 1000) % 1000,
+            m_tsc_freq_known ? "" : " (nominal)");
+    } else {
+        g_tsc_freq_hz = quick_acpi_timer_calibrate();
+        CHECK(g_tsc_freq_hz != 0);
+        TRACE("timer: Fast TSC calibration using ACPI Timer %lu.%03lu MHz",
+            g_tsc_freq_hz / 1000000, (g_tsc_freq_hz / 1000) % 1000);
+    }
 
 cleanup:
     return err;
 }
 
+INIT_CODE void tsc_start_refinement(void) {
+    if (m_tsc_freq_known) {
+        return;
+    }
+
+    // measure over a long window in the background, the clock
+    // page is updated once it is done
+    tsc_sample_acpi_timer(&m_tsc_refine_start_tsc, &m_tsc_refine_start_ticks);
+    m_tsc_refine_timer.callback = tsc_refine;
+    timer_set_timeout(&m_tsc_refine_timer, TSC_REFINE_WINDOW_MS);
+}
+
 INIT_CODE bool tsc_deadline_is_supported(void) {
     uint32_t a, b, c, d;
     __cpuid(1, a, b, c, d);
@@ -10,6 +10,12 @@
  */
 err_t INIT_CODE init_tsc_early(void);
 
+/**
+ * Measure the TSC over a long window in the background, and publish the more
+ * accurate frequency once done, does nothing if CPUID gave the exact frequency
+ */
+INIT_CODE void tsc_start_refinement(void);
+
 /**
  * Returns true if the CPU supports TSC deadline
  */
@@ -5,6 +5,8 @@
 #include "lib/except.h"
 #include "lib/atomic.h"
 #include "lib/list.h"
+#include "thread/group.h"
+#include "thread/wait.h"
 
 
 kernel_object_t* kernel_object_get(kernel_object_t* object) {
@@ -28,6 +30,14 @@ void kernel_object_put(kernel_object_t* object) {
             irq_free(containerof(object, irq_t, object));
         } break;
 
+        case KERNEL_OBJECT_TYPE_SCHED_GROUP: {
+            sched_group_free(containerof(object, sched_group_t, object));
+        } break;
+
+        case KERNEL_OBJECT_TYPE_WAIT_SET: {
+            wait_set_free(containerof(object, wait_set_t, object));
+        } break;
+
         default:
             ASSERT(0, "Invalid kernel object type %d", object->type);
     }
@@ -6,6 +6,8 @@
 
 typedef enum kernel_object_type : uint8_t {
     KERNEL_OBJECT_TYPE_IRQ,
+    KERNEL_OBJECT_TYPE_SCHED_GROUP,
+    KERNEL_OBJECT_TYPE_WAIT_SET,
 } kernel_object_type_t;
 
 typedef struct kernel_object {
@@ -1,7 +1,9 @@
 #include "syscall.h"
+#include "arch/intr.h"
 #include "arch/smp.h"
 #include "irq/ioapic.h"
 #include "irq/irq.h"
+#include "irq/msi.h"
 #include "lib/assert.h"
 #include "lib/except.h"
 #include "lib/list.h"
@@ -27,9 +29,12 @@
 #include "lib/rbtree/rbtree.h"
 #include "mem/mappings.h"
 #include "mem/phys.h"
+#include "mem/stack.h"
 #include "mem/virt.h"
+#include "thread/group.h"
 #include "thread/sched.h"
 #include "thread/wait.h"
+#include "time/clock.h"
 #include "uapi/wait.h"
 #include "user/handle.h"
 #include "user/object.h"
@@ -73,14 +78,6 @@ static void copy_string_from_user(char* dst, const char* src, size_t max_size) {
     *(char*)dst = '\0';
 }
 
-static void copy_to_user(void* dst, const void* src, size_t size) {
-    assert_user_range(dst, size);
-
-    user_access_enable();
-    memcpy((void*)dst, src, size);
-    user_access_disable();
-}
-
 //----------------------------------------------------------------------------------------------------------------------
 // Debug
 //----------------------------------------------------------------------------------------------------------------------
@@ -96,22 +93,121 @@ static void handle_sys_debug_print(const char* message, size_t message_len) {
 // VMAR management
 //----------------------------------------------------------------------------------------------------------------------
 
-static void* handle_sys_mem_reserve(size_t total_page_count, size_t mappable_page_count, const char* name) {
-    vmar_lock();
+/**
+ * The max amount of released memory regions we keep around
+ */
+#define MEM_POOL_MAX    16
 
-    ASSERT(total_page_count >= mappable_page_count);
+/**
+ * Pool of released memory regions, these are kept reserved with their page
+ * table levels intact so they can be handed out again without touching
+ * the vmar tree, protected by the vmar lock
+ */
+static vmar_t* m_mem_pool[MEM_POOL_MAX];
+static size_t m_mem_pool_count = 0;
+
+static vmar_t* mem_get_bump_parent(vmar_t* mapping) {
+    vmar_t* mappable = vmar_find(mapping, mapping->base);
+    if (mappable != nullptr && mappable->type == VMAR_TYPE_REGION) {
+        ASSERT(mappable->subtype == VMAR_SUBTYPE_MAPPABLE);
+        return mappable;
+    }
+    return mapping;
+}
+
+static size_t mem_get_mappable_page_count(vmar_t* mapping) {
+    return mem_get_bump_parent(mapping)->page_count;
+}
+
+static vmar_t* mem_pool_pop(size_t total_page_count, size_t mappable_page_count) {
+    // we only check the top of the pool, practically all of
+    // the regions have the same geometry
+    if (m_mem_pool_count == 0) {
+        return nullptr;
+    }
+
+    vmar_t* mapping = m_mem_pool[m_mem_pool_count - 1];
+    if (mapping->page_count != total_page_count || mem_get_mappable_page_count(mapping) != mappable_page_count) {
+        return nullptr;
+    }
+
+    m_mem_pool_count--;
+    return mapping;
+}
+
+static bool mem_pool_push(vmar_t* mapping) {
+    if (m_mem_pool_count == ARRAY_LENGTH(m_mem_pool)) {
+        return false;
+    }
+
+    // reset the region, everything but the bump region is removed, and
+    // the bump region is discarded back to zero size, all of it
+    // shares a single TLB shootdown
+    virt_unmap_batch_begin();
+
+    vmar_t* bump_parent = mem_get_bump_parent(mapping);
+    vmar_t* bump = vmar_find(bump_parent, bump_parent->base);
+    ASSERT(bump != nullptr);
+    ASSERT(bump->subtype == VMAR_SUBTYPE_BUMP);
+
+    rb_node_t* node = rb_first(&bump_parent->region.root);
+    while (node != nullptr) {
+        vmar_t* child = rb_entry(node, vmar_t, node);
+        node = rb_next(node);
+        if (child != bump) {
+            vmar_free(child);
+        }
+    }
+
+    vmar_resize(bump, 0);
+    vmar_free_control(bump);
+
+    virt_unmap_batch_end();
+
+    // while pooled the region is not a valid memory region
+    mapping->subtype = VMAR_SUBTYPE_NONE;
+    vmar_set_name(mapping, "pooled");
+    m_mem_pool[m_mem_pool_count++] = mapping;
+    return true;
+}
+
+/**
+ * Give the bump of a memory region its own page for the control word, the page
+ * is faulted in right away so the page fault handler can read the word through
+ * the direct map, and it is only freed together with the bump
+ */
+static bool mem_alloc_control(vmar_t* bump) {
+    vmar_t* page = vmar_allocate(&g_user_memory, 1, nullptr);
+    if (page == nullptr) {
+        return false;
+    }
+
+    page->subtype = VMAR_SUBTYPE_MEM_CONTROL;
+    page->locked = true;
+    vmar_set_name(page, "mem-control");
 
+    if (IS_ERROR(virt_handle_page_fault((uintptr_t)page->base, IA32_PF_EC_WRITE | IA32_PF_EC_USER))) {
+        vmar_free(page);
+        return false;
+    }
+
+    bump->alloc.control = virt_get_direct(page->base);
+    bump->alloc.control_page = page;
+    ASSERT(bump->alloc.control != nullptr);
+    return true;
+}
+
+/**
+ * Reserve a new memory region with an empty bump at the start of its mappable
+ * range, null if we are out of address space
+ */
+static vmar_t* mem_reserve_new(size_t total_page_count, size_t mappable_page_count) {
     // reserve the top level region
     vmar_t* mapping = vmar_reserve(&g_user_memory, total_page_count, nullptr);
     if (mapping == nullptr) {
-        vmar_unlock();
         return nullptr;
     }
 
-    // mark as a mem region, copy the name to it
-    mapping->subtype = VMAR_SUBTYPE_MEM;
-    copy_string_from_user(mapping->name, name, sizeof(mapping->name));
-
     // we sometimes want the mappable range to be smaller 
     // than the total reserved range, handle that in here
     vmar_t* bump_parent = mapping;
@@ -119,7 +215,6 @@ static void* handle_sys_mem_reserve(size_t total_page_count, size_t mappable_pag
         vmar_t* mappable = vmar_reserve(mapping, mappable_page_count, mapping->base);
         if (mappable == nullptr) {
             vmar_free(mapping);
-            vmar_unlock();
             return nullptr;
         }
 
@@ -134,7 +229,6 @@ static void* handle_sys_mem_reserve(size_t total_page_count, size_t mappable_pag
     vmar_t* bump = vmar_allocate(bump_parent, 0, bump_parent->base);
     if (bump == nullptr) {
         vmar_free(mapping);
-        vmar_unlock();
         return nullptr;
     }
 
@@ -142,6 +236,49 @@ static void* handle_sys_mem_reserve(size_t total_page_count, size_t mappable_pag
     bump->subtype = VMAR_SUBTYPE_BUMP;
     vmar_set_name(bump, "bump");
 
+    return mapping;
+}
+
+static void* handle_sys_mem_reserve(size_t total_page_count, size_t mappable_page_count, const char* name, mem_control_t** user_control) {
+    if (user_control != nullptr) {
+        assert_user_range(user_control, sizeof(*user_control));
+    }
+
+    vmar_lock();
+
+    ASSERT(total_page_count >= mappable_page_count);
+
+    // attempt to take a region from the pool first
+    vmar_t* mapping = mem_pool_pop(total_page_count, mappable_page_count);
+    if (mapping == nullptr) {
+        mapping = mem_reserve_new(total_page_count, mappable_page_count);
+        if (mapping == nullptr) {
+            vmar_unlock();
+            return nullptr;
+        }
+    }
+
+    // mark as a mem region, copy the name to it
+    mapping->subtype = VMAR_SUBTYPE_MEM;
+    copy_string_from_user(mapping->name, name, sizeof(mapping->name));
+
+    // the control word starts out as zero, so nothing is
+    // accessible until the user sets it up
+    if (user_control != nullptr) {
+        vmar_t* bump_parent = mem_get_bump_parent(mapping);
+        vmar_t* bump = vmar_find(bump_parent, bump_parent->base);
+        if (!mem_alloc_control(bump)) {
+            vmar_free(mapping);
+            vmar_unlock();
+            return nullptr;
+        }
+
+        mem_control_t* control = bump->alloc.control_page->base;
+        user_access_enable();
+        *user_control = control;
+        user_access_disable();
+    }
+
     void* base = mapping->base;
 
     vmar_unlock();
@@ -248,6 +385,8 @@ static void handle_sys_mem_unmap_phys(void* ptr, size_t page_count) {
     vmar_t* mapping = vmar_find_mapping(&g_user_memory, ptr);
     ASSERT(mapping != nullptr);
     ASSERT(mapping->type == VMAR_TYPE_PHYS);
+    ASSERT(mapping->subtype != VMAR_SUBTYPE_CLOCK_PAGE);
+    ASSERT(mapping->subtype != VMAR_SUBTYPE_THREAD_RUN_PAGE);
     ASSERT(mapping->base == ptr);
     ASSERT(mapping->page_count == page_count);
     vmar_free(mapping);
@@ -255,6 +394,27 @@ static void handle_sys_mem_unmap_phys(void* ptr, size_t page_count) {
     vmar_unlock();
 }
 
+static void handle_sys_mem_free_initrd(void* ptr) {
+    vmar_lock();
+
+    vmar_t* mapping = vmar_find_mapping(&g_user_memory, ptr);
+    ASSERT(mapping != nullptr);
+    ASSERT(mapping->parent == &g_user_memory);
+    ASSERT(mapping->type == VMAR_TYPE_PHYS);
+    ASSERT(mapping->subtype == VMAR_SUBTYPE_INITRD);
+    ASSERT(mapping->base == ptr);
+
+    // remember the range, and unmap it from the user
+    uint64_t phys = mapping->phys.phys;
+    size_t page_count = mapping->page_count;
+    vmar_free(mapping);
+
+    // no one can access it anymore, return it to the buddy
+    ASSERT(!IS_ERROR(phys_reclaim_reserved(phys, PAGES_TO_SIZE(page_count))));
+
+    vmar_unlock();
+}
+
 static void handle_sys_mem_free(void* ptr) {
     vmar_lock();
 
@@ -263,7 +423,11 @@ static void handle_sys_mem_free(void* ptr) {
     ASSERT(mapping->type == VMAR_TYPE_REGION);
     ASSERT(mapping->subtype == VMAR_SUBTYPE_MEM);
     ASSERT(mapping->base == ptr);
-    vmar_free(mapping);
+
+    // keep the region for the next reservation if we can
+    if (!mem_pool_push(mapping)) {
+        vmar_free(mapping);
+    }
 
     vmar_unlock();
 }
@@ -424,10 +588,59 @@ static void handle_sys_jit_free(void* ptr) {
 // Thread handling
 //----------------------------------------------------------------------------------------------------------------------
 
-static bool handle_sys_thread_create(void* arg, const char* name) {
+static bool copy_sched_param_from_user(sched_param_t* param, const sched_param_t* user_param) {
+    assert_user_range(user_param, sizeof(*user_param));
+    user_access_enable();
+    *param = *user_param;
+    user_access_disable();
+    return sched_param_is_valid(param);
+}
+
+static sched_group_t* sched_group_lookup(uint64_t handle) {
+    kernel_object_t* object = handle_lookup(handle);
+    ASSERT(object->type == KERNEL_OBJECT_TYPE_SCHED_GROUP);
+    return containerof(object, sched_group_t, object);
+}
+
+static bool handle_sys_thread_create(void* arg, const char* name, const thread_create_params_t* user_params) {
     char kname[128];
     copy_string_from_user(kname, name, sizeof(kname));
 
+    // anything that is not given is inherited from us
+    thread_create_params_t params = {};
+    if (user_params != nullptr) {
+        assert_user_range(user_params, sizeof(*user_params));
+        user_access_enable();
+        params = *user_params;
+        user_access_disable();
+    }
+
+    thread_t* current = get_current_thread();
+
+    sched_param_t param;
+    if (params.flags & THREAD_CREATE_SCHED_PARAM) {
+        param = params.sched_param;
+        if (!sched_param_is_valid(&param)) {
+            return false;
+        }
+    } else {
+        sched_get_param(current, &param);
+    }
+
+    cpu_mask_t affinity;
+    if (params.flags & THREAD_CREATE_AFFINITY) {
+        affinity = params.affinity;
+        if (!sched_affinity_is_valid(&affinity)) {
+            return false;
+        }
+    } else {
+        sched_get_affinity(current, &affinity);
+    }
+
+    if ((params.flags & THREAD_CREATE_CPU_HINT) && params.placement > SCHED_PLACEMENT_SPREAD) {
+        return false;
+    }
+
     // create the new thread
     thread_t* thread = thread_create(
         runtime_thread_entry_thunk,
@@ -440,8 +653,24 @@ static bool handle_sys_thread_create(void* arg, const char* name) {
         return false;
     }
 
-    // start the thread
+    // place it in the requested group, or in our own group
+    if (params.flags & THREAD_CREATE_GROUP) {
+        sched_group_t* group = sched_group_lookup(params.group);
+        sched_set_group(thread, group);
+        kernel_object_put(&group->object);
+    } else {
+        sched_set_group(thread, current->group);
+    }
+
+    sched_set_affinity(thread, &affinity);
+    if (params.flags & THREAD_CREATE_CPU_HINT) {
+        sched_set_placement(thread, params.cpu_hint, params.placement);
+    }
+
+    // start the thread, if it outranks us let it run right away
+    sched_set_param(thread, &param);
     thread_start(thread);
+    sched_preempt_point();
 
     return true;
 }
@@ -458,6 +687,128 @@ static void handle_sys_thread_yield(void) {
     irq_restore(irq_state);
 }
 
+static bool handle_sys_thread_set_sched(const sched_param_t* user_param) {
+    sched_param_t param;
+    if (!copy_sched_param_from_user(&param, user_param)) {
+        return false;
+    }
+
+    sched_set_param(get_current_thread(), &param);
+    return true;
+}
+
+static bool handle_sys_thread_set_affinity(const cpu_mask_t* user_mask) {
+    assert_user_range(user_mask, sizeof(*user_mask));
+
+    cpu_mask_t mask;
+    user_access_enable();
+    mask = *user_mask;
+    user_access_disable();
+
+    if (!sched_affinity_is_valid(&mask)) {
+        return false;
+    }
+
+    sched_set_affinity(get_current_thread(), &mask);
+    return true;
+}
+
+static void handle_sys_thread_get_affinity(cpu_mask_t* user_mask) {
+    assert_user_range(user_mask, sizeof(*user_mask));
+
+    cpu_mask_t mask;
+    sched_get_affinity(get_current_thread(), &mask);
+
+    user_access_enable();
+    *user_mask = mask;
+    user_access_disable();
+}
+
+static void handle_sys_thread_get_cpu_time(cpu_time_stats_t* user_stats) {
+    assert_user_range(user_stats, sizeof(*user_stats));
+
+    cpu_time_stats_t stats = {};
+    sched_get_cpu_time(&stats);
+
+    user_access_enable();
+    *user_stats = stats;
+    user_access_disable();
+}
+
+static size_t handle_sys_sched_get_cpu_count(void) {
+    return g_cpu_count;
+}
+
+static bool handle_sys_sched_get_stats(size_t cpu, sched_stats_t* user_stats) {
+    assert_user_range(user_stats, sizeof(*user_stats));
+
+    sched_stats_t stats = {};
+    if (!sched_get_stats(cpu, &stats)) {
+        return false;
+    }
+
+    user_access_enable();
+    *user_stats = stats;
+    user_access_disable();
+
+    return true;
+}
+
+static bool handle_sys_sched_set_slice(uint64_t sched_class, uint64_t slice_us) {
+    // validate before narrowing
+    if (sched_class > SCHED_CLASS_IDLE || slice_us > SCHED_SLICE_MAX_US) {
+        return false;
+    }
+
+    return sched_set_slice(sched_class, slice_us);
+}
+
+static uint64_t handle_sys_sched_group_create(uint32_t weight) {
+    ASSERT(sched_group_weight_is_valid(weight));
+
+    sched_group_t* group = sched_group_create(weight);
+    if (group == nullptr) {
+        return INVALID_HANDLE;
+    }
+
+    uint64_t handle = handle_register(group);
+    if (handle == INVALID_HANDLE) {
+        kernel_object_put(&group->object);
+        return INVALID_HANDLE;
+    }
+
+    return handle;
+}
+
+static void handle_sys_sched_group_set_weight(uint64_t handle, uint32_t weight) {
+    ASSERT(sched_group_weight_is_valid(weight));
+
+    sched_group_t* group = sched_group_lookup(handle);
+    sched_group_set_weight(group, weight);
+    kernel_object_put(&group->object);
+}
+
+static void handle_sys_sched_group_get_stats(uint64_t handle, sched_group_stats_t* user_stats) {
+    assert_user_range(user_stats, sizeof(*user_stats));
+
+    // the calling thread might be in the group and did
+    // not leave the cpu since it last added its time
+    sched_flush_cpu_time();
+
+    sched_group_stats_t stats = {};
+    sched_group_t* group = sched_group_lookup(handle);
+    sched_group_get_stats(group, &stats);
+    kernel_object_put(&group->object);
+
+    user_access_enable();
+    *user_stats = stats;
+    user_access_disable();
+}
+
+static void handle_sys_stack_cache_set_limit(uint64_t limit) {
+    stack_cache_set_limit(MIN(limit, STACK_CACHE_MAX));
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Futex primitives
 //----------------------------------------------------------------------------------------------------------------------
@@ -467,7 +818,98 @@ static bool handle_sys_atomic_wait(wait_entry_t* wait_entries, size_t count, uin
 }
 
 static size_t handle_sys_atomic_notify(void* key, uint64_t mask, size_t count) {
-    return atomic_notify(key, mask, count);
+    size_t woken = atomic_notify(key, mask, count);
+
+    // switch right away to a woken up thread that outranks us
+    sched_preempt_point();
+
+    return woken;
+}
+
+static wait_status_t handle_sys_atomic_notify_wait(const notify_wait_params_t* user_params, uint64_t deadline) {
+    assert_user_range(user_params, sizeof(*user_params));
+
+    user_access_enable();
+    void* notify_key = user_params->notify_key;
+    uint64_t notify_mask = user_params->notify_mask;
+    uint64_t notify_count = user_params->notify_count;
+    user_access_disable();
+
+    // the wait entry is read by the wait itself
+    return atomic_notify_wait(notify_key, notify_mask, notify_count, &user_params->wait, deadline);
+}
+
+static wait_status_t handle_sys_atomic_requeue(const requeue_params_t* user_params) {
+    assert_user_range(user_params, sizeof(*user_params));
+
+    user_access_enable();
+    requeue_params_t params = *user_params;
+    user_access_disable();
+
+    return atomic_requeue(
+        &params.compare, params.wake_count,
+        params.requeue_key, params.requeue_count, params.requeue_waiters_bit
+    );
+}
+
+static wait_set_t* wait_set_lookup(uint64_t handle) {
+    kernel_object_t* object = handle_lookup(handle);
+    ASSERT(object->type == KERNEL_OBJECT_TYPE_WAIT_SET);
+    return containerof(object, wait_set_t, object);
+}
+
+static uint64_t handle_sys_wait_set_create(void) {
+    wait_set_t* set = wait_set_create();
+    if (set == nullptr) {
+        return INVALID_HANDLE;
+    }
+
+    uint64_t handle = handle_register(set);
+    if (handle == INVALID_HANDLE) {
+        kernel_object_put(&set->object);
+        return INVALID_HANDLE;
+    }
+
+    return handle;
+}
+
+static bool handle_sys_wait_set_add(uint64_t handle, const wait_entry_t* user_entry, uint64_t user_data) {
+    assert_user_range(user_entry, sizeof(*user_entry));
+
+    user_access_enable();
+    wait_entry_t entry = *user_entry;
+    user_access_disable();
+
+    wait_set_t* set = wait_set_lookup(handle);
+    bool result = wait_set_add(set, entry.key, entry.key_size, entry.mask, entry.waiters_bit, user_data);
+    kernel_object_put(&set->object);
+
+    return result;
+}
+
+static bool handle_sys_wait_set_remove(uint64_t handle, void* key, uint64_t user_data) {
+    wait_set_t* set = wait_set_lookup(handle);
+    bool result = wait_set_remove(set, key, user_data);
+    kernel_object_put(&set->object);
+    return result;
+}
+
+static size_t handle_sys_wait_set_wait(uint64_t handle, uint64_t* user_ready, size_t count, uint64_t deadline) {
+    count = MIN(count, WAIT_SET_MAX_READY);
+    assert_user_range(user_ready, count * sizeof(*user_ready));
+
+    uint64_t ready[WAIT_SET_MAX_READY];
+    wait_set_t* set = wait_set_lookup(handle);
+    size_t found = wait_set_wait(set, ready, count, deadline);
+    kernel_object_put(&set->object);
+
+    user_access_enable();
+    for (size_t i = 0; i < found; i++) {
+        user_ready[i] = ready[i];
+    }
+    user_access_disable();
+
+    return found;
 }
 
 //----------------------------------------------------------------------------------------------------------------------
@@ -482,7 +924,11 @@ static void handle_sys_handle_close(uint64_t handle) {
 // IRQ handling
 //----------------------------------------------------------------------------------------------------------------------
 
-static uint64_t handle_sys_irq_create_ioapic(wake_params_t* user_wake_params, uint32_t irq_num, uint32_t cpu_id) {
+/**
+ * Create an interrupt object on the given cpu that wakes the given key,
+ * with a vector allocated but not registered with anything yet
+ */
+static irq_t* irq_create_for_user(wake_params_t* user_wake_params, uint32_t cpu_id, irq_type_t type) {
     // get a copy of the wake params and validate it 
     assert_user_range(user_wake_params, sizeof(*user_wake_params));
     user_access_enable();
@@ -491,23 +937,24 @@ static uint64_t handle_sys_irq_create_ioapic(wake_params_t* user_wake_params, ui
     assert_user_range(wake_params.key, wake_params.key_size == WAIT_KEY_UINT32 ? 4 : 8);
 
     // make sure the id is in a valid range
-    ASSERT(cpu_id < g_cpu_count);
+    ASSERT(cpu_id < g_cpu_count || cpu_id == IRQ_CPU_ANY);
 
     // create the interrupt object
-    irq_t* irq = irq_create(cpu_id);
+    irq_t* irq = irq_create(cpu_id, type);
     if (irq == nullptr) {
-        return INVALID_HANDLE;
+        return nullptr;
     }
 
     // copy over the wake params
     irq->wait_key = wake_params.key;
     irq->wait_key_size = wake_params.key_size;
     irq->wait_mask = wake_params.mask;
+    irq->wait_waiters_bit = wake_params.waiters_bit;
 
-    // register the ioapic interrupt
-    ioapic_register_isa(irq, irq_num);
+    return irq;
+}
 
-    // create the handle for it
+static uint64_t irq_register_handle(irq_t* irq) {
     uint64_t handle = handle_register(irq);
     if (handle == INVALID_HANDLE) {
         kernel_object_put(&irq->object);
@@ -517,6 +964,41 @@ static uint64_t handle_sys_irq_create_ioapic(wake_params_t* user_wake_params, ui
     return handle;
 }
 
+static uint64_t handle_sys_irq_create_ioapic(wake_params_t* user_wake_params, uint32_t irq_num, uint32_t cpu_id) {
+    irq_t* irq = irq_create_for_user(user_wake_params, cpu_id, IRQ_TYPE_IOAPIC);
+    if (irq == nullptr) {
+        return INVALID_HANDLE;
+    }
+
+    // register the ioapic interrupt
+    ioapic_register_isa(irq, irq_num);
+
+    return irq_register_handle(irq);
+}
+
+static uint64_t handle_sys_irq_create_msi(wake_params_t* user_wake_params, uint32_t cpu_id, msi_message_t* user_message) {
+    assert_user_range(user_message, sizeof(*user_message));
+
+    irq_t* irq = irq_create_for_user(user_wake_params, cpu_id, IRQ_TYPE_MSI);
+    if (irq == nullptr) {
+        return INVALID_HANDLE;
+    }
+
+    // the driver programs the device with the message, we
+    // only need the vector to be ready before it does
+    msi_message_t message;
+    if (!msi_register(irq, &message)) {
+        kernel_object_put(&irq->object);
+        return INVALID_HANDLE;
+    }
+
+    user_access_enable();
+    *user_message = message;
+    user_access_disable();
+
+    return irq_register_handle(irq);
+}
+
 static void handle_sys_irq_unmask(uint64_t handle) {
     kernel_object_t* object = handle_lookup(handle);
     ASSERT(object->type == KERNEL_OBJECT_TYPE_IRQ);
@@ -525,6 +1007,76 @@ static void handle_sys_irq_unmask(uint64_t handle) {
     kernel_object_put(object);
 }
 
+static void handle_sys_irq_get_stats(uint64_t handle, irq_stats_t* user_stats) {
+    assert_user_range(user_stats, sizeof(*user_stats));
+
+    kernel_object_t* object = handle_lookup(handle);
+    ASSERT(object->type == KERNEL_OBJECT_TYPE_IRQ);
+    irq_stats_t stats = {};
+    irq_get_stats(containerof(object, irq_t, object), &stats);
+    kernel_object_put(object);
+
+    user_access_enable();
+    *user_stats = stats;
+    user_access_disable();
+}
+
+static irq_affinity_status_t handle_sys_irq_set_affinity(uint64_t handle, uint32_t cpu_id, msi_message_t* user_message) {
+    ASSERT(cpu_id < g_cpu_count || cpu_id == IRQ_CPU_ANY);
+    if (user_message != nullptr) {
+        assert_user_range(user_message, sizeof(*user_message));
+    }
+
+    kernel_object_t* object = handle_lookup(handle);
+    ASSERT(object->type == KERNEL_OBJECT_TYPE_IRQ);
+    irq_t* irq = containerof(object, irq_t, object);
+
+    // an MSI gets the message that targets the new cpu, which the
+    // driver has to program into the device for the move to happen
+    msi_message_t message = {};
+    irq_affinity_status_t status = irq_set_affinity(irq, cpu_id, &message);
+    bool is_msi = irq->type == IRQ_TYPE_MSI;
+    kernel_object_put(object);
+
+    if (status == IRQ_AFFINITY_SUCCESS && is_msi && user_message != nullptr) {
+        user_access_enable();
+        *user_message = message;
+        user_access_disable();
+    }
+
+    return status;
+}
+
+static bool handle_sys_irq_set_mode(uint64_t handle, irq_mode_t mode, _Atomic(uint64_t)* user_counter) {
+    ASSERT(mode == IRQ_MODE_MASK || mode == IRQ_MODE_AUTO_ACK);
+    if (user_counter != nullptr) {
+        assert_user_range(user_counter, sizeof(*user_counter));
+    }
+
+    kernel_object_t* object = handle_lookup(handle);
+    ASSERT(object->type == KERNEL_OBJECT_TYPE_IRQ);
+    bool result = irq_set_mode(containerof(object, irq_t, object), mode, user_counter);
+    kernel_object_put(object);
+
+    return result;
+}
+
+static wait_status_t handle_sys_irq_wait(uint64_t handle, uint64_t seen, uint64_t deadline, uint64_t* user_count) {
+    assert_user_range(user_count, sizeof(*user_count));
+
+    kernel_object_t* object = handle_lookup(handle);
+    ASSERT(object->type == KERNEL_OBJECT_TYPE_IRQ);
+    uint64_t count = 0;
+    wait_status_t status = irq_wait(containerof(object, irq_t, object), seen, deadline, &count);
+    kernel_object_put(object);
+
+    user_access_enable();
+    *user_count = count;
+    user_access_disable();
+
+    return status;
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Early syscalls for configuring stuff from the runtime
 //----------------------------------------------------------------------------------------------------------------------
@@ -534,13 +1086,76 @@ INIT_CODE static size_t handle_sys_early_get_initrd_size(void) {
     return file->size;
 }
 
-INIT_CODE static void handle_sys_early_get_initrd(void* addr) {
+INIT_CODE static void* handle_sys_early_map_initrd(void) {
     struct limine_file* file = g_limine_module_request.response->modules[0];
-    copy_to_user(addr, file->address, file->size);
+    uint64_t phys = direct_to_phys(file->address);
+    ASSERT((phys % PAGE_SIZE) == 0);
+
+    vmar_lock();
+
+    // map the module pages directly instead of copying them, the pages
+    // are normal memory so we can map them as cached, and we never want
+    // the runtime to modify them
+    vmar_t* mapping = vmar_map_phys(&g_user_memory, phys, SIZE_TO_PAGES(file->size), nullptr);
+    if (mapping == nullptr) {
+        vmar_unlock();
+        return nullptr;
+    }
+
+    mapping->subtype = VMAR_SUBTYPE_INITRD;
+    mapping->phys.protection = MAPPING_PROTECTION_RO;
+    mapping->phys.cached = true;
+    vmar_set_name(mapping, "initrd");
+
+    void* base = mapping->base;
+
+    vmar_unlock();
+
+    return base;
 }
 
-INIT_CODE static uint64_t handle_sys_early_get_tsc_freq(void) {
-	return g_tsc_freq_hz;
+INIT_CODE static void* handle_sys_early_map_clock_page(void) {
+    vmar_lock();
+
+    // the kernel keeps updating the page, the user only reads it
+    vmar_t* mapping = vmar_map_phys(&g_user_memory, clock_get_page_phys(), 1, nullptr);
+    if (mapping == nullptr) {
+        vmar_unlock();
+        return nullptr;
+    }
+
+    mapping->subtype = VMAR_SUBTYPE_CLOCK_PAGE;
+    mapping->phys.protection = MAPPING_PROTECTION_RO;
+    mapping->phys.cached = true;
+    vmar_set_name(mapping, "clock");
+
+    void* base = mapping->base;
+
+    vmar_unlock();
+
+    return base;
+}
+
+INIT_CODE static void* handle_sys_early_map_thread_run_page(void) {
+    vmar_lock();
+
+    // written by the scheduler on every switch, the user only reads it
+    vmar_t* mapping = vmar_map_phys(&g_user_memory, thread_get_run_page_phys(), 1, nullptr);
+    if (mapping == nullptr) {
+        vmar_unlock();
+        return nullptr;
+    }
+
+    mapping->subtype = VMAR_SUBTYPE_THREAD_RUN_PAGE;
+    mapping->phys.protection = MAPPING_PROTECTION_RO;
+    mapping->phys.cached = true;
+    vmar_set_name(mapping, "thread-run");
+
+    void* base = mapping->base;
+
+    vmar_unlock();
+
+    return base;
 }
 
 INIT_CODE static uint64_t handle_sys_early_get_rsdp(void) {
@@ -567,41 +1182,69 @@ INIT_CODE static void handle_sys_early_done(void) {
     protect_ro_data();
 }
 
-OMIT_ENDBR uint64_t syscall_handler(syscall_t syscall, uint64_t arg1, uint64_t arg2, uint64_t rip, uint64_t arg3, uint64_t arg4) {
+static uint64_t syscall_dispatch(syscall_t syscall, uint64_t arg1, uint64_t arg2, uint64_t rip, uint64_t arg3, uint64_t arg4) {
     switch (syscall) {
         case SYSCALL_DEBUG_PRINT: handle_sys_debug_print((void*)arg1, arg2); break;
         case SYSCALL_HEAP_ALLOC: return (uintptr_t)handle_sys_heap_alloc(arg1); break;
         case SYSCALL_HEAP_FREE: handle_sys_heap_free((void*)arg1); break;
-        case SYSCALL_MEM_RESERVE: return (uintptr_t)handle_sys_mem_reserve(arg1, arg2, (void*)arg3); break;
+        case SYSCALL_MEM_RESERVE: return (uintptr_t)handle_sys_mem_reserve(arg1, arg2, (void*)arg3, (void*)arg4); break;
         case SYSCALL_MEM_BUMP: return (uintptr_t)handle_sys_mem_bump((void*)arg1, arg2); break;
         case SYSCALL_MEM_MAP_PHYS: return (uintptr_t)handle_sys_mem_map_phys((void*)arg1, arg2, arg3); break;
         case SYSCALL_MEM_UNMAP_PHYS: handle_sys_mem_unmap_phys((void*)arg1, arg2); break;
         case SYSCALL_MEM_FREE: handle_sys_mem_free((void*)arg1); break;
+        case SYSCALL_MEM_FREE_INITRD: handle_sys_mem_free_initrd((void*)arg1); break;
         case SYSCALL_JIT_ALLOC: return (uintptr_t)handle_sys_jit_alloc(arg1, arg2); break;
         case SYSCALL_JIT_LOCK_PROTECTION: handle_sys_jit_lock_protection((void*)arg1); break;
         case SYSCALL_JIT_FREE: handle_sys_jit_free((void*)arg1); break;
-        case SYSCALL_THREAD_CREATE: return handle_sys_thread_create((void*)arg1, (void*)arg2); break;
+        case SYSCALL_THREAD_CREATE: return handle_sys_thread_create((void*)arg1, (void*)arg2, (void*)arg3); break;
         case SYSCALL_THREAD_EXIT: handle_sys_thread_exit(); break;
         case SYSCALL_THREAD_YIELD: handle_sys_thread_yield(); break;
+        case SYSCALL_THREAD_SET_SCHED: return handle_sys_thread_set_sched((void*)arg1); break;
+        case SYSCALL_THREAD_SET_AFFINITY: return handle_sys_thread_set_affinity((void*)arg1); break;
+        case SYSCALL_THREAD_GET_AFFINITY: handle_sys_thread_get_affinity((void*)arg1); break;
+        case SYSCALL_THREAD_GET_CPU_TIME: handle_sys_thread_get_cpu_time((void*)arg1); break;
+        case SYSCALL_SCHED_GET_CPU_COUNT: return handle_sys_sched_get_cpu_count(); break;
+        case SYSCALL_SCHED_GET_STATS: return handle_sys_sched_get_stats(arg1, (void*)arg2); break;
+        case SYSCALL_SCHED_SET_SLICE: return handle_sys_sched_set_slice(arg1, arg2); break;
+        case SYSCALL_SCHED_GROUP_CREATE: return handle_sys_sched_group_create(arg1); break;
+        case SYSCALL_SCHED_GROUP_SET_WEIGHT: handle_sys_sched_group_set_weight(arg1, arg2); break;
+        case SYSCALL_SCHED_GROUP_GET_STATS: handle_sys_sched_group_get_stats(arg1, (void*)arg2); break;
+        case SYSCALL_STACK_CACHE_SET_LIMIT: handle_sys_stack_cache_set_limit(arg1); break;
         case SYSCALL_ATOMIC_WAIT: return handle_sys_atomic_wait((void*)arg1, arg2, arg3); break;
         case SYSCALL_ATOMIC_NOTIFY: return handle_sys_atomic_notify((void*)arg1, arg2, arg3); break;
+        case SYSCALL_ATOMIC_NOTIFY_WAIT: return handle_sys_atomic_notify_wait((void*)arg1, arg2); break;
+        case SYSCALL_ATOMIC_REQUEUE: return handle_sys_atomic_requeue((void*)arg1); break;
+        case SYSCALL_WAIT_SET_CREATE: return handle_sys_wait_set_create(); break;
+        case SYSCALL_WAIT_SET_ADD: return handle_sys_wait_set_add(arg1, (void*)arg2, arg3); break;
+        case SYSCALL_WAIT_SET_REMOVE: return handle_sys_wait_set_remove(arg1, (void*)arg2, arg3); break;
+        case SYSCALL_WAIT_SET_WAIT: return handle_sys_wait_set_wait(arg1, (void*)arg2, arg3, arg4); break;
         case SYSCALL_HANDLE_CLOSE: handle_sys_handle_close(arg1); break;
         case SYSCALL_IRQ_CREATE_IOAPIC: return handle_sys_irq_create_ioapic((void*)arg1, arg2, arg3); break;
+        case SYSCALL_IRQ_CREATE_MSI: return handle_sys_irq_create_msi((void*)arg1, arg2, (void*)arg3); break;
         case SYSCALL_IRQ_UNMASK: handle_sys_irq_unmask(arg1); break;
+        case SYSCALL_IRQ_GET_STATS: handle_sys_irq_get_stats(arg1, (void*)arg2); break;
+        case SYSCALL_IRQ_SET_AFFINITY: return handle_sys_irq_set_affinity(arg1, arg2, (void*)arg3); break;
+        case SYSCALL_IRQ_SET_MODE: return handle_sys_irq_set_mode(arg1, arg2, (void*)arg3); break;
+        case SYSCALL_IRQ_WAIT: return handle_sys_irq_wait(arg1, arg2, arg3, (void*)arg4); break;
 
         case SYSCALL_EARLY_GET_INITRD_SIZE: {
             ASSERT(!m_early_done);
             return handle_sys_early_get_initrd_size();
         } break;
 
-        case SYSCALL_EARLY_GET_INITRD: {
+        case SYSCALL_EARLY_MAP_INITRD: {
             ASSERT(!m_early_done);
-            handle_sys_early_get_initrd((void*)arg1);
+            return (uintptr_t)handle_sys_early_map_initrd();
         } break;
 
-        case SYSCALL_EARLY_GET_TSC_FREQ: {
+        case SYSCALL_EARLY_MAP_CLOCK_PAGE: {
             ASSERT(!m_early_done);
-            return handle_sys_early_get_tsc_freq();
+            return (uintptr_t)handle_sys_early_map_clock_page();
+        } break;
+
+        case SYSCALL_EARLY_MAP_THREAD_RUN_PAGE: {
+            ASSERT(!m_early_done);
+            return (uintptr_t)handle_sys_early_map_thread_run_page();
         } break;
 
         case SYSCALL_EARLY_GET_RSDP: {
@@ -622,6 +1265,14 @@ OMIT_ENDBR uint64_t syscall_handler(syscall_t syscall, uint64_t arg1, uint64_t a
     return 0;
 }
 
+OMIT_ENDBR uint64_t syscall_handler(syscall_t syscall, uint64_t arg1, uint64_t arg2, uint64_t rip, uint64_t arg3, uint64_t arg4) {
+    // the time in the syscall is kernel time of the thread
+    sched_account_enter(CPU_TIME_KERNEL);
+    uint64_t result = syscall_dispatch(syscall, arg1, arg2, rip, arg3, arg4);
+    sched_account_enter(CPU_TIME_USER);
+    return result;
+}
+
 // this is called directly by the stub and no-one else
 
 void syscall_entry(void);
@@ -0,0 +1,76 @@
+#include "clock.h"
+
+#include "lib/syscall.h"
+#include "lib/tsc.h"
+#include "uapi/clock.h"
+
+/**
+ * The timekeeping page, the kernel updates it as the tsc calibration is refined
+ */
+static const clock_page_t* m_clock_page = nullptr;
+
+err_t clock_init(void) {
+    err_t err = WASI_ERRNO_SUCCESS;
+
+    m_clock_page = sys_early_map_clock_page();
+    CHECK(m_clock_page != nullptr);
+
+    // the frequency might get refined later, anything that
+    // needs to be accurate goes through the clock page
+    clock_params_t params;
+    clock_page_read(m_clock_page, &params);
+    g_tsc_freq_hz = params.tsc_freq_hz;
+
+cleanup:
+    return err;
+}
+
+uint64_t clock_monotonic_ns(void) {
+    clock_params_t params;
+    clock_page_read(m_clock_page, &params);
+    return clock_params_tsc_to_ns(&params, params.monotonic_base_ns, get_tsc());
+}
+
+uint64_t clock_realtime_ns(void) {
+    clock_params_t params;
+    clock_page_read(m_clock_page, &params);
+    return clock_params_tsc_to_ns(&params, params.realtime_base_ns, get_tsc());
+}
+
+/**
+ * Turn a duration into tsc ticks, saturating on overflow
+ */
+static uint64_t clock_ns_to_ticks(const clock_params_t* params, uint64_t ns) {
+    unsigned __int128 ticks = ((unsigned __int128)ns << CLOCK_MULT_SHIFT) / params->mult;
+    return ticks > UINT64_MAX ? UINT64_MAX : (uint64_t)ticks;
+}
+
+static uint64_t clock_to_tsc(const clock_params_t* params, uint64_t base_ns, uint64_t ns) {
+    if (ns < base_ns) {
+        uint64_t ticks = clock_ns_to_ticks(params, base_ns - ns);
+        return ticks > params->tsc_base ? 0 : params->tsc_base - ticks;
+    }
+
+    uint64_t ticks = clock_ns_to_ticks(params, ns - base_ns);
+    return ticks > UINT64_MAX - params->tsc_base ? UINT64_MAX : params->tsc_base + ticks;
+}
+
+uint64_t clock_monotonic_to_tsc(uint64_t ns) {
+    clock_params_t params;
+    clock_page_read(m_clock_page, &params);
+    return clock_to_tsc(&params, params.monotonic_base_ns, ns);
+}
+
+uint64_t clock_realtime_to_tsc(uint64_t ns) {
+    clock_params_t params;
+    clock_page_read(m_clock_page, &params);
+    return clock_to_tsc(&params, params.realtime_base_ns, ns);
+}
+
+uint64_t clock_ns_deadline(uint64_t ns) {
+    clock_params_t params;
+    clock_page_read(m_clock_page, &params);
+    uint64_t now = get_tsc();
+    uint64_t ticks = clock_ns_to_ticks(&params, ns);
+    return ticks > UINT64_MAX - now ? UINT64_MAX : now + ticks;
+}
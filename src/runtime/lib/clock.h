@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "lib/except.h"
+
+/**
+ * Map the timekeeping page of the kernel, must be called before the early syscalls are done
+ */
+err_t clock_init(void);
+
+/**
+ * The monotonic time and the wall clock time, in nanoseconds, read
+ * from the timekeeping page without going through the kernel
+ */
+uint64_t clock_monotonic_ns(void);
+uint64_t clock_realtime_ns(void);
+
+/**
+ * Turn a time of either clock into a tsc deadline
+ */
+uint64_t clock_monotonic_to_tsc(uint64_t ns);
+uint64_t clock_realtime_to_tsc(uint64_t ns);
+
+/**
+ * Get a tsc deadline the given amount of nanoseconds from now
+ */
+uint64_t clock_ns_deadline(uint64_t ns);
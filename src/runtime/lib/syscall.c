@@ -98,8 +98,8 @@ void sys_debug_print(const char* message, size_t message_len) {
 // VMAR management
 //----------------------------------------------------------------------------------------------------------------------
 
-void* sys_mem_reserve(size_t total_page_count, size_t mappable_page_count, const char* name) {
-    return (void*)syscall3(SYSCALL_MEM_RESERVE, total_page_count, mappable_page_count, name);
+void* sys_mem_reserve(size_t total_page_count, size_t mappable_page_count, const char* name, mem_control_t** control) {
+    return (void*)syscall4(SYSCALL_MEM_RESERVE, total_page_count, mappable_page_count, name, control);
 }
 
 void* sys_mem_bump(void* ptr, size_t page_count) {
@@ -118,6 +118,10 @@ void sys_mem_free(void* ptr) {
     (void)syscall1(SYSCALL_MEM_FREE, ptr);
 }
 
+void sys_mem_free_initrd(const void* ptr) {
+    (void)syscall1(SYSCALL_MEM_FREE_INITRD, ptr);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Heap management
 //----------------------------------------------------------------------------------------------------------------------
@@ -152,8 +156,8 @@ void sys_jit_free(void* ptr) {
 
 typedef void (*sys_thread_entry_t)(void* arg);
 
-bool sys_thread_create(void* arg, const char* name) {
-	return (bool)syscall2(SYSCALL_THREAD_CREATE, arg, name);
+bool sys_thread_create(void* arg, const char* name, const thread_create_params_t* params) {
+	return (bool)syscall3(SYSCALL_THREAD_CREATE, arg, name, params);
 }
 
 noreturn void sys_thread_exit(void) {
@@ -165,6 +169,50 @@ void sys_thread_yield(void) {
 	(void)syscall0(SYSCALL_THREAD_YIELD);
 }
 
+bool sys_thread_set_sched(const sched_param_t* param) {
+	return (bool)syscall1(SYSCALL_THREAD_SET_SCHED, param);
+}
+
+bool sys_thread_set_affinity(const cpu_mask_t* mask) {
+	return (bool)syscall1(SYSCALL_THREAD_SET_AFFINITY, mask);
+}
+
+void sys_thread_get_affinity(cpu_mask_t* mask) {
+	(void)syscall1(SYSCALL_THREAD_GET_AFFINITY, mask);
+}
+
+void sys_thread_get_cpu_time(cpu_time_stats_t* stats) {
+	(void)syscall1(SYSCALL_THREAD_GET_CPU_TIME, stats);
+}
+
+size_t sys_sched_get_cpu_count(void) {
+	return syscall0(SYSCALL_SCHED_GET_CPU_COUNT);
+}
+
+bool sys_sched_get_stats(size_t cpu, sched_stats_t* stats) {
+	return (bool)syscall2(SYSCALL_SCHED_GET_STATS, cpu, stats);
+}
+
+bool sys_sched_set_slice(sched_class_t sched_class, uint32_t slice_us) {
+	return (bool)syscall2(SYSCALL_SCHED_SET_SLICE, sched_class, slice_us);
+}
+
+uint64_t sys_sched_group_create(uint32_t weight) {
+	return syscall1(SYSCALL_SCHED_GROUP_CREATE, weight);
+}
+
+void sys_sched_group_set_weight(uint64_t group, uint32_t weight) {
+	(void)syscall2(SYSCALL_SCHED_GROUP_SET_WEIGHT, group, weight);
+}
+
+void sys_sched_group_get_stats(uint64_t group, sched_group_stats_t* stats) {
+	(void)syscall2(SYSCALL_SCHED_GROUP_GET_STATS, group, stats);
+}
+
+void sys_stack_cache_set_limit(size_t limit) {
+	(void)syscall1(SYSCALL_STACK_CACHE_SET_LIMIT, limit);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Futex primitives
 //----------------------------------------------------------------------------------------------------------------------
@@ -177,6 +225,34 @@ size_t sys_atomic_notify(void* key, uint64_t mask, size_t count) {
 	return syscall3(SYSCALL_ATOMIC_NOTIFY, key, mask, count);
 }
 
+wait_status_t sys_atomic_notify_wait(const notify_wait_params_t* params, uint64_t deadline) {
+	return syscall2(SYSCALL_ATOMIC_NOTIFY_WAIT, params, deadline);
+}
+
+wait_status_t sys_atomic_requeue(const requeue_params_t* params) {
+	return syscall1(SYSCALL_ATOMIC_REQUEUE, params);
+}
+
+//----------------------------------------------------------------------------------------------------------------------
+// Wait sets
+//----------------------------------------------------------------------------------------------------------------------
+
+uint64_t sys_wait_set_create(void) {
+	return syscall0(SYSCALL_WAIT_SET_CREATE);
+}
+
+bool sys_wait_set_add(uint64_t set, const wait_entry_t* entry, uint64_t user_data) {
+	return (bool)syscall3(SYSCALL_WAIT_SET_ADD, set, entry, user_data);
+}
+
+bool sys_wait_set_remove(uint64_t set, void* key, uint64_t user_data) {
+	return (bool)syscall3(SYSCALL_WAIT_SET_REMOVE, set, key, user_data);
+}
+
+size_t sys_wait_set_wait(uint64_t set, uint64_t* ready, size_t count, uint64_t deadline) {
+	return syscall4(SYSCALL_WAIT_SET_WAIT, set, ready, count, deadline);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Handles
 //----------------------------------------------------------------------------------------------------------------------
@@ -193,10 +269,30 @@ uint64_t sys_irq_create_ioapic(wake_params_t* wake_params, uint32_t irq, uint32_
 	return syscall3(SYSCALL_IRQ_CREATE_IOAPIC, wake_params, irq, cpu_id);
 }
 
+uint64_t sys_irq_create_msi(wake_params_t* wake_params, uint32_t cpu_id, msi_message_t* message) {
+	return syscall3(SYSCALL_IRQ_CREATE_MSI, wake_params, cpu_id, message);
+}
+
 void sys_irq_unmask(uint64_t handle) {
 	(void)syscall1(SYSCALL_IRQ_UNMASK, handle);
 }
 
+void sys_irq_get_stats(uint64_t handle, irq_stats_t* stats) {
+	(void)syscall2(SYSCALL_IRQ_GET_STATS, handle, stats);
+}
+
+irq_affinity_status_t sys_irq_set_affinity(uint64_t handle, uint32_t cpu_id, msi_message_t* message) {
+	return (irq_affinity_status_t)syscall3(SYSCALL_IRQ_SET_AFFINITY, handle, cpu_id, message);
+}
+
+bool sys_irq_set_mode(uint64_t handle, irq_mode_t mode, _Atomic(uint64_t)* counter) {
+	return (bool)syscall3(SYSCALL_IRQ_SET_MODE, handle, mode, counter);
+}
+
+wait_status_t sys_irq_wait(uint64_t handle, uint64_t seen, uint64_t deadline, uint64_t* count) {
+	return syscall4(SYSCALL_IRQ_WAIT, handle, seen, deadline, count);
+}
+
 //----------------------------------------------------------------------------------------------------------------------
 // Early syscalls for configuring stuff from the runtime
 //----------------------------------------------------------------------------------------------------------------------
@@ -205,12 +301,16 @@ size_t sys_early_get_initrd_size(void) {
 	return syscall0(SYSCALL_EARLY_GET_INITRD_SIZE);
 }
 
-void sys_early_get_initrd(void* addr) {
-	(void)syscall1(SYSCALL_EARLY_GET_INITRD, addr);
+const void* sys_early_map_initrd(void) {
+	return (const void*)syscall0(SYSCALL_EARLY_MAP_INITRD);
+}
+
+const clock_page_t* sys_early_map_clock_page(void) {
+	return (const clock_page_t*)syscall0(SYSCALL_EARLY_MAP_CLOCK_PAGE);
 }
 
-uint64_t sys_early_get_tsc_freq(void) {
-	return syscall0(SYSCALL_EARLY_GET_TSC_FREQ);
+const thread_run_page_t* sys_early_map_thread_run_page(void) {
+	return (const thread_run_page_t*)syscall0(SYSCALL_EARLY_MAP_THREAD_RUN_PAGE);
 }
 
 uint64_t sys_early_get_rsdp(void) {
@@ -1,5 +1,9 @@
 #pragma once
 
+#include "uapi/clock.h"
+#include "uapi/irq.h"
+#include "uapi/mapping.h"
+#include "uapi/sched.h"
 #include "uapi/wait.h"
 #include <stddef.h>
 #include <stdint.h>
@@ -15,11 +19,12 @@ void sys_debug_print(const char* message, size_t message_len);
 // VMAR management
 //----------------------------------------------------------------------------------------------------------------------
 
-void* sys_mem_reserve(size_t total_page_count, size_t mappable_page_count, const char* name);
+void* sys_mem_reserve(size_t total_page_count, size_t mappable_page_count, const char* name, mem_control_t** control);
 void* sys_mem_bump(void* ptr, size_t page_count);
 void* sys_mem_map_phys(void* ptr, uint64_t phys_base, size_t page_count);
 void sys_mem_unmap_phys(void* ptr, size_t page_count);
 void sys_mem_free(void* ptr);
+void sys_mem_free_initrd(const void* ptr);
 
 //----------------------------------------------------------------------------------------------------------------------
 // Heap management
@@ -42,9 +47,20 @@ void sys_jit_free(void* ptr);
 
 typedef void (*sys_thread_entry_t)(void* arg);
 
-bool sys_thread_create(void* arg, const char* name);
+bool sys_thread_create(void* arg, const char* name, const thread_create_params_t* params);
 noreturn void sys_thread_exit(void);
 void sys_thread_yield(void);
+bool sys_thread_set_sched(const sched_param_t* param);
+bool sys_thread_set_affinity(const cpu_mask_t* mask);
+void sys_thread_get_affinity(cpu_mask_t* mask);
+void sys_thread_get_cpu_time(cpu_time_stats_t* stats);
+size_t sys_sched_get_cpu_count(void);
+bool sys_sched_get_stats(size_t cpu, sched_stats_t* stats);
+bool sys_sched_set_slice(sched_class_t sched_class, uint32_t slice_us);
+uint64_t sys_sched_group_create(uint32_t weight);
+void sys_sched_group_set_weight(uint64_t group, uint32_t weight);
+void sys_sched_group_get_stats(uint64_t group, sched_group_stats_t* stats);
+void sys_stack_cache_set_limit(size_t limit);
 
 //----------------------------------------------------------------------------------------------------------------------
 // Futex primitives
@@ -52,6 +68,17 @@ void sys_thread_yield(void);
 
 bool sys_atomic_wait(wait_entry_t* entries, size_t count, uint64_t deadline);
 size_t sys_atomic_notify(void* key, uint64_t mask, size_t count);
+wait_status_t sys_atomic_notify_wait(const notify_wait_params_t* params, uint64_t deadline);
+wait_status_t sys_atomic_requeue(const requeue_params_t* params);
+
+//----------------------------------------------------------------------------------------------------------------------
+// Wait sets
+//----------------------------------------------------------------------------------------------------------------------
+
+uint64_t sys_wait_set_create(void);
+bool sys_wait_set_add(uint64_t set, const wait_entry_t* entry, uint64_t user_data);
+bool sys_wait_set_remove(uint64_t set, void* key, uint64_t user_data);
+size_t sys_wait_set_wait(uint64_t set, uint64_t* ready, size_t count, uint64_t deadline);
 
 //----------------------------------------------------------------------------------------------------------------------
 // Handle
@@ -64,14 +91,20 @@ void sys_handle_close(uint64_t handle);
 //----------------------------------------------------------------------------------------------------------------------
 
 uint64_t sys_irq_create_ioapic(wake_params_t* wake_params, uint32_t irq, uint32_t cpu_id);
+uint64_t sys_irq_create_msi(wake_params_t* wake_params, uint32_t cpu_id, msi_message_t* message);
 void sys_irq_unmask(uint64_t handle);
+void sys_irq_get_stats(uint64_t handle, irq_stats_t* stats);
+irq_affinity_status_t sys_irq_set_affinity(uint64_t handle, uint32_t cpu_id, msi_message_t* message);
+bool sys_irq_set_mode(uint64_t handle, irq_mode_t mode, _Atomic(uint64_t)* counter);
+wait_status_t sys_irq_wait(uint64_t handle, uint64_t seen, uint64_t deadline, uint64_t* count);
 
 //----------------------------------------------------------------------------------------------------------------------
 // Early syscalls for configuring stuff from the runtime
 //----------------------------------------------------------------------------------------------------------------------
 
 size_t sys_early_get_initrd_size(void);
-void sys_early_get_initrd(void* addr);
-uint64_t sys_early_get_tsc_freq(void);
+const void* sys_early_map_initrd(void);
+const clock_page_t* sys_early_map_clock_page(void);
+const thread_run_page_t* sys_early_map_thread_run_page(void);
 uint64_t sys_early_get_rsdp(void);
 void sys_early_done(void);
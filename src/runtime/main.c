@@ -1,5 +1,6 @@
 #include "alloc/alloc.h"
 #include "lib/assert.h"
+#include "lib/clock.h"
 #include "lib/defs.h"
 #include "lib/except.h"
 #include "lib/log.h"
@@ -10,6 +11,7 @@
 #include "proc/handle.h"
 #include "proc/proc.h"
 #include "proc/thread.h"
+#include "sync/spin.h"
 #include "wasi/file.h"
 #include "wasi/wasip1.h"
 #include "wasmato/wasmato.h"
@@ -27,11 +29,20 @@ static void spidir_log_callback(spidir_log_level_t level, const char* module, si
     }
 }
 
+static void initrd_free(void* initrd, size_t initrd_size) {
+    // the kernel will reclaim the pages once we unmap it, the
+    // process gives it back as soon as the module is instantiated
+    sys_mem_free_initrd(initrd);
+}
+
 static void main(void) {
     err_t err = WASI_ERRNO_SUCCESS;
 
-    // initialize the tsc freq so we can sync with it nicely
-    g_tsc_freq_hz = sys_early_get_tsc_freq();
+    // map the timekeeping page so we can sync with the tsc nicely
+    RETHROW(clock_init());
+
+    // map the run page so locks know when spinning is worth it
+    RETHROW(spin_init());
 
     // ensure we only enter the main function once
     static bool init_once = false;
@@ -40,11 +51,11 @@ static void main(void) {
 
     TRACE("From main thread!");
 
-    // get the initrd from the kernel before we are done
+    // map the initrd from the kernel before we are done, we
+    // get a read-only view of the module without any copy
     size_t initrd_size = sys_early_get_initrd_size();
-    void* initrd = mem_alloc(initrd_size);
+    const void* initrd = sys_early_map_initrd();
     CHECK(initrd != nullptr);
-    sys_early_get_initrd(initrd);
 
     // save the RSDP for wasm to access
     g_acpi_rsdp = sys_early_get_rsdp();
@@ -79,7 +90,8 @@ static void main(void) {
     };
     RETHROW(wasm_create_proc(
         WASM_PROC_TYPE_ACPID, 
-        initrd, initrd_size, 
+        (void*)initrd, initrd_size,
+        initrd_free,
         handles, ARRAY_LENGTH(handles)
     ));
 
@@ -76,10 +76,10 @@ void object_signal(object_t* object, uint32_t set_mask) {
     // set the bits that we signaled
     uint32_t old = atomic_fetch_or_explicit(&object->signals, set_mask, memory_order_release);
 
-    if ((old & set_mask) != set_mask) {
-        // the old value will only have less bits than we have right now, so if it does
-        // not have the exact same bits, it means we set some bits, so we should notify
-        // the waiters
+    // the old value will only have less bits than we have right now, so if it does
+    // not have the exact same bits, it means we set some bits, so we should notify
+    // the waiters, if there are any
+    if ((old & set_mask) != set_mask && (old & SIGNAL_HAS_WAITERS) != 0) {
         sys_atomic_notify(&object->signals, set_mask, 0);
     }
 }
@@ -93,13 +93,14 @@ uint32_t object_prepare_wait(object_t* object, uint32_t signals, wait_entry_t* e
     // first check if we already have a valid signal
     uint32_t pending = atomic_load_acquire(&object->signals);
     if ((pending & signals) != 0) {
-        return pending;
+        return pending & ~SIGNAL_HAS_WAITERS;
     }
 
     // not signaled, set the entry
     entry->key = &object->signals;
     entry->key_size = WAIT_KEY_UINT32;
     entry->mask = signals;
+    entry->waiters_bit = SIGNAL_HAS_WAITERS;
     entry->old = pending;
 
     return 0;
@@ -112,6 +113,7 @@ err_t object_wait_one(object_t* object, uint32_t signals, uint64_t deadline, uin
         .key = &object->signals,
         .key_size = WAIT_KEY_UINT32,
         .mask = signals,
+        .waiters_bit = SIGNAL_HAS_WAITERS,
     };
 
     for (;;) {
@@ -119,11 +121,13 @@ err_t object_wait_one(object_t* object, uint32_t signals, uint64_t deadline, uin
         uint32_t pending = atomic_load_acquire(&object->signals);
         if ((pending & signals) != 0) {
             // TODO: should we mask it or not?
-            *observed = pending;
+            *observed = pending & ~SIGNAL_HAS_WAITERS;
             break;
         }
 
-        // perform the wait 
+        // perform the wait, comparing against what we saw so
+        // unrelated signals don't make us spin
+        entry.old = pending;
         wait_status_t status = sys_atomic_wait(&entry, 1, deadline);
         CHECK_ERROR(status != WAIT_STATUS_OUT_OF_MEMORY, WASI_ERRNO_NOMEM);
     }
@@ -22,6 +22,11 @@ typedef enum object_type : uint8_t {
      * This is a channel endpoint
      */
     OBJECT_TYPE_CHANNEL,
+
+    /**
+     * This is a counting event
+     */
+    OBJECT_TYPE_EVENT,
 } object_type_t;
 
 /**
@@ -49,6 +54,12 @@ typedef enum signals : uint32_t {
      * The object is writable, the exact meaning depends on the object type
      */
     SIGNAL_WRITABLE = BIT3,
+
+    /**
+     * Kept set by the kernel while anyone waits on the signals,
+     * signaling without it set does not need to notify anyone
+     */
+    SIGNAL_HAS_WAITERS = BIT31,
 } signals_t;
 
 typedef struct object {
@@ -11,12 +11,14 @@
 #include "lib/defs.h"
 #include "lib/except.h"
 #include "lib/list.h"
+#include "lib/log.h"
 #include "lib/stb_sprintf.h"
 #include "lib/syscall.h"
 
 #include "proc/handle.h"
 #include "sync/mutex.h"
 #include "uapi/page.h"
+#include "uapi/syscall.h"
 #include "wasi/wasi.h"
 #include "wasi/wasip1.h"
 #include "wasm/debug_elf.h"
@@ -44,11 +46,37 @@ void wasm_put_proc(wasm_proc_t* proc) {
     if (ref_count == 1) {
         atomic_fence_acquire();
 
+        // report the share of the cpu the process got over its
+        // lifetime, and release the scheduling group
+        if (proc->sched_group != INVALID_HANDLE) {
+            sched_group_stats_t stats = {};
+            sys_sched_group_get_stats(proc->sched_group, &stats);
+            TRACE("proc: %s#%d used %lums of cpu time in %lums (%lu%% of a cpu, weight %u)",
+                proc->module_name,
+                proc->process_id,
+                stats.runtime_us / 1000, stats.elapsed_us / 1000,
+                stats.runtime_us * 100 / MAX(stats.elapsed_us, 1),
+                stats.weight);
+            TRACE("proc: %s#%d spent %lums in usermode, %lums in the kernel, %lums in irqs, "
+                  "%lums waiting for a cpu and %lums blocked",
+                proc->module_name,
+                proc->process_id,
+                stats.cpu_time.user_ns / 1000000, stats.cpu_time.kernel_ns / 1000000,
+                stats.cpu_time.irq_ns / 1000000, stats.cpu_time.wait_ns / 1000000,
+                stats.cpu_time.blocked_ns / 1000000);
+            sys_handle_close(proc->sched_group);
+        }
+
         // free the wasm jit and module
         // TODO: sharing?
         wasm_module_jit_free(&proc->jit);
         wasm_module_free(&proc->module);
 
+        // release the data if we failed before the module was instantiated
+        if (proc->module_free != nullptr) {
+            proc->module_free(proc->module_data, proc->module_size);
+        }
+
         // free the memory itself
         if (proc->memory_base != nullptr) {
             sys_mem_free(proc->memory_base);
@@ -113,6 +141,7 @@ static void* wasm_resolve_import(void* arg, const char* module, const char* name
 err_t wasm_create_proc(
     wasm_proc_type_t type, 
     void* module, size_t module_size,
+    wasm_module_free_t module_free,
     proc_handle_t* handles,
     size_t handles_count
 ) {
@@ -124,6 +153,12 @@ err_t wasm_create_proc(
     memset(proc, 0, sizeof(*proc));
 
     proc->type = type;
+    proc->sched_group = INVALID_HANDLE;
+
+    // from this point the module data is owned by the proc
+    proc->module_data = module;
+    proc->module_size = module_size;
+    proc->module_free = module_free;
 
     // set the pid
     proc->process_id = atomic_fetch_add_explicit(&m_process_id_gen, 1, memory_order_relaxed) + 1;
@@ -131,28 +166,43 @@ err_t wasm_create_proc(
     // start with ref count of 1
     proc->ref_count = 1;
 
+    // all the threads of the process share a single weight
+    proc->sched_group = sys_sched_group_create(SCHED_WEIGHT_DEFAULT);
+    CHECK_ERROR(proc->sched_group != INVALID_HANDLE, WASI_ERRNO_NOMEM);
+
     // load the module
     RETHROW_WASM(wasm_load_module(&proc->module, module, module_size));
 
-    // the name for the region
-    char name[128] = "";
+    // keep the name around for once the module data is gone
     const char* module_name = "wasm";
     if (proc->module.module_name != nullptr) {
         module_name = proc->module.module_name;
     }
-    stbsp_snprintf(name, sizeof(name), "%s#%d", module_name, proc->process_id);
+    stbsp_snprintf(proc->module_name, sizeof(proc->module_name), "%s", module_name);
+
+    // the name for the region
+    char name[128] = "";
+    stbsp_snprintf(name, sizeof(name), "%s#%d", proc->module_name, proc->process_id);
 
     // allocate the memory, we need to reserve 8gb to ensure that nothing 
     // can accidently overflow or exit the range, from the 8gb only the first
     // 4GB are mappable, because that is all wasm can actually access without 
-    // using the static offset in the mapping
-    proc->memory_base = sys_mem_reserve(SIZE_TO_PAGES(SIZE_8GB), SIZE_TO_PAGES(SIZE_4GB), name);
+    // using the static offset in the mapping, the initial size is set in
+    // the control word, the kernel maps it in lazily as it gets accessed
+    mem_control_t* control_word = nullptr;
+    proc->memory_base = sys_mem_reserve(
+        SIZE_TO_PAGES(SIZE_8GB), SIZE_TO_PAGES(SIZE_4GB), name,
+        &control_word
+    );
     CHECK_ERROR(proc->memory_base != nullptr, WASI_ERRNO_NOMEM);
 
-    // perform the initial bump
-    proc->memory_size = proc->module.memory.min;
-    void* base = sys_mem_bump(proc->memory_base, SIZE_TO_PAGES(proc->module.memory.min));
-    CHECK_ERROR(base != nullptr, WASI_ERRNO_NOMEM);
+    // nothing is accessible until we set the control word
+    mem_control_t control = {
+        .accessible = ALIGN_UP(proc->module.memory.min, WASM_PAGE_SIZE) / WASM_PAGE_SIZE,
+        .max = SIZE_4GB / WASM_PAGE_SIZE,
+    };
+    proc->memory_control = (_Atomic(uint64_t)*)&control_word->packed;
+    atomic_store_release(proc->memory_control, control.packed);
 
     // and initialize the memory
     wasm_module_init_memory(&proc->module, proc->memory_base);
@@ -237,6 +287,16 @@ err_t wasm_create_proc(
         proc->start = proc->jit.exports[index].func.address;
     }
 
+    // the memory was initialized from the data segments and the code is
+    // jitted, nothing needs the module data anymore so release it now
+    // instead of holding on to it for the lifetime of the process
+    if (proc->module_free != nullptr) {
+        proc->module_free(proc->module_data, proc->module_size);
+        proc->module_free = nullptr;
+    }
+    proc->module_data = nullptr;
+    proc->module_size = 0;
+
     // install all the default handles
     for (int i = 0; i < handles_count; i++) {
         proc_handle_t handle = handles[i];
@@ -254,6 +314,8 @@ err_t wasm_create_proc(
 cleanup:
     if (proc != nullptr) {
         wasm_put_proc(proc);
+    } else if (module_free != nullptr) {
+        module_free(module, module_size);
     }
 
     return err;
@@ -261,31 +323,32 @@ cleanup:
 
 int32_t wasm_host_memory_size(void* memory_base, void* state_base) {
     wasm_proc_t* proc = wasm_current_proc(state_base);
-    return atomic_load_acquire(&proc->memory_size);
+    mem_control_t control = { .packed = atomic_load_acquire(proc->memory_control) };
+    return control.accessible;
 }
 
 int32_t wasm_host_memory_grow(void* memory_base, void* state_base, int32_t new_page_count) {
     wasm_proc_t* proc = wasm_current_proc(state_base);
-
-    mutex_lock(&proc->memory_lock);
-    
-    // the old and new sizes
-    size_t current_size = atomic_load_relaxed(&proc->memory_size);
-    size_t size_to_add = new_page_count * WASM_PAGE_SIZE;
-
-    // bump the region
-    void* result = sys_mem_bump(memory_base, SIZE_TO_PAGES(size_to_add));
-    if (result == nullptr) {
-        // either out of memory or we went over the page limit
-        mutex_unlock(&proc->memory_lock);
+    if (new_page_count < 0) {
         return -1;
     }
 
-    // add the new size
-    atomic_fetch_add_explicit(&proc->memory_size, size_to_add, memory_order_release);
-
-    mutex_unlock(&proc->memory_lock);
+    // the kernel will map the new pages on access, so all we
+    // need is to raise the accessible size in the control word
+    mem_control_t current = { .packed = atomic_load_relaxed(proc->memory_control) };
+    mem_control_t new;
+    do {
+        // ensure we don't go over the max
+        new = current;
+        if (new_page_count > current.max - current.accessible) {
+            return -1;
+        }
+        new.accessible += new_page_count;
+    } while (!atomic_compare_exchange_weak_explicit(
+        proc->memory_control, &current.packed, new.packed,
+        memory_order_release, memory_order_relaxed
+    ));
 
-    // return the page count
-    return current_size / WASM_PAGE_SIZE;
+    // return the old page count
+    return current.accessible;
 }
@@ -23,6 +23,39 @@ typedef enum wasm_proc_type : uint8_t {
     WASM_PROC_TYPE_ACPID,
 } wasm_proc_type_t;
 
+/**
+ * Where the new threads of a process are placed
+ */
+typedef enum wasm_thread_placement : uint8_t {
+    /**
+     * Let the scheduler place the threads
+     */
+    WASM_THREAD_PLACEMENT_NONE,
+
+    /**
+     * Give each thread a different home cpu it wakes up on when it is
+     * idle, for threads that mostly work on their own
+     */
+    WASM_THREAD_PLACEMENT_SPREAD,
+
+    /**
+     * Keep all the threads waking up on the same cpu,
+     * for threads that share a lot of data
+     */
+    WASM_THREAD_PLACEMENT_COMPACT,
+
+    /**
+     * Keep the threads on the cpu the interrupts of the
+     * process are routed to, for driver threads
+     */
+    WASM_THREAD_PLACEMENT_FOLLOW_IRQ,
+} wasm_thread_placement_t;
+
+/**
+ * Called to release the module data once the process no longer needs it
+ */
+typedef void (*wasm_module_free_t)(void* module, size_t module_size);
+
 typedef struct wasm_proc {
     /**
      * Process flags
@@ -44,6 +77,20 @@ typedef struct wasm_proc {
      */
     wasm_module_jit_t jit;
 
+    /**
+     * The raw module data, owned by the process until the
+     * module is instantiated if a free callback was given
+     */
+    void* module_data;
+    size_t module_size;
+    wasm_module_free_t module_free;
+
+    /**
+     * The name of the module, copied out of the module
+     * data so it stays around once the data is released
+     */
+    char module_name[64];
+
     /**
      * The thread's entry point
      */
@@ -60,15 +107,26 @@ typedef struct wasm_proc {
     void* memory_base;
 
     /**
-     * The current memory size
+     * The memory control word (mem_control_t), the kernel
+     * lets wasm access memory up to the accessible size in
+     * it, so growing is just a compare-and-swap, it lives
+     * in a page the kernel gave the memory region
+     */
+    _Atomic(uint64_t)* memory_control;
+
+    /**
+     * The kernel scheduling group all the threads of the
+     * process run in, so the process gets a single share
+     * of the cpu no matter how many threads it has
      */
-    atomic_size_t memory_size;
+    uint64_t sched_group;
 
     /**
-     * The lock to synchronize 
-     * different memory bumping
+     * How new threads of the process are placed, and the
+     * cpu the interrupts of the process are routed to
      */
-    mutex_t memory_lock;
+    wasm_thread_placement_t placement;
+    uint32_t irq_cpu;
 
     /**
      * For generating thread ids
@@ -97,9 +155,15 @@ typedef struct proc_handle {
     int fd;
 } proc_handle_t;
 
+/**
+ * Create a new process from the given module, if module_free is given the
+ * process takes ownership of the module data and will release it with the
+ * callback as soon as the module is instantiated
+ */
 err_t wasm_create_proc(
     wasm_proc_type_t type, 
     void* module, size_t module_size,
+    wasm_module_free_t module_free,
     proc_handle_t* handles,
     size_t handles_count
 );
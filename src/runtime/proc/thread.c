@@ -14,6 +14,16 @@ noreturn void wasm_thread_exit(void* state_base) {
     // we will need the proc
     wasm_proc_t* proc = state->proc;
 
+    // release the poll set, closing it removes all the
+    // objects from it so only the refs are left
+    for (size_t i = 0; i < state->poll_count; i++) {
+        object_put(state->poll_entries[i].object);
+    }
+    mem_free(state->poll_entries);
+    if (state->poll_set != INVALID_HANDLE) {
+        sys_handle_close(state->poll_set);
+    }
+
     // free the state, since we no longer need it 
     mem_free(state);
     state = nullptr;
@@ -72,6 +82,7 @@ err_t wasm_create_thread(wasm_proc_t* proc, uint32_t arg, int32_t* out_tid) {
     state = mem_alloc(state_size);
     CHECK_ERROR(state != nullptr, WASI_ERRNO_NOMEM);
     memset(state, 0, state_size);
+    state->poll_set = INVALID_HANDLE;
 
     // save the proc, we take a ref to it
     state->proc = wasm_get_proc(proc);
@@ -101,14 +112,43 @@ err_t wasm_create_thread(wasm_proc_t* proc, uint32_t arg, int32_t* out_tid) {
 
     // setup a name
     char name[128] = "";
-    const char* module_name = "wasm";
-    if (proc->module.module_name != nullptr) {
-        module_name = proc->module.module_name;
+    stbsp_snprintf(name, sizeof(name), "%s#%d#%d", proc->module_name, proc->process_id, tid);
+
+    // the thread runs in the group of the process, and inherits
+    // the rest of the scheduling parameters of the creating thread
+    thread_create_params_t params = {
+        .flags = THREAD_CREATE_GROUP,
+        .group = proc->sched_group,
+    };
+
+    // place it according to the policy of the process
+    uint32_t cpu_count = sys_sched_get_cpu_count();
+    switch (proc->placement) {
+        case WASM_THREAD_PLACEMENT_NONE:
+            break;
+
+        case WASM_THREAD_PLACEMENT_SPREAD:
+            params.flags |= THREAD_CREATE_CPU_HINT;
+            params.cpu_hint = ((uint32_t)proc->process_id + (uint32_t)tid) % cpu_count;
+            params.placement = SCHED_PLACEMENT_SPREAD;
+            break;
+
+        case WASM_THREAD_PLACEMENT_COMPACT:
+            params.flags |= THREAD_CREATE_CPU_HINT;
+            params.cpu_hint = (uint32_t)proc->process_id % cpu_count;
+            params.placement = SCHED_PLACEMENT_HOME;
+            break;
+
+        case WASM_THREAD_PLACEMENT_FOLLOW_IRQ:
+            params.flags |= THREAD_CREATE_AFFINITY | THREAD_CREATE_CPU_HINT;
+            params.cpu_hint = proc->irq_cpu;
+            params.placement = SCHED_PLACEMENT_HOME;
+            cpu_mask_set(&params.affinity, proc->irq_cpu);
+            break;
     }
-    stbsp_snprintf(name, sizeof(name), "%s#%d#%d", module_name, proc->process_id, tid);
 
     // and actually create/start the thread
-    CHECK_ERROR(sys_thread_create(args, name), WASI_ERRNO_NOMEM);
+    CHECK_ERROR(sys_thread_create(args, name, &params), WASI_ERRNO_NOMEM);
     args = nullptr;
 
     // output the tid
@@ -1,15 +1,46 @@
 #pragma once
 
 #include "proc.h"
+#include "proc/object.h"
 #include <stdint.h>
 #include <stdnoreturn.h>
 
+/**
+ * An object registered in the poll wait set of a thread
+ */
+typedef struct wasm_poll_entry {
+	/**
+     * The object, the entry holds a reference to it
+     */
+	object_t* object;
+
+	/**
+     * The signals waited on
+     */
+	uint32_t signals;
+
+	/**
+     * The subscription of the current poll that uses this entry
+     */
+	uint32_t sub_index;
+} wasm_poll_entry_t;
+
 typedef struct wasm_state {
 	/**
      * The actual process
      */
 	wasm_proc_t* proc;
 
+	/**
+     * The kernel wait set used by poll_oneoff and the objects registered in
+     * it, kept in the order of the subscriptions of the last poll, so polling
+     * the same objects over and over only registers them once
+     */
+	uint64_t poll_set;
+	wasm_poll_entry_t* poll_entries;
+	size_t poll_count;
+	size_t poll_capacity;
+
 	/**
      * The actual state
      */
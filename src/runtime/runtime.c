@@ -1,4 +1,7 @@
 #include "runtime.h"
+#include "arch/intrin.h"
+#include "lib/atomic.h"
+#include "lib/clock.h"
 #include "lib/log.h"
 #include "lib/syscall.h"
 
@@ -11,6 +14,7 @@
 #include "alloc/alloc.h"
 #include "lib/stb_sprintf.h"
 #include "lib/tsc.h"
+#include "sync/spin.h"
 #include "uapi/wait.h"
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -97,20 +101,106 @@ void wasm_host_free(void* ptr) {
 //
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * The wasm memory belongs to the module so we can't keep a waiters bit in it,
+ * instead the addresses hash into buckets that count their waiters, notify
+ * checks the bucket and skips the syscall when it's empty.
+ *
+ * The bucket also remembers the run slot of the last thread to notify on it,
+ * plus one, that thread is likely the one to change the value next, so while
+ * it is on a cpu waiters spin for a bit instead of parking right away.
+ */
+#define WASM_WAIT_BUCKETS       256
+#define WASM_WAIT_SPIN_LIMIT    1000
+
+typedef struct wasm_wait_bucket {
+    _Atomic(uint32_t) waiters;
+    _Atomic(uint32_t) notifier;
+} wasm_wait_bucket_t;
+
+static wasm_wait_bucket_t m_wasm_wait_buckets[WASM_WAIT_BUCKETS];
+
+static wasm_wait_bucket_t* wasm_wait_bucket(void* ptr) {
+    uint64_t hash = ((uintptr_t)ptr >> 2) * 0x9E3779B97F4A7C15ull;
+    return &m_wasm_wait_buckets[hash >> 56];
+}
+
 uint32_t wasm_host_atomic_notify(void* ptr, uint32_t count) {
     // for the kernel 0 means wake all, for wasm it means not waking 
     // up any threads, so just pass if that happens
     if (count == 0) {
         return 0;
     }
+
+    // only write the line when someone else notified last
+    wasm_wait_bucket_t* bucket = wasm_wait_bucket(ptr);
+    uint32_t notifier = spin_self() + 1;
+    if (atomic_load_relaxed(&bucket->notifier) != notifier) {
+        atomic_store_relaxed(&bucket->notifier, notifier);
+    }
+
+    // pairs with the waiter incrementing the bucket before the kernel
+    // checks the value, so either we see it or it sees the new value
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_relaxed(&bucket->waiters) == 0) {
+        return 0;
+    }
+
     return sys_atomic_notify(ptr, UINT64_MAX, count);
 }
 
+/**
+ * Spin on the value while the last notifier is on a cpu, returns
+ * true if the value changed, false if we should park
+ */
+static bool wasm_atomic_spin(wasm_wait_bucket_t* bucket, const wait_entry_t* entry) {
+    uint32_t self = spin_self() + 1;
+
+    for (size_t i = 0; i < WASM_WAIT_SPIN_LIMIT; i++) {
+        // we are not going to change it ourselves, and unknown or
+        // preempted notifiers are not going to change it soon
+        uint32_t notifier = atomic_load_relaxed(&bucket->notifier);
+        if (notifier == self || spin_owner_get(notifier - 1) != SPIN_OWNER_RUNNING) {
+            return false;
+        }
+
+        cpu_relax();
+
+        uint64_t value;
+        if (entry->key_size == WAIT_KEY_UINT32) {
+            value = atomic_load_acquire((_Atomic(uint32_t)*)entry->key);
+        } else {
+            value = atomic_load_acquire((_Atomic(uint64_t)*)entry->key);
+        }
+
+        if (value != entry->old) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static wait_status_t wasm_atomic_wait(wait_entry_t* entry, uint64_t deadline) {
+    wasm_wait_bucket_t* bucket = wasm_wait_bucket(entry->key);
+
+    // the value changing while we spin looks just like
+    // it changing right before we got to wait
+    if (wasm_atomic_spin(bucket, entry)) {
+        return WAIT_STATUS_NOT_EQUAL;
+    }
+
+    atomic_fetch_add_explicit(&bucket->waiters, 1, memory_order_seq_cst);
+    wait_status_t status = sys_atomic_wait(entry, 1, deadline);
+    atomic_fetch_sub_explicit(&bucket->waiters, 1, memory_order_relaxed);
+    return status;
+}
+
 static uint64_t wasm_atomic_deadline(int64_t timeout) {
     if (timeout <= 0) {
         return (uint64_t)-1;
     }
-    return tsc_ns_deadline((uint64_t)timeout);
+    return clock_ns_deadline((uint64_t)timeout);
 }
 
 static uint32_t wasm_atomic_woken_result(uint64_t deadline) {
@@ -129,7 +219,7 @@ uint32_t wasm_host_atomic_wait_4(_Atomic(uint32_t)* value, uint32_t expected, in
         .old = expected,
         .mask = UINT64_MAX
     };
-    if (sys_atomic_wait(&entry, 1, deadline) == WAIT_STATUS_NOT_EQUAL) {
+    if (wasm_atomic_wait(&entry, deadline) == WAIT_STATUS_NOT_EQUAL) {
         return 1; // "not-equal"
     }
 
@@ -145,7 +235,7 @@ uint32_t wasm_host_atomic_wait_8(_Atomic(uint64_t)* value, uint64_t expected, in
         .old = expected,
         .mask = UINT64_MAX
     };
-    if (sys_atomic_wait(&entry, 1, deadline) == WAIT_STATUS_NOT_EQUAL) {
+    if (wasm_atomic_wait(&entry, deadline) == WAIT_STATUS_NOT_EQUAL) {
         return 1; // "not-equal"
     }
     
@@ -150,15 +150,17 @@ err_t channel_send(channel_t* ep, handle_t* handles, size_t handle_count, const
     memcpy(data_ptr, data, data_size);
 
     // queue it from the end (this is a FIFO)
-    message->next = peer->queue_tail;
-    peer->queue_tail = message;
-    if (peer->queue_head == nullptr) {
-        peer->queue_head = message;   
+    message->next = nullptr;
+    if (peer->queue_tail != nullptr) {
+        peer->queue_tail->next = message;
+    } else {
+        peer->queue_head = message;
     }
+    peer->queue_tail = message;
 
     // signal the peer that it got a new message
     // TODO: should we do this outside the lock?
-    object_signal(&peer->object, SIGNAL_WRITABLE);
+    object_signal(&peer->object, SIGNAL_READABLE);
     
 cleanup:
     if (peer != nullptr) {
@@ -0,0 +1,67 @@
+#include "condvar.h"
+
+#include "lib/atomic.h"
+#include "lib/syscall.h"
+#include "uapi/wait.h"
+#include <stdint.h>
+
+wait_status_t condvar_wait(condvar_t* cond, mutex_t* mutex, uint64_t deadline) {
+    // we hold the mutex, so a signal can't sneak in before we wait
+    uint32_t seq = atomic_load_relaxed(&cond->seq);
+    atomic_store_relaxed(&cond->mutex, mutex);
+
+    wait_entry_t entry = {
+        .key = &cond->seq,
+        .key_size = WAIT_KEY_UINT32,
+        .old = seq,
+        .mask = UINT64_MAX,
+        .waiters_bit = CONDVAR_WAITERS,
+    };
+    wait_status_t status = mutex_unlock_and_wait(mutex, &entry, deadline);
+
+    // a broadcast that moved other waiters to the mutex had the
+    // kernel mark it, so our unlock is going to wake them
+    mutex_lock(mutex);
+
+    return status;
+}
+
+void condvar_signal(condvar_t* cond) {
+    uint32_t old = atomic_fetch_add_explicit(&cond->seq, CONDVAR_SEQ_STEP, memory_order_release);
+    if ((old & CONDVAR_WAITERS) != 0) {
+        sys_atomic_notify(&cond->seq, UINT64_MAX, 1);
+    }
+}
+
+void condvar_broadcast(condvar_t* cond) {
+    // no one ever waited
+    mutex_t* mutex = atomic_load_relaxed(&cond->mutex);
+    if (mutex == nullptr) {
+        return;
+    }
+
+    uint32_t seq = atomic_fetch_add_explicit(&cond->seq, CONDVAR_SEQ_STEP, memory_order_release) + CONDVAR_SEQ_STEP;
+    if ((seq & CONDVAR_WAITERS) == 0) {
+        return;
+    }
+
+    // wake one waiter, and move the rest to the mutex, waking
+    // all of them would just have them fight over the mutex
+    requeue_params_t params = {
+        .compare = {
+            .key = &cond->seq,
+            .key_size = WAIT_KEY_UINT32,
+            .old = seq,
+            .mask = UINT64_MAX,
+        },
+        .wake_count = 1,
+        .requeue_key = &mutex->state,
+        .requeue_count = UINT64_MAX,
+        .requeue_waiters_bit = MUTEX_STATE_WAITERS,
+    };
+
+    // another signal got in between, fallback to waking everyone
+    if (sys_atomic_requeue(&params) == WAIT_STATUS_NOT_EQUAL) {
+        sys_atomic_notify(&cond->seq, UINT64_MAX, 0);
+    }
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "lib/defs.h"
+#include "mutex.h"
+#include "uapi/wait.h"
+
+/**
+ * The low bit of the sequence is kept set by the kernel while there
+ * are waiters, the sequence itself is bumped in steps of two
+ */
+#define CONDVAR_WAITERS     BIT0
+#define CONDVAR_SEQ_STEP    2
+
+typedef struct condvar {
+    /**
+     * Bumped on every signal, the waiters wait for it to change
+     */
+    _Atomic uint32_t seq;
+
+    /**
+     * The mutex the waiters use, a broadcast moves
+     * the waiters to wait on it
+     */
+    _Atomic(mutex_t*) mutex;
+} condvar_t;
+
+/**
+ * Unlock the mutex and wait for a signal, the mutex is locked again
+ * before returning, waking up spuriously is allowed
+ */
+wait_status_t condvar_wait(condvar_t* cond, mutex_t* mutex, uint64_t deadline);
+
+/**
+ * Wake a single waiter
+ */
+void condvar_signal(condvar_t* cond);
+
+/**
+ * Wake all the waiters, only one of them is woken right away and the rest
+ * are moved to the mutex, and get woken one at a time as it is unlocked
+ */
+void condvar_broadcast(condvar_t* cond);
@@ -6,38 +6,92 @@
 #include "uapi/wait.h"
 #include <stdint.h>
 
+/**
+ * How long to spin when we can't tell if the owner is on a cpu, and
+ * the upper bound on spinning while it is, in case the critical
+ * section turns out to be a long one
+ */
 #define SPIN_LIMIT 40
+#define SPIN_LIMIT_OWNER_RUNNING 4000
+
+/**
+ * Should we keep spinning on the mutex, the owner is only going to unlock
+ * it soon if it is still on a cpu, once it gets preempted we park right away
+ */
+static bool mutex_should_spin(mutex_t* mutex, size_t i) {
+    switch (spin_owner_get(atomic_load_relaxed(&mutex->owner))) {
+        case SPIN_OWNER_RUNNING: return i < SPIN_LIMIT_OWNER_RUNNING;
+        case SPIN_OWNER_PREEMPTED: return false;
+        case SPIN_OWNER_UNKNOWN: return i < SPIN_LIMIT;
+    }
+    return false;
+}
+
+static void mutex_set_owner(mutex_t* mutex) {
+    atomic_store_relaxed(&mutex->owner, spin_self());
+}
 
 void mutex_lock_slow(mutex_t* mutex, uint32_t cur_state) {
+    // no point in spinning once others are already asleep on it
     for (size_t i = 0;
-         i < SPIN_LIMIT && cur_state != MUTEX_STATE_LOCKED_CONTENDED; i++) {
+         mutex_should_spin(mutex, i) && (cur_state & MUTEX_STATE_WAITERS) == 0; i++) {
         cpu_relax();
 
         // Don't issue more RfO requests until we think we might have a chance.
         cur_state = atomic_load_relaxed(&mutex->state);
-        if (cur_state != MUTEX_STATE_UNLOCKED) {
+        if ((cur_state & MUTEX_STATE_LOCKED) != 0) {
             continue;
         }
 
         if (atomic_compare_exchange_weak_acquire_relaxed(
-                &mutex->state, &cur_state, MUTEX_STATE_LOCKED)) {
+                &mutex->state, &cur_state, cur_state | MUTEX_STATE_LOCKED)) {
+            mutex_set_owner(mutex);
             return;
         }
     }
 
-    while (
-        atomic_exchange_acquire(&mutex->state, MUTEX_STATE_LOCKED_CONTENDED) !=
-        MUTEX_STATE_UNLOCKED) {
+    for (;;) {
+        // keep the waiters bit as is, the kernel owns it
+        cur_state = atomic_load_relaxed(&mutex->state);
+        if ((cur_state & MUTEX_STATE_LOCKED) == 0) {
+            if (atomic_compare_exchange_weak_acquire_relaxed(
+                    &mutex->state, &cur_state, cur_state | MUTEX_STATE_LOCKED)) {
+                mutex_set_owner(mutex);
+                return;
+            }
+            continue;
+        }
+
+        // the kernel sets the waiters bit as part of the compare,
+        // so the unlock either sees it or we see the mutex unlocked
         wait_entry_t entry = {
             .key = &mutex->state,
             .key_size = WAIT_KEY_UINT32,
-            .old = MUTEX_STATE_LOCKED_CONTENDED,
+            .old = cur_state,
             .mask = UINT64_MAX,
+            .waiters_bit = MUTEX_STATE_WAITERS,
         };
-        sys_atomic_wait(&entry, 1, 0);
+        sys_atomic_wait(&entry, 1, -1);
     }
 }
 
 void mutex_unlock_slow(mutex_t* mutex) {
     sys_atomic_notify(&mutex->state, UINT64_MAX, 1);
 }
+
+wait_status_t mutex_unlock_and_wait(mutex_t* mutex, const wait_entry_t* entry, uint64_t deadline) {
+    wait_entry_t wait = *entry;
+    uint32_t old = atomic_fetch_and_explicit(&mutex->state, ~MUTEX_STATE_LOCKED, memory_order_release);
+    if ((old & MUTEX_STATE_WAITERS) == 0) {
+        // no one to wake, just wait
+        return sys_atomic_wait(&wait, 1, deadline);
+    }
+
+    notify_wait_params_t params = {
+        .notify_key = &mutex->state,
+        .notify_mask = UINT64_MAX,
+        .notify_count = 1,
+        .wait = wait,
+    };
+    return sys_atomic_notify_wait(&params, deadline);
+}
@@ -3,31 +3,53 @@
 #include <stdint.h>
 
 #include "lib/atomic.h"
+#include "lib/defs.h"
+#include "sync/spin.h"
+#include "uapi/wait.h"
 
 enum {
     MUTEX_STATE_UNLOCKED = 0,
-    MUTEX_STATE_LOCKED = 1,
-    MUTEX_STATE_LOCKED_CONTENDED = 2,
+    MUTEX_STATE_LOCKED = BIT0,
+
+    /**
+     * Kept set by the kernel while threads wait on the mutex, so
+     * the unlock only goes to the kernel when there is someone to wake
+     */
+    MUTEX_STATE_WAITERS = BIT1,
 };
 
 typedef struct mutex {
     _Atomic uint32_t state;
+
+    /**
+     * The run slot of the last thread to take the mutex, only a hint
+     * for the waiters to tell if the owner is still on a cpu
+     */
+    _Atomic uint32_t owner;
 } mutex_t;
 
 void mutex_lock_slow(mutex_t* mutex, uint32_t cur_state);
 void mutex_unlock_slow(mutex_t* mutex);
 
+/**
+ * Unlock the mutex and wait on the given entry, if a thread is waiting for
+ * the mutex it takes over the cpu right away, in a single syscall
+ */
+wait_status_t mutex_unlock_and_wait(mutex_t* mutex, const wait_entry_t* entry, uint64_t deadline);
+
 static inline void mutex_lock(mutex_t* mutex) {
     uint32_t expected = MUTEX_STATE_UNLOCKED;
     if (!atomic_compare_exchange_weak_acquire_relaxed(&mutex->state, &expected,
                                                       MUTEX_STATE_LOCKED)) {
         mutex_lock_slow(mutex, expected);
+        return;
     }
+    atomic_store_relaxed(&mutex->owner, spin_self());
 }
 
 static inline void mutex_unlock(mutex_t* mutex) {
-    if (atomic_exchange_release(&mutex->state, MUTEX_STATE_UNLOCKED) ==
-        MUTEX_STATE_LOCKED_CONTENDED) {
+    uint32_t old = atomic_fetch_and_explicit(&mutex->state, ~MUTEX_STATE_LOCKED, memory_order_release);
+    if ((old & MUTEX_STATE_WAITERS) != 0) {
         mutex_unlock_slow(mutex);
     }
 }
@@ -0,0 +1,32 @@
+#include "spin.h"
+
+#include "lib/atomic.h"
+#include "lib/syscall.h"
+#include "uapi/sched.h"
+
+/**
+ * The run page, the kernel updates it on every thread switch
+ */
+static const thread_run_page_t* m_run_page = nullptr;
+
+err_t spin_init(void) {
+    err_t err = WASI_ERRNO_SUCCESS;
+
+    m_run_page = sys_early_map_thread_run_page();
+    CHECK(m_run_page != nullptr);
+
+cleanup:
+    return err;
+}
+
+spin_owner_t spin_owner_get(uint32_t slot) {
+    if (m_run_page == nullptr || slot >= THREAD_RUN_SLOTS) {
+        return SPIN_OWNER_UNKNOWN;
+    }
+
+    if (atomic_load_relaxed(&m_run_page->on_cpu[slot]) == 0) {
+        return SPIN_OWNER_PREEMPTED;
+    }
+
+    return SPIN_OWNER_RUNNING;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+#include <x86intrin.h>
+
+#include "lib/except.h"
+#include "uapi/sched.h"
+
+/**
+ * What we know about the thread we would be spinning on
+ */
+typedef enum spin_owner : uint8_t {
+    /**
+     * We don't know which thread it is, or the
+     * run page is not mapped, spin for a bounded time
+     */
+    SPIN_OWNER_UNKNOWN,
+
+    /**
+     * The thread is on a cpu, it is worth spinning on
+     */
+    SPIN_OWNER_RUNNING,
+
+    /**
+     * The thread is not on a cpu, it can't make progress
+     * until it gets one so park right away
+     */
+    SPIN_OWNER_PREEMPTED,
+} spin_owner_t;
+
+/**
+ * Map the run page of the kernel, must be called before the early syscalls are done
+ */
+err_t spin_init(void);
+
+/**
+ * The run slot of the current thread, the kernel keeps it in the TSC_AUX
+ */
+static inline uint32_t spin_self(void) {
+    return _rdpid_u32();
+}
+
+/**
+ * Check if the thread at the given run slot is on a cpu
+ */
+spin_owner_t spin_owner_get(uint32_t slot);
@@ -1,5 +1,6 @@
 #include "wasi.h"
 #include "alloc/alloc.h"
+#include "lib/clock.h"
 #include "lib/defs.h"
 #include "lib/list.h"
 #include "lib/log.h"
@@ -30,10 +31,30 @@ static wasi_errno_t wasi_clock_time_get(
 ) {
     wasi_timestamp_t result;
     switch (id) {
+        // both come from the clock page without entering the kernel
+        case WASI_CLOCKID_REALTIME:
+            result = clock_realtime_ns();
+            break;
+
         case WASI_CLOCKID_MONOTONIC:
-            result = tsc_to_ns(get_tsc());
+            result = clock_monotonic_ns();
             break;
 
+        // the cpu time of a process is that of all of its
+        // threads, which all share the scheduling group
+        case WASI_CLOCKID_PROCESS_CPUTIME_ID: {
+            wasm_proc_t* proc = wasm_current_proc(state_base);
+            sched_group_stats_t stats = {};
+            sys_sched_group_get_stats(proc->sched_group, &stats);
+            result = stats.cpu_time.user_ns + stats.cpu_time.kernel_ns;
+        } break;
+
+        case WASI_CLOCKID_THREAD_CPUTIME_ID: {
+            cpu_time_stats_t stats = {};
+            sys_thread_get_cpu_time(&stats);
+            result = stats.user_ns + stats.kernel_ns;
+        } break;
+
         default: 
             return WASI_ERRNO_INVAL;
     }
@@ -198,6 +219,66 @@ static bool wasi_event_set_errno(
     return !safe_copy(event, &data, sizeof(data));
 }
 
+/**
+ * Make the poll entry at the given index wait on the object, taking over the
+ * ref of the object, if the entry already waits on the same thing it is left
+ * as is, which is the common case of polling the same subscriptions in a loop
+ */
+static bool wasi_poll_register(wasm_state_t* state, size_t index, object_t* object, uint32_t signals) {
+    wasm_poll_entry_t* entry = &state->poll_entries[index];
+
+    if (index < state->poll_count) {
+        if (entry->object == object && entry->signals == signals) {
+            // the entry has its own ref
+            object_put(object);
+            return true;
+        }
+
+        // something else was polled in this spot last time
+        if (entry->object != nullptr) {
+            sys_wait_set_remove(state->poll_set, &entry->object->signals, index);
+            object_put(entry->object);
+        }
+    } else {
+        state->poll_count = index + 1;
+    }
+
+    entry->object = nullptr;
+
+    wait_entry_t wait = {
+        .key = &object->signals,
+        .key_size = WAIT_KEY_UINT32,
+        .mask = signals,
+        .waiters_bit = SIGNAL_HAS_WAITERS,
+    };
+    if (!sys_wait_set_add(state->poll_set, &wait, index)) {
+        object_put(object);
+        return false;
+    }
+
+    entry->object = object;
+    entry->signals = signals;
+    return true;
+}
+
+/**
+ * Drop the entries that were not used by the current poll
+ */
+static void wasi_poll_truncate(wasm_state_t* state, size_t count) {
+    for (size_t i = count; i < state->poll_count; i++) {
+        wasm_poll_entry_t* entry = &state->poll_entries[i];
+        if (entry->object != nullptr) {
+            sys_wait_set_remove(state->poll_set, &entry->object->signals, i);
+            object_put(entry->object);
+            entry->object = nullptr;
+        }
+    }
+
+    if (state->poll_count > count) {
+        state->poll_count = count;
+    }
+}
+
 static wasi_errno_t wasi_poll_oneoff(
     void* memory_base, void* state_base, 
     wasi_ptr_t in, wasi_ptr_t out, wasi_size_t nsubscriptions, 
@@ -211,34 +292,49 @@ static wasi_errno_t wasi_poll_oneoff(
         return WASI_ERRNO_INVAL;
     }
 
-    // allocate the wait entries
-    wait_entry_t* wait_entries = mem_calloc(sizeof(wait_entry_t), nsubscriptions);
-    if (wait_entries == nullptr) return WASI_ERRNO_NOMEM;
-    size_t wait_count = 0;
+    wasm_state_t* state = containerof(state_base, wasm_state_t, state);
+    wasm_proc_t* proc = state->proc;
+
+    // the wait set is created on the first poll of the thread
+    if (state->poll_set == INVALID_HANDLE) {
+        state->poll_set = sys_wait_set_create();
+        if (state->poll_set == INVALID_HANDLE) return WASI_ERRNO_NOMEM;
+    }
+
+    // there is at most a single entry per subscription
+    if (state->poll_capacity < nsubscriptions) {
+        wasm_poll_entry_t* entries = mem_realloc(state->poll_entries, sizeof(wasm_poll_entry_t) * nsubscriptions);
+        if (entries == nullptr) return WASI_ERRNO_NOMEM;
+        state->poll_entries = entries;
+        state->poll_capacity = nsubscriptions;
+    }
 
     // allocate the subscriptions, we want a copy so that we can't randomly 
     // fault when dealing with that data
     wasi_subscription_t* subscriptions = mem_calloc(sizeof(wasi_subscription_t), nsubscriptions);
     if (subscriptions == nullptr) return WASI_ERRNO_NOMEM;
 
-    // copy the subscriptions in a single transaction
-    if (!safe_copy(subscriptions, memory_base + in, sizeof(wasi_subscription_t) * nsubscriptions)) {
-        return WASI_ERRNO_FAULT;
-    }
-    
-    wasm_proc_t* proc = wasm_current_proc(state_base);
-
     // the events that we output
     wasi_size_t event_count = 0;
     wasi_event_t* events = memory_base + out;
 
+    // the entries used by this poll
+    size_t poll_count = 0;
+
+    // copy the subscriptions in a single transaction
+    if (!safe_copy(subscriptions, memory_base + in, sizeof(wasi_subscription_t) * nsubscriptions)) {
+        fault = true;
+        goto cleanup;
+    }
+
     // 
-    // Prepare all the waiters, this will potentially already find
-    // ready entries that we will return right away instead of going 
-    // to sleep
+    // Register all the objects in the wait set, objects that were polled
+    // the same way last time are already registered, this will potentially
+    // already find ready entries that we will return right away instead of
+    // going to sleep
     //
     uint64_t min_deadline = -1;
-    const wasi_subscription_t* deadline_sub;
+    const wasi_subscription_t* deadline_sub = nullptr;
     for (size_t i = 0; i < nsubscriptions; i++) {
         const wasi_subscription_t* sub = &subscriptions[i];
 
@@ -247,8 +343,8 @@ static wasi_errno_t wasi_poll_oneoff(
         // into a min deadline for the wait
         //
         if (sub->tag == WASI_EVENTTYPE_CLOCK) {
-            // TODO: for now we only support monotonic clock
-            if (sub->clock.id != WASI_CLOCKID_MONOTONIC) {
+            // TODO: for now we only support the monotonic and realtime clocks
+            if (sub->clock.id != WASI_CLOCKID_MONOTONIC && sub->clock.id != WASI_CLOCKID_REALTIME) {
                 fault = wasi_event_set_errno(
                     &events[event_count++], sub, 
                     WASI_ERRNO_INVAL
@@ -262,10 +358,12 @@ static wasi_errno_t wasi_poll_oneoff(
 
             // calculate the timeout for this clock
             uint64_t deadline;
-            if (sub->clock.flags & WASI_SUBCLOCKFLAGS_SUBSCRIPTION_CLOCK_ABSTIME) {
-                deadline = ns_to_tsc(sub->clock.timeout);
+            if ((sub->clock.flags & WASI_SUBCLOCKFLAGS_SUBSCRIPTION_CLOCK_ABSTIME) == 0) {
+                deadline = clock_ns_deadline(sub->clock.timeout);
+            } else if (sub->clock.id == WASI_CLOCKID_REALTIME) {
+                deadline = clock_realtime_to_tsc(sub->clock.timeout);
             } else {
-                deadline = tsc_ns_deadline(sub->clock.timeout);
+                deadline = clock_monotonic_to_tsc(sub->clock.timeout);
             }
             
             // if its smaller than the current deadline then use it
@@ -329,7 +427,7 @@ static wasi_errno_t wasi_poll_oneoff(
             if (!wasi_file_is_capable(file, right | WASI_RIGHTS_POLL_FD_READWRITE)) {
                 // the file is not capable for polling 
                 // on the given poll type
-                bool fault = wasi_event_set_errno(
+                fault = wasi_event_set_errno(
                     &events[event_count++], sub, 
                     WASI_ERRNO_NOTCAPABLE
                 );
@@ -343,52 +441,43 @@ static wasi_errno_t wasi_poll_oneoff(
             }
         }
 
-        // prepare for waiting
-        wait_entry_t* entry = &wait_entries[wait_count];
-        uint32_t signals = object_prepare_wait(
-            object, 
-            SIGNAL_CLOSED | SIGNAL_PEER_CLOSED | 
-            (is_read ? SIGNAL_READABLE : SIGNAL_WRITABLE), 
-            entry
-        );
+        // register the object, this takes over our ref
+        uint32_t signals = SIGNAL_CLOSED | SIGNAL_PEER_CLOSED | (is_read ? SIGNAL_READABLE : SIGNAL_WRITABLE);
+        size_t index = poll_count++;
+        if (!wasi_poll_register(state, index, object, signals)) {
+            status = WASI_ERRNO_NOMEM;
+            goto cleanup;
+        }
+        state->poll_entries[index].sub_index = i;
 
         // check if the signal was set
-        if (signals != 0) {
+        uint32_t pending = atomic_load_acquire(&object->signals);
+        if ((pending & signals) != 0) {
             // the signal is already set, move it to the 
             // ready output right away
-            bool fault = wasi_event_set_signal(
+            fault = wasi_event_set_signal(
                 &events[event_count++], 
                 sub, 
-                signals
+                pending
             );
 
-            // we need to close the object because it was 
-            // not added to the list
-            object_put(object);
-
             if (fault)
-                goto cleanup;            
-            else
-                continue;
+                goto cleanup;
         }
-
-        // remember the index
-        wait_count++;
-        entry->user_data = i;
     }
 
-    // as long as nothing is ready, wait on stuff
+    // objects polled last time but not now should not wake us
+    wasi_poll_truncate(state, poll_count);
+
+    // as long as nothing is ready, wait on the set
     while (event_count == 0) {
-        wait_status_t ws = sys_atomic_wait(wait_entries, wait_count, min_deadline);
-        if (ws == WAIT_STATUS_OUT_OF_MEMORY) {
-            status = WASI_ERRNO_NOMEM;
-            goto cleanup;
-        }
+        uint64_t ready[WAIT_SET_MAX_READY];
+        size_t ready_count = sys_wait_set_wait(state->poll_set, ready, ARRAY_LENGTH(ready), min_deadline);
 
         // if we are past the deadline then add it as an event
         // TODO: should we maybe do a full pass and find all the 
         //       timeouts we got instead? 
-        if (tsc_check_deadline(min_deadline)) {
+        if (deadline_sub != nullptr && tsc_check_deadline(min_deadline)) {
             fault = wasi_event_set_errno(
                 &events[event_count++], 
                 deadline_sub, 
@@ -399,43 +488,45 @@ static wasi_errno_t wasi_poll_oneoff(
                 goto cleanup;
         }
 
-        // go over the wait entries and see if anything changed
-        for (int i = 0; i < wait_count; i++) {
-            wait_entry_t* entry = &wait_entries[i];
-            wasi_subscription_t* sub = &subscriptions[entry->user_data];
+        // only the ready entries need to be checked
+        for (size_t i = 0; i < ready_count; i++) {
+            if (ready[i] >= poll_count) {
+                continue;
+            }
+
+            wasm_poll_entry_t* entry = &state->poll_entries[ready[i]];
+            if (entry->object == nullptr) {
+                continue;
+            }
 
             // check if the value has changed or we 
             // got a spurious wakeup
-            uint32_t signals = atomic_load_acquire((_Atomic(uint32_t)*)entry->key);
-            if (signals & entry->mask) {
+            uint32_t signals = atomic_load_acquire(&entry->object->signals);
+            if (signals & entry->signals) {
                 fault = wasi_event_set_signal(
                     &events[event_count++],
-                    sub, 
+                    &subscriptions[entry->sub_index], 
                     signals
                 );
 
                 if (fault)
                     goto cleanup;
-
-            } else {
-                // update the value since we saw the new stuff
-                entry->old = signals;
             }
         }
     }
 
 cleanup:
-    // remove the ref count of all the files we are waiting on
-    for (int i = 0; i < wait_count; i++) {
-        object_t* object = containerof(wait_entries[i].key, object_t, signals);
-        object_put(object);
-    }
+    // the objects stay registered for the next poll, only
+    // drop what was not used by this one
+    wasi_poll_truncate(state, poll_count);
 
-    // free the wait entries
-    mem_free(wait_entries);
+    // free the subscriptions
+    mem_free(subscriptions);
 
     // copy out the value
-    fault = !safe_copy(memory_base + retptr0, &event_count, sizeof(event_count));
+    if (!safe_copy(memory_base + retptr0, &event_count, sizeof(event_count))) {
+        fault = true;
+    }
 
     return fault ? WASI_ERRNO_FAULT : status;
 }
@@ -3,19 +3,31 @@
 #include "arch/intrin.h"
 #include "lib/assert.h"
 #include "lib/defs.h"
+#include "lib/atomic.h"
 #include "lib/except.h"
 #include "lib/list.h"
+#include "lib/clock.h"
 #include "lib/syscall.h"
+#include "lib/tsc.h"
 #include "proc/handle.h"
 #include "proc/object.h"
 #include "proc/proc.h"
 #include "runtime.h"
+#include "sync/condvar.h"
+#include "sync/mutex.h"
 #include "uapi/page.h"
 #include "uapi/syscall.h"
 #include "wasi/wasi.h"
 #include "wasi/wasip1.h"
 #include <stdint.h>
 
+/**
+ * The highest real-time priority a wasm thread may ask for, the priorities
+ * above it are kept for the runtime so a guest can't starve the threads
+ * that service it
+ */
+#define WASMATO_RT_PRIORITY_MAX     (SCHED_RT_PRIORITY_COUNT / 2 - 1)
+
 typedef struct kernel_object {
     object_t object;
 
@@ -23,6 +35,13 @@ typedef struct kernel_object {
      * The handle to the kernel object
      */
     uint64_t kernel_handle;
+
+    /**
+     * For interrupts, the amount of times the interrupt fired, kept up
+     * to date by the kernel, and whether the line is left unmasked
+     */
+    _Atomic(uint64_t) events;
+    bool auto_ack;
 } kernel_object_t;
 
 static void wasmato_kernel_object_free(object_t* obj) {
@@ -48,7 +67,26 @@ static wasi_ptr_t wasmato_map_phys(void* memory_base, void* state_base, uint64_t
     uint64_t aligned_base = ALIGN_DOWN(phys_base, PAGE_SIZE);
     size_t page_count = (phys_end - aligned_base) / PAGE_SIZE;
 
-    uint32_t wasm_addr = sys_mem_map_phys(memory_base, aligned_base, page_count) - memory_base;
+    void* ptr = sys_mem_map_phys(memory_base, aligned_base, page_count);
+    if (ptr == nullptr) {
+        return 0;
+    }
+    uint32_t wasm_addr = ptr - memory_base;
+
+    // memory can no longer grow over the mapping, if it already
+    // grew over it by the time we got here then we can't use it
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    mem_control_t current = { .packed = atomic_load_relaxed(proc->memory_control) };
+    mem_control_t new;
+    do {
+        new = current;
+        if ((uint64_t)current.accessible * MEM_CONTROL_UNIT > wasm_addr) {
+            sys_mem_unmap_phys(ptr, page_count);
+            return 0;
+        }
+        new.max = MIN(current.max, wasm_addr / MEM_CONTROL_UNIT);
+    } while (!atomic_compare_exchange_weak_relaxed(proc->memory_control, &current.packed, new.packed));
+
     return wasm_addr + (phys_base - aligned_base);
 }
 
@@ -85,24 +123,22 @@ static void wasmato_io_write_32(void* memory_base, void* state_base, uint16_t po
     __outdword(port, value);
 }
 
-static wasi_fd_t wasmato_irq_create_ioapic(void* memory_base, void* state_base, uint32_t irq) {
-    kernel_object_t* obj = mem_alloc(sizeof(*obj));
-    if (obj == nullptr) {
-        return -1;
-    }
-
-    // create the irq object, making it turn the object to be writable,
-    // aka, we can ack it
-    wake_params_t parmas = {
-        .key = &obj->object.signals,
-        .key_size = WAIT_KEY_UINT32,
-        .mask = SIGNAL_WRITABLE
-    };
-    uint64_t handle = sys_irq_create_ioapic(&parmas, irq, 0);
-    if (handle == INVALID_HANDLE) {
-        mem_free(obj);
-        return -1;
-    }
+/**
+ * Wrap a new kernel interrupt object, once fired the kernel makes the object
+ * writable, aka, we can ack it
+ */
+static wasi_fd_t wasmato_irq_finish(wasm_proc_t* proc, kernel_object_t* obj, uint64_t handle) {
+    // remember where the interrupts go, for placing threads next to them,
+    // the kernel might have picked the cpu
+    irq_stats_t stats = {};
+    sys_irq_get_stats(handle, &stats);
+    proc->irq_cpu = stats.cpu;
+
+    // have the kernel count the interrupts for us, so waiting
+    // for them can skip the syscall if one came in already
+    obj->events = 0;
+    obj->auto_ack = false;
+    sys_irq_set_mode(handle, IRQ_MODE_MASK, &obj->events);
 
     // finalize the object setup
     object_init(&obj->object);
@@ -118,7 +154,6 @@ static wasi_fd_t wasmato_irq_create_ioapic(void* memory_base, void* state_base,
     rights_t rights = RIGHT_WAIT | RIGHT_WRITE;
 
     // and finally create the handle itself
-    wasm_proc_t* proc = wasm_current_proc(state_base);
     return handle_table_allocate(
         &proc->handles, 
         &obj->object, 
@@ -126,6 +161,64 @@ static wasi_fd_t wasmato_irq_create_ioapic(void* memory_base, void* state_base,
     );
 }
 
+static wasi_fd_t wasmato_irq_create_ioapic(void* memory_base, void* state_base, uint32_t irq) {
+    kernel_object_t* obj = mem_alloc(sizeof(*obj));
+    if (obj == nullptr) {
+        return -1;
+    }
+
+    // create the irq object, making it turn the object to be writable,
+    // aka, we can ack it
+    wake_params_t parmas = {
+        .key = &obj->object.signals,
+        .key_size = WAIT_KEY_UINT32,
+        .mask = SIGNAL_WRITABLE,
+        .waiters_bit = SIGNAL_HAS_WAITERS,
+    };
+    uint64_t handle = sys_irq_create_ioapic(&parmas, irq, IRQ_CPU_ANY);
+    if (handle == INVALID_HANDLE) {
+        mem_free(obj);
+        return -1;
+    }
+
+    return wasmato_irq_finish(wasm_current_proc(state_base), obj, handle);
+}
+
+static wasi_fd_t wasmato_irq_create_msi(void* memory_base, void* state_base, uint32_t cpu, wasi_ptr_t message_ptr) {
+    // -1 lets the kernel pick the cpu
+    if (cpu != IRQ_CPU_ANY && cpu >= sys_sched_get_cpu_count()) {
+        return -1;
+    }
+
+    kernel_object_t* obj = mem_alloc(sizeof(*obj));
+    if (obj == nullptr) {
+        return -1;
+    }
+
+    // the vector is allocated on the requested cpu, and the message
+    // that targets it is returned for the driver to program the device
+    wake_params_t parmas = {
+        .key = &obj->object.signals,
+        .key_size = WAIT_KEY_UINT32,
+        .mask = SIGNAL_WRITABLE,
+        .waiters_bit = SIGNAL_HAS_WAITERS,
+    };
+    msi_message_t message = {};
+    uint64_t handle = sys_irq_create_msi(&parmas, cpu, &message);
+    if (handle == INVALID_HANDLE) {
+        mem_free(obj);
+        return -1;
+    }
+
+    if (!safe_copy(memory_base + message_ptr, &message, sizeof(message))) {
+        sys_handle_close(handle);
+        mem_free(obj);
+        return -1;
+    }
+
+    return wasmato_irq_finish(wasm_current_proc(state_base), obj, handle);
+}
+
 static wasi_errno_t wasmato_irq_unmask(void* memory_base, void* state_base, wasi_fd_t fd) {
     wasi_errno_t err = WASI_ERRNO_SUCCESS;
     
@@ -146,14 +239,289 @@ static wasi_errno_t wasmato_irq_unmask(void* memory_base, void* state_base, wasi
     // we are about to unmask it, clear the signal
     object_clear_signal(&ko->object, SIGNAL_WRITABLE);
 
-    // and actually clear it
-    sys_irq_unmask(ko->kernel_handle);
+    // and actually clear it, an auto-ack line was never masked
+    if (!ko->auto_ack) {
+        sys_irq_unmask(ko->kernel_handle);
+    }
+
+cleanup:
+    object_put(handle.object);
+    return err;
+}
+
+static wasi_errno_t wasmato_irq_get_stats(void* memory_base, void* state_base, wasi_fd_t fd, wasi_ptr_t stats_ptr) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    handle_t handle = handle_table_lookup(&proc->handles, fd);
+    if (handle.object == nullptr) {
+        return WASI_ERRNO_BADF;
+    }
+
+    CHECK_ERROR(handle.object->type == OBJECT_TYPE_INTERRUPT, WASI_ERRNO_INVAL);
+
+    kernel_object_t* ko = containerof(handle.object, kernel_object_t, object);
+    irq_stats_t stats = {};
+    sys_irq_get_stats(ko->kernel_handle, &stats);
+
+    CHECK_ERROR(safe_copy(memory_base + stats_ptr, &stats, sizeof(stats)), WASI_ERRNO_FAULT);
+
+cleanup:
+    object_put(handle.object);
+    return err;
+}
+
+static wasi_errno_t wasmato_irq_set_affinity(void* memory_base, void* state_base, wasi_fd_t fd, uint32_t cpu, wasi_ptr_t message_ptr) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    handle_t handle = handle_table_lookup(&proc->handles, fd);
+    if (handle.object == nullptr) {
+        return WASI_ERRNO_BADF;
+    }
+
+    // moving the interrupt is as much control over it as acking it
+    CHECK_ERROR(handle.object->type == OBJECT_TYPE_INTERRUPT, WASI_ERRNO_INVAL);
+    CHECK_ERROR(handle.rights & RIGHT_WRITE, WASI_ERRNO_NOTCAPABLE);
+    CHECK_ERROR(cpu == IRQ_CPU_ANY || cpu < sys_sched_get_cpu_count(), WASI_ERRNO_INVAL);
+
+    // an MSI gets the message to reprogram the device with,
+    // an io-apic line gets an empty one
+    kernel_object_t* ko = containerof(handle.object, kernel_object_t, object);
+    msi_message_t message = {};
+    irq_affinity_status_t status = sys_irq_set_affinity(ko->kernel_handle, cpu, &message);
+
+    // an auto-ack io-apic line can never be moved, unlike running out of
+    // vectors which might work on another cpu or later on
+    CHECK_ERROR(status != IRQ_AFFINITY_NOT_SUPPORTED, WASI_ERRNO_NOTSUP);
+    CHECK_ERROR(status == IRQ_AFFINITY_SUCCESS, WASI_ERRNO_NOSPC);
+
+    irq_stats_t stats = {};
+    sys_irq_get_stats(ko->kernel_handle, &stats);
+    proc->irq_cpu = stats.cpu;
+
+    CHECK_ERROR(safe_copy(memory_base + message_ptr, &message, sizeof(message)), WASI_ERRNO_FAULT);
 
 cleanup:
     object_put(handle.object);
     return err;
 }
 
+static wasi_errno_t wasmato_irq_set_auto_ack(void* memory_base, void* state_base, wasi_fd_t fd) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    handle_t handle = handle_table_lookup(&proc->handles, fd);
+    if (handle.object == nullptr) {
+        return WASI_ERRNO_BADF;
+    }
+
+    CHECK_ERROR(handle.object->type == OBJECT_TYPE_INTERRUPT, WASI_ERRNO_INVAL);
+    CHECK_ERROR(handle.rights & RIGHT_WRITE, WASI_ERRNO_NOTCAPABLE);
+
+    // the kernel refuses level triggered lines
+    kernel_object_t* ko = containerof(handle.object, kernel_object_t, object);
+    CHECK_ERROR(sys_irq_set_mode(ko->kernel_handle, IRQ_MODE_AUTO_ACK, &ko->events), WASI_ERRNO_NOTSUP);
+    ko->auto_ack = true;
+
+cleanup:
+    object_put(handle.object);
+    return err;
+}
+
+static wasi_errno_t wasmato_irq_wait(void* memory_base, void* state_base, wasi_fd_t fd, uint64_t seen, wasi_ptr_t count_ptr) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    handle_t handle = handle_table_lookup(&proc->handles, fd);
+    if (handle.object == nullptr) {
+        return WASI_ERRNO_BADF;
+    }
+
+    CHECK_ERROR(handle.object->type == OBJECT_TYPE_INTERRUPT, WASI_ERRNO_INVAL);
+    CHECK_ERROR(handle.rights & RIGHT_WAIT, WASI_ERRNO_NOTCAPABLE);
+
+    // only go to the kernel if nothing came in since
+    kernel_object_t* ko = containerof(handle.object, kernel_object_t, object);
+    uint64_t count = atomic_load_explicit(&ko->events, memory_order_acquire);
+    if (count == seen) {
+        wait_status_t status = sys_irq_wait(ko->kernel_handle, seen, -1, &count);
+        CHECK_ERROR(status != WAIT_STATUS_BUSY, WASI_ERRNO_BUSY);
+    }
+
+    CHECK_ERROR(safe_copy(memory_base + count_ptr, &count, sizeof(count)), WASI_ERRNO_FAULT);
+
+cleanup:
+    object_put(handle.object);
+    return err;
+}
+
+/**
+ * A counting event, what the acpid uses for its events
+ */
+typedef struct event_object {
+    object_t object;
+
+    /**
+     * Protects the counter, the waiters sleep on the condvar
+     */
+    mutex_t lock;
+    condvar_t cond;
+
+    /**
+     * The amount of signals not yet consumed by a wait
+     */
+    uint64_t counter;
+} event_object_t;
+
+static wasi_fd_t wasmato_event_create(void* memory_base, void* state_base) {
+    event_object_t* event = mem_alloc(sizeof(*event));
+    if (event == nullptr) {
+        return -1;
+    }
+
+    object_init(&event->object);
+    event->object.type = OBJECT_TYPE_EVENT;
+    event->lock = (mutex_t){};
+    event->cond = (condvar_t){};
+    event->counter = 0;
+
+    // The rights:
+    // - wait (required for waiting on it)
+    // - write (required for signaling and resetting it)
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    wasi_fd_t fd = handle_table_allocate(&proc->handles, &event->object, RIGHT_WAIT | RIGHT_WRITE);
+    if (fd < 0) {
+        object_put(&event->object);
+    }
+    return fd;
+}
+
+/**
+ * Wait until the event has a signal and consume it, a negative timeout
+ * waits forever and a zero timeout only checks
+ */
+static wasi_errno_t wasmato_event_wait(void* memory_base, void* state_base, wasi_fd_t fd, int64_t timeout) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    handle_t handle = handle_table_lookup(&proc->handles, fd);
+    if (handle.object == nullptr) {
+        return WASI_ERRNO_BADF;
+    }
+
+    CHECK_ERROR(handle.object->type == OBJECT_TYPE_EVENT, WASI_ERRNO_INVAL);
+    CHECK_ERROR(handle.rights & RIGHT_WAIT, WASI_ERRNO_NOTCAPABLE);
+
+    event_object_t* event = containerof(handle.object, event_object_t, object);
+    uint64_t deadline = timeout < 0 ? (uint64_t)-1 : clock_ns_deadline((uint64_t)timeout);
+
+    mutex_lock(&event->lock);
+    while (event->counter == 0) {
+        if (timeout == 0 || (deadline != (uint64_t)-1 && tsc_check_deadline(deadline))) {
+            err = WASI_ERRNO_TIMEDOUT;
+            break;
+        }
+        condvar_wait(&event->cond, &event->lock, deadline);
+    }
+    if (err == WASI_ERRNO_SUCCESS) {
+        event->counter--;
+    }
+    mutex_unlock(&event->lock);
+
+cleanup:
+    object_put(handle.object);
+    return err;
+}
+
+/**
+ * Add signals to the event, a single signal wakes a single waiter, more
+ * wake all of them and they take the signals one at a time as they get
+ * the lock
+ */
+static wasi_errno_t wasmato_event_signal(void* memory_base, void* state_base, wasi_fd_t fd, uint32_t count) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    handle_t handle = handle_table_lookup(&proc->handles, fd);
+    if (handle.object == nullptr) {
+        return WASI_ERRNO_BADF;
+    }
+
+    CHECK_ERROR(handle.object->type == OBJECT_TYPE_EVENT, WASI_ERRNO_INVAL);
+    CHECK_ERROR(handle.rights & RIGHT_WRITE, WASI_ERRNO_NOTCAPABLE);
+
+    event_object_t* event = containerof(handle.object, event_object_t, object);
+    mutex_lock(&event->lock);
+    event->counter += count;
+    if (count == 1) {
+        condvar_signal(&event->cond);
+    } else if (count > 1) {
+        condvar_broadcast(&event->cond);
+    }
+    mutex_unlock(&event->lock);
+
+cleanup:
+    object_put(handle.object);
+    return err;
+}
+
+/**
+ * Drop all the signals that were not consumed yet
+ */
+static wasi_errno_t wasmato_event_reset(void* memory_base, void* state_base, wasi_fd_t fd) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    handle_t handle = handle_table_lookup(&proc->handles, fd);
+    if (handle.object == nullptr) {
+        return WASI_ERRNO_BADF;
+    }
+
+    CHECK_ERROR(handle.object->type == OBJECT_TYPE_EVENT, WASI_ERRNO_INVAL);
+    CHECK_ERROR(handle.rights & RIGHT_WRITE, WASI_ERRNO_NOTCAPABLE);
+
+    event_object_t* event = containerof(handle.object, event_object_t, object);
+    mutex_lock(&event->lock);
+    event->counter = 0;
+    mutex_unlock(&event->lock);
+
+cleanup:
+    object_put(handle.object);
+    return err;
+}
+
+static wasi_errno_t wasmato_thread_set_sched(void* memory_base, void* state_base, uint32_t sched_class, uint32_t priority) {
+    wasi_errno_t err = WASI_ERRNO_SUCCESS;
+
+    CHECK_ERROR(sched_class <= SCHED_CLASS_IDLE, WASI_ERRNO_INVAL);
+    CHECK_ERROR(priority <= UINT8_MAX, WASI_ERRNO_INVAL);
+    if (sched_class == SCHED_CLASS_REALTIME) {
+        CHECK_ERROR(priority <= WASMATO_RT_PRIORITY_MAX, WASI_ERRNO_PERM);
+    }
+
+    // the kernel validates the priority range of the class
+    sched_param_t param = {
+        .sched_class = sched_class,
+        .priority = priority,
+    };
+    CHECK_ERROR(sys_thread_set_sched(&param), WASI_ERRNO_INVAL);
+
+cleanup:
+    return err;
+}
+
+static wasi_errno_t wasmato_thread_set_placement(void* memory_base, void* state_base, uint32_t placement) {
+    if (placement > WASM_THREAD_PLACEMENT_FOLLOW_IRQ) {
+        return WASI_ERRNO_INVAL;
+    }
+
+    // only applies to threads created from now on
+    wasm_proc_t* proc = wasm_current_proc(state_base);
+    proc->placement = placement;
+    return WASI_ERRNO_SUCCESS;
+}
+
 static const runtime_function_t m_wasmato_acpid_functions[] = {
     RUNTIME_FUNCTION(wasmato, acpi_get_rsdp, I64),
 
@@ -169,7 +537,20 @@ static const runtime_function_t m_wasmato_acpid_functions[] = {
     RUNTIME_FUNCTION(wasmato, io_write_32, INVALID, I32, I32),
 
     RUNTIME_FUNCTION(wasmato, irq_create_ioapic, I32, I32),
+    RUNTIME_FUNCTION(wasmato, irq_create_msi, I32, I32, I32),
     RUNTIME_FUNCTION(wasmato, irq_unmask, INVALID, I32),
+    RUNTIME_FUNCTION(wasmato, irq_get_stats, I32, I32, I32),
+    RUNTIME_FUNCTION(wasmato, irq_set_affinity, I32, I32, I32, I32),
+    RUNTIME_FUNCTION(wasmato, irq_set_auto_ack, I32, I32),
+    RUNTIME_FUNCTION(wasmato, irq_wait, I32, I32, I64, I32),
+
+    RUNTIME_FUNCTION(wasmato, event_create, I32),
+    RUNTIME_FUNCTION(wasmato, event_wait, I32, I32, I64),
+    RUNTIME_FUNCTION(wasmato, event_signal, I32, I32, I32),
+    RUNTIME_FUNCTION(wasmato, event_reset, I32, I32),
+
+    RUNTIME_FUNCTION(wasmato, thread_set_sched, I32, I32, I32),
+    RUNTIME_FUNCTION(wasmato, thread_set_placement, I32, I32),
 };
 
 void* wasmato_resolve_import(const char* name, wasm_proc_t* proc, wasm_type_t* type) {